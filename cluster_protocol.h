@@ -0,0 +1,44 @@
+/* Protocol between the coordinator and the workers of estimate_pi_cluster. */
+
+#ifndef __CLUSTER_PROTOCOL_H__
+#define __CLUSTER_PROTOCOL_H__
+
+#include <cstdint>
+
+/**
+ * Fixed-size messages over TCP, in the byte order of the nodes, which
+ * must agree: a message whose magic does not match closes the
+ * connection. A worker asks for work with CLUSTER_REQUEST, one lease per
+ * request; the coordinator answers with CLUSTER_LEASE, a range of chunks
+ * of the run, or CLUSTER_DONE once every chunk is counted. Requests that
+ * find no chunk to lease wait in the coordinator until chunks come back
+ * or the run is done. The worker sends one CLUSTER_RESULT per chunk.
+ */
+#define CLUSTER_MAGIC 0x49504543u // "CEPI"
+#define CLUSTER_VERSION 1
+
+enum ClusterType
+{
+    CLUSTER_REQUEST = 0,          // num_chunks: how many the worker wants
+    CLUSTER_LEASE = 1,            // first_chunk, num_chunks of the run
+    CLUSTER_RESULT = 2,           // first_chunk: the chunk, hits
+    CLUSTER_DONE = 3
+};
+
+struct ClusterMessage
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t type;                // ClusterType
+    uint32_t seed;                // of the run
+    uint32_t lease_ms;            // the lease ends this long after it is granted
+    uint64_t lease;               // id, chosen by the coordinator
+    int64_t num_samples;          // of the run, the last chunk may be partial
+    int64_t first_chunk;
+    int64_t num_chunks;
+    int64_t hits;
+};
+
+static_assert(sizeof(ClusterMessage) == 56, "ClusterMessage layout");
+
+#endif /* EOF */
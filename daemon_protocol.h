@@ -0,0 +1,66 @@
+/* Binary protocol of estimate_pi_daemon over a Unix domain socket. */
+
+#ifndef __DAEMON_PROTOCOL_H__
+#define __DAEMON_PROTOCOL_H__
+
+#include <cstdint>
+
+/**
+ * A client writes requests and reads responses, both fixed-size records
+ * in host byte order (the socket is local). Requests may be pipelined;
+ * the requests that arrive together are admitted as one batch, where
+ * those of the same backend, seed, samples and priority share a single
+ * estimate and get the same response under their own ids.
+ * Responses come as the estimates finish, not in request order, and
+ * carry the id of their request.
+ */
+#define DAEMON_MAGIC 0x49504544u  // "DEPI"
+#define DAEMON_VERSION 1
+
+enum DaemonBackend
+{
+    DAEMON_CPU = 0,
+    DAEMON_OPENCL = 1
+};
+
+enum DaemonStatus
+{
+    DAEMON_OK = 0,
+    DAEMON_BUSY = 1,              // admission control, retry later
+    DAEMON_INVALID = 2,           // bad magic, version, backend or samples
+    DAEMON_FAILED = 3,            // the engine failed
+    DAEMON_NO_BACKEND = 4         // the daemon runs without this backend
+};
+
+struct DaemonRequest
+{
+    uint32_t magic;
+    uint16_t version;
+    uint8_t backend;              // DaemonBackend
+    int8_t priority;              // higher first, 0 by default
+    uint32_t id;                  // chosen by the client
+    uint32_t seed;
+    int64_t samples;
+};
+
+struct DaemonResponse
+{
+    uint32_t magic;
+    uint32_t id;
+    int32_t status;               // DaemonStatus
+    uint32_t reserved;
+    int64_t samples;              // rounded up by the OpenCL backend
+    int64_t hits;
+    double pi;
+    double ci95;
+    // Request read -> estimate done, in the daemon.
+    double server_us;
+    // Of the engine: waiting for and running the chunks, and all of it.
+    double compute_us;
+    double total_us;
+};
+
+static_assert(sizeof(DaemonRequest) == 24, "DaemonRequest layout");
+static_assert(sizeof(DaemonResponse) == 72, "DaemonResponse layout");
+
+#endif /* EOF */
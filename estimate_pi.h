@@ -0,0 +1,78 @@
+/* C API of libestimatepi. */
+
+#ifndef __ESTIMATE_PI_H__
+#define __ESTIMATE_PI_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define EPI_API_VERSION 2
+
+typedef struct epi_estimator epi_estimator;
+typedef struct epi_cancel epi_cancel;
+
+typedef struct epi_result
+{
+    int64_t samples;
+    int64_t hits;
+    double pi;
+    double ci95;                  /* half width of the 95% interval */
+    double setup_ms;
+    double compute_ms;
+    double reduce_ms;
+    double total_ms;
+    int cancelled;                /* partial counts of the chunks done */
+} epi_result;
+
+/*
+ * Completion of epi_submit(), on a thread of the estimator: status is 0
+ * on success, -1 on failure.
+ */
+typedef void (*epi_callback)(int status, const epi_result* result, void* user);
+
+/* Version of this API the library implements, EPI_API_VERSION. */
+int epi_api_version(void);
+
+/* An estimator on num_threads CPU threads, NULL on failure. */
+epi_estimator* epi_cpu_create(int num_threads);
+
+/*
+ * An estimator on OpenCL GPU device_index (from 1) running kernel from
+ * the sources in source_dir. NULL on failure, with the reason in error
+ * (error_size bytes, may be NULL). Needs libestimatepi_opencl.
+ */
+epi_estimator* epi_opencl_create(int device_index, const char* kernel, const char* source_dir,
+                                 char* error, int error_size);
+
+/*
+ * Estimate pi from samples samples of the sequence of seed. Returns 0 on
+ * success, -1 on failure with the reason in epi_error().
+ */
+int epi_run(epi_estimator* estimator, int64_t samples, uint32_t seed, epi_result* result);
+
+/*
+ * Start an estimate and return at once; done(user) is called when it is
+ * over. cancel may be NULL. Returns 0 if submitted, -1 if rejected, with
+ * the reason in epi_error() and without calling done.
+ */
+int epi_submit(epi_estimator* estimator, int64_t samples, uint32_t seed, epi_cancel* cancel,
+               epi_callback done, void* user);
+
+/* A cancellation token for any number of submissions. */
+epi_cancel* epi_cancel_create(void);
+void epi_cancel_request(epi_cancel* cancel);
+void epi_cancel_destroy(epi_cancel* cancel);
+
+/* Valid until the next epi_error() on estimator. */
+const char* epi_error(const epi_estimator* estimator);
+
+void epi_destroy(epi_estimator* estimator);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* EOF */
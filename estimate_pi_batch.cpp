@@ -0,0 +1,620 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace std;
+using namespace chrono;
+
+#include "estimator.h"
+#ifndef DISABLE_OPENCL
+#include "estimator_opencl.h"
+#endif
+#include "governor.h"
+#include "stats.h"
+
+static void usage()
+{
+    fprintf(stdout, "usage: estimate_pi_batch jobs_file [--out file] [--threads n] [--inflight n] [--source dir]\n"
+                    "\n"
+                    "jobs_file has one JSON object per line, \"-\" for stdin:\n"
+                    "  {\"id\": \"a1\", \"samples\": 100000000, \"seed\": 42, \"replica\": 0, \"engine\": \"cpu\"}\n"
+                    "engine is cpu (default), inline or opencl:device_index:kernel.\n");
+    exit(1);
+}
+
+static double ms_since(steady_clock::time_point start)
+{
+    return duration<double, milli>(steady_clock::now() - start).count();
+}
+
+//------------------------------------------------------------------------------
+
+static string json_string(const string& s)
+{
+    string out = "\"";
+    for (char c : s)
+    {
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += c;
+        }
+        else if ((unsigned char)c < 0x20)
+        {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", (unsigned char)c);
+            out += buf;
+        }
+        else
+        {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+// End of the string token starting at quote s[begin], npos if unterminated.
+static size_t string_end(const string& s, size_t begin)
+{
+    for (size_t i = begin + 1; i < s.size(); i++)
+    {
+        if (s[i] == '\\')
+            i++;
+        else if (s[i] == '"')
+            return i + 1;
+    }
+    return string::npos;
+}
+
+// Value of a string token without the quotes and escapes. \u escapes are
+// kept as they are, names and ids need none.
+static string unquote(const string& token)
+{
+    string out;
+    for (size_t i = 1; i + 1 < token.size(); i++)
+    {
+        char c = token[i];
+        if (c == '\\' && i + 2 < token.size())
+        {
+            c = token[++i];
+            if (c == 'u')
+                out += '\\';
+            else if (c == 'n' || c == 't' || c == 'r')
+                c = c == 'n' ? '\n' : c == 't' ? '\t' : '\r';
+        }
+        out += c;
+    }
+    return out;
+}
+
+/**
+ * Members of a flat JSON object, each value as its JSON text: strings
+ * keep their quotes so that they can be written back as they came.
+ * Nested objects and arrays are not supported.
+ */
+static bool parse_object(const string& line, map<string, string>& members, string& error)
+{
+    size_t i = 0;
+    auto skip = [&] {
+        while (i < line.size() && strchr(" \t\r\n", line[i]))
+            i++;
+    };
+    skip();
+    if (i >= line.size() || line[i++] != '{')
+    {
+        error = "expected an object";
+        return false;
+    }
+    skip();
+    if (i < line.size() && line[i] == '}')
+        return true;
+    for (;;)
+    {
+        skip();
+        size_t end = i < line.size() && line[i] == '"' ? string_end(line, i) : string::npos;
+        if (end == string::npos)
+        {
+            error = "expected a member name";
+            return false;
+        }
+        string name = unquote(line.substr(i, end - i));
+        i = end;
+        skip();
+        if (i >= line.size() || line[i++] != ':')
+        {
+            error = "expected ':' after " + name;
+            return false;
+        }
+        skip();
+        if (i < line.size() && line[i] == '"')
+        {
+            end = string_end(line, i);
+        }
+        else if (i < line.size() && (line[i] == '{' || line[i] == '['))
+        {
+            error = "nested values are not supported, in " + name;
+            return false;
+        }
+        else
+        {
+            end = i;
+            while (end < line.size() && !strchr(",} \t\r\n", line[end]))
+                end++;
+            end = end > i ? end : string::npos;
+        }
+        if (end == string::npos)
+        {
+            error = "bad value of " + name;
+            return false;
+        }
+        members[name] = line.substr(i, end - i);
+        i = end;
+        skip();
+        if (i < line.size() && line[i] == ',')
+        {
+            i++;
+            continue;
+        }
+        if (i < line.size() && line[i] == '}')
+            return true;
+        error = "expected ',' or '}'";
+        return false;
+    }
+}
+
+static bool parse_integer(const string& token, long long min, long long max, long long& value)
+{
+    char* end;
+    value = strtoll(token.c_str(), &end, 10);
+    return !token.empty() && *end == 0 && value >= min && value <= max;
+}
+
+//------------------------------------------------------------------------------
+
+/**
+ * One estimate asked for: replica of the run of samples and seed on
+ * engine. Jobs only differing in consecutive replicas are computed
+ * together.
+ */
+struct Job
+{
+    int line;
+    string id;                    // JSON text, the line number if none
+    string engine;                // opencl:D for all the kernels of device D
+    string kernel;                // OpenCL variant, empty for the CPU
+    int64_t samples;
+    uint32_t seed;
+    int replica;
+    string error;                 // of the spec
+};
+
+static Job parse_job(const string& text, int line)
+{
+    Job job;
+    job.line = line;
+    job.id = to_string(line);
+    job.engine = "cpu";
+    job.samples = 0;
+    job.seed = DEFAULT_SEED;
+    job.replica = 0;
+    map<string, string> members;
+    if (!parse_object(text, members, job.error))
+        return job;
+    long long value;
+    for (const auto& m : members)
+    {
+        if (m.first == "id")
+            job.id = m.second;
+        else if (m.first == "engine" && m.second[0] == '"')
+            job.engine = unquote(m.second);
+        else if (m.first == "samples" && parse_integer(m.second, 1, INT64_MAX, value))
+            job.samples = value;
+        else if (m.first == "seed" && parse_integer(m.second, 0, UINT32_MAX, value))
+            job.seed = (uint32_t)value;
+        else if (m.first == "replica" && parse_integer(m.second, 0, INT32_MAX - 1, value))
+            job.replica = (int)value;
+        else
+            job.error = "bad " + m.first;
+    }
+    if (job.error.empty() && job.samples == 0)
+        job.error = "samples missing";
+    if (job.engine.compare(0, 7, "opencl:") == 0)
+    {
+        size_t colon = job.engine.find(':', 7);
+        if (colon == string::npos)
+            job.error = "engine must be opencl:device_index:kernel";
+        else
+            job.kernel = job.engine.substr(colon + 1);
+        job.engine = job.engine.substr(0, colon);
+    }
+    return job;
+}
+
+/**
+ * An engine shared by all the jobs naming it, created on the setup thread
+ * ahead of its first job. An OpenCL session serves every kernel variant
+ * of its device, on two queues so that a run computes while the previous
+ * one is read back.
+ */
+struct Engine
+{
+    string name;
+    string kernel;                // built first, of the first job
+    unique_ptr<Estimator> estimator;
+    string error;
+    int64_t parallel;             // threads or work items
+    double setup_ms;
+    promise<void> created;
+    shared_future<void> ready;
+    // Totals of its groups, under the output lock
+    int jobs;
+    int groups;
+    double compute_ms;            // of the threads or the device
+};
+
+static void create_engine(Engine& e, CpuEstimator* pool, int threads, const char* source_dir)
+{
+    auto start = steady_clock::now();
+    if (e.name == "inline")
+    {
+        e.estimator.reset(new CpuEstimator(0));
+        e.parallel = 1;
+    }
+    else if (e.name == "cpu")
+    {
+        // Owned by main(), shared by every cpu job.
+        e.parallel = pool ? threads : 0;
+    }
+#ifndef DISABLE_OPENCL
+    else if (e.name.compare(0, 7, "opencl:") == 0)
+    {
+        int device_index = 0;
+        vector<cl_device_id> devices;
+        if (sscanf(e.name.c_str(), "opencl:%d", &device_index) != 1)
+        {
+            e.error = "Unknown engine " + e.name;
+        }
+        else if (OpenCLEstimator::listDevices(devices, e.error))
+        {
+            if (device_index <= 0 || device_index > (int)devices.size())
+            {
+                e.error = "Invalid device_index!";
+            }
+            else
+            {
+                unique_ptr<OpenCLEstimator> opencl(new OpenCLEstimator);
+                if (opencl->create(devices[device_index - 1], e.kernel.c_str(), source_dir, N_THREADS, false, 2))
+                {
+                    e.parallel = (int64_t)opencl->globalWorkSize();
+                    e.estimator.reset(opencl.release());
+                }
+                else
+                {
+                    e.error = opencl->error();
+                }
+            }
+        }
+    }
+#endif
+    else
+    {
+        e.error = "Unknown engine " + e.name;
+    }
+    (void)source_dir;
+    e.setup_ms = ms_since(start);
+    e.created.set_value();
+}
+
+/**
+ * Jobs of one engine, samples and seed, computed as a single run of the
+ * replicas [first_replica, first_replica + replicas) they ask for. A gap
+ * between the replicas asked for starts another group, so that no replica
+ * is computed that no job wants.
+ */
+struct Group
+{
+    int engine;
+    string kernel;
+    int64_t samples;
+    uint32_t seed;
+    int first_replica;
+    int replicas;
+    vector<int> jobs;
+};
+
+/**
+ * Writes the results as JSONL in the order the groups complete and keeps
+ * the number of groups in flight and of jobs that failed.
+ */
+class Output
+{
+    FILE* out_;
+    mutex mutex_;
+    condition_variable done_;
+    int in_flight_;
+    int failed_;
+    steady_clock::time_point start_;
+public:
+    Output(FILE* out, steady_clock::time_point start) : out_(out), in_flight_(0), failed_(0), start_(start)
+    {
+    }
+    steady_clock::time_point start() const
+    {
+        return start_;
+    }
+    int failed()
+    {
+        lock_guard<mutex> lock(mutex_);
+        return failed_;
+    }
+    void error(const Job& job, const string& error)
+    {
+        lock_guard<mutex> lock(mutex_);
+        failed_++;
+        fprintf(out_, "{\"id\": %s, \"line\": %d, \"error\": %s}\n", job.id.c_str(), job.line,
+                json_string(error).c_str());
+        fflush(out_);
+    }
+    // Wait until fewer than max_in_flight groups run, then count one more.
+    void begin(int max_in_flight)
+    {
+        unique_lock<mutex> lock(mutex_);
+        done_.wait(lock, [&] { return in_flight_ < max_in_flight; });
+        in_flight_++;
+    }
+    void end(const vector<Job>& jobs, const Group& group, int group_index, Engine& engine, double queued_ms,
+             const EstimateResult& r)
+    {
+        lock_guard<mutex> lock(mutex_);
+        double done_ms = ms_since(start_);
+        if (r.error.empty())
+        {
+            engine.jobs += (int)group.jobs.size();
+            engine.groups++;
+            engine.compute_ms += r.busy_ms > 0 && engine.parallel > 0 ? r.busy_ms / engine.parallel
+                                                                        : r.phase_ms[HISTORY_COMPUTE];
+        }
+        // The stream decomposition of the run: replica r draws unit u from
+        // jump id r * count + u, chunks on the CPU, work items on a device,
+        // where all but a lone replica 0 run the ensemble kernel.
+        bool opencl = !group.kernel.empty();
+        bool ensemble = group.replicas > 1 || group.first_replica > 0;
+        string name = opencl ? engine.name + ":" + group.kernel + (ensemble ? "_ensemble" : "") : engine.name;
+        int64_t count = opencl ? engine.parallel : (r.samples + CHUNK_SAMPLES - 1) / CHUNK_SAMPLES;
+        int64_t size = opencl ? r.samples / max(engine.parallel, (int64_t)1) : CHUNK_SAMPLES;
+        for (int j : group.jobs)
+        {
+            const Job& job = jobs[j];
+            if (!r.error.empty())
+            {
+                failed_++;
+                fprintf(out_, "{\"id\": %s, \"line\": %d, \"error\": %s}\n", job.id.c_str(), job.line,
+                        json_string(r.error).c_str());
+                continue;
+            }
+            int64_t hits = r.replica_hits[job.replica - group.first_replica];
+            double pi = pi_estimate(hits, r.samples);
+            fprintf(out_,
+                    "{\"id\": %s, \"engine\": %s, \"samples\": %lld, \"seed\": %u, \"replica\": %d, "
+                    "\"hits\": %lld, \"pi\": %.9f, \"ci95\": %.9f, "
+                    "\"group\": %d, \"group_jobs\": %d, \"replicas\": %d, "
+                    "\"decomposition\": {\"unit\": \"%s\", \"count\": %lld, \"samples_per_unit\": %lld, "
+                    "\"first_stream\": %lld}, "
+                    "\"timings\": {\"queued_ms\": %.3f, \"setup_ms\": %.3f, \"compute_ms\": %.3f, "
+                    "\"reduce_ms\": %.3f, \"total_ms\": %.3f, \"done_ms\": %.3f}}\n",
+                    job.id.c_str(), json_string(name).c_str(), (long long)r.samples, job.seed, job.replica,
+                    (long long)hits, pi, pi_ci95(hits, r.samples), group_index, (int)group.jobs.size(),
+                    group.replicas, opencl ? "work_item" : "chunk", (long long)count, (long long)size,
+                    (long long)(job.replica * count), queued_ms, r.phase_ms[HISTORY_SETUP],
+                    r.phase_ms[HISTORY_COMPUTE], r.phase_ms[HISTORY_REDUCE], r.phase_ms[HISTORY_TOTAL], done_ms);
+        }
+        fflush(out_);
+        in_flight_--;
+        done_.notify_all();
+    }
+    void wait_all()
+    {
+        unique_lock<mutex> lock(mutex_);
+        done_.wait(lock, [&] { return in_flight_ == 0; });
+    }
+};
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2)
+        usage();
+    const char* jobs_file = argv[1];
+    const char* out_file = nullptr;
+    int threads = detect_cpu_limits().effective;
+    int max_in_flight = 0;
+    const char* source_dir = "..";
+    for (int i = 2; i < argc; i++)
+    {
+        if (i + 1 >= argc)
+            usage();
+        if (strcmp(argv[i], "--out") == 0)
+            out_file = argv[++i];
+        else if (strcmp(argv[i], "--threads") == 0)
+            threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--inflight") == 0)
+            max_in_flight = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--source") == 0)
+            source_dir = argv[++i];
+        else
+            usage();
+    }
+    if (threads <= 0 || max_in_flight < 0)
+        usage();
+    // Enough runs queued for the threads to go from one to the next
+    // without waiting for the main thread.
+    if (max_in_flight == 0)
+        max_in_flight = 2 * threads + 2;
+
+    FILE* in = strcmp(jobs_file, "-") == 0 ? stdin : fopen(jobs_file, "r");
+    if (!in)
+    {
+        fprintf(stderr, "Can not open %s\n", jobs_file);
+        return EXIT_FAILURE;
+    }
+    FILE* out = out_file ? fopen(out_file, "w") : stdout;
+    if (!out)
+    {
+        fprintf(stderr, "Can not write %s\n", out_file);
+        return EXIT_FAILURE;
+    }
+
+    auto start = steady_clock::now();
+    Output output(out, start);
+    vector<Job> jobs;
+    {
+        string text;
+        char buf[4096];
+        int line = 0;
+        while (fgets(buf, sizeof(buf), in))
+        {
+            text += buf;
+            if (text.back() != '\n' && !feof(in))
+                continue;
+            line++;
+            if (text.find_first_not_of(" \t\r\n") != string::npos)
+            {
+                Job job = parse_job(text, line);
+                if (job.error.empty())
+                    jobs.push_back(job);
+                else
+                    output.error(job, job.error);
+            }
+            text.clear();
+        }
+        if (in != stdin)
+            fclose(in);
+    }
+
+    // Group the jobs in the order they first appear, and the engines in
+    // the order of their first job.
+    vector<unique_ptr<Engine> > engines;
+    map<string, int> engine_index;
+    vector<Group> groups;
+    vector<vector<int> > runs;              // jobs of each run of samples and seed
+    map<string, int> run_index;
+    for (size_t j = 0; j < jobs.size(); j++)
+    {
+        const Job& job = jobs[j];
+        auto e = engine_index.find(job.engine);
+        if (e == engine_index.end())
+        {
+            unique_ptr<Engine> engine(new Engine);
+            engine->name = job.engine;
+            engine->kernel = job.kernel;
+            engine->parallel = 0;
+            engine->setup_ms = 0;
+            engine->ready = engine->created.get_future().share();
+            engine->jobs = 0;
+            engine->groups = 0;
+            engine->compute_ms = 0;
+            e = engine_index.insert(make_pair(job.engine, (int)engines.size())).first;
+            engines.push_back(std::move(engine));
+        }
+        string key = job.engine + ":" + job.kernel + " " + to_string(job.samples) + " " + to_string(job.seed);
+        auto r = run_index.find(key);
+        if (r == run_index.end())
+        {
+            r = run_index.insert(make_pair(key, (int)runs.size())).first;
+            runs.push_back(vector<int>());
+        }
+        runs[r->second].push_back((int)j);
+    }
+    // Split each run into groups of consecutive replicas.
+    for (auto& run : runs)
+    {
+        stable_sort(run.begin(), run.end(), [&](int a, int b) { return jobs[a].replica < jobs[b].replica; });
+        for (int j : run)
+        {
+            const Job& job = jobs[j];
+            if (j == run[0] || job.replica > groups.back().first_replica + groups.back().replicas)
+            {
+                Group group;
+                group.engine = engine_index[job.engine];
+                group.kernel = job.kernel;
+                group.samples = job.samples;
+                group.seed = job.seed;
+                group.first_replica = job.replica;
+                group.replicas = 0;
+                groups.push_back(group);
+            }
+            Group& group = groups.back();
+            group.replicas = job.replica - group.first_replica + 1;
+            group.jobs.push_back(j);
+        }
+    }
+
+    // The CPU pool is shared by the cpu jobs; the other engines are set up
+    // one after the other on a thread of their own while the first groups
+    // compute.
+    bool uses_pool = engine_index.count("cpu") > 0;
+    unique_ptr<CpuEstimator> pool(uses_pool ? new CpuEstimator(threads) : nullptr);
+    if (pool)
+        pool->setBudget(detect_cpu_limits().budget);
+    thread setup([&] {
+        for (auto& e : engines)
+            create_engine(*e, pool.get(), threads, source_dir);
+    });
+
+    for (size_t g = 0; g < groups.size(); g++)
+    {
+        const Group& group = groups[g];
+        Engine& engine = *engines[group.engine];
+        engine.ready.wait();
+        Estimator* estimator = engine.name == "cpu" ? pool.get() : engine.estimator.get();
+        if (!estimator)
+        {
+            for (int j : group.jobs)
+                output.error(jobs[j], engine.error);
+            continue;
+        }
+        output.begin(max_in_flight);
+        double queued_ms = ms_since(start);
+        EstimateOptions options;
+        options.first_replica = group.first_replica;
+        options.replicas = group.replicas;
+        options.kernel = group.kernel;
+        int index = (int)g;
+        bool ok = estimator->submit(group.samples, group.seed, options, [&, index, queued_ms](const EstimateResult& r) {
+            output.end(jobs, groups[index], index, *engines[groups[index].engine], queued_ms, r);
+        });
+        if (!ok)
+        {
+            EstimateResult r;
+            r.error = estimator->error();
+            output.end(jobs, group, index, engine, queued_ms, r);
+        }
+    }
+    output.wait_all();
+    setup.join();
+    double wall_ms = ms_since(start);
+
+    double compute_ms = 0;
+    fprintf(stderr, "%-24s %8s %8s %12s %12s\n", "engine", "jobs", "groups", "setup ms", "compute ms");
+    for (auto& e : engines)
+    {
+        fprintf(stderr, "%-24s %8d %8d %12.3f %12.3f%s%s\n", e->name.c_str(), e->jobs, e->groups, e->setup_ms,
+                e->compute_ms, e->error.empty() ? "" : "  ", e->error.c_str());
+        compute_ms += e->compute_ms;
+    }
+    int failed = output.failed();
+    fprintf(stderr, "jobs = %d, groups = %d, failed = %d, wall = %.3fms, compute = %.3fms, overhead = %.3fms\n",
+            (int)jobs.size(), (int)groups.size(), failed, wall_ms, compute_ms, wall_ms - compute_ms);
+    if (out != stdout)
+        fclose(out);
+    return failed > 0 ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,251 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <random>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <vector>
+using namespace std;
+using namespace chrono;
+
+#include "pi_cpu.h"
+#include "stats.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#elif defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#define HAVE_TSC 1
+#endif
+
+static void usage()
+{
+    fprintf(stdout, "usage: estimate_pi_bench [--threads n] [--reps n] [--warmup n] [--filter name] [--json file]\n");
+    exit(1);
+}
+
+// Reference cycles of the time stamp counter, 0 where there is none.
+static uint64_t ticks()
+{
+#if HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Results are written here so that the measured loops are not removed.
+static volatile uint64_t sink;
+
+struct Benchmark
+{
+    string name;
+    const char* unit;      // what one operation is
+    int64_t ops;           // operations per repetition
+    function<void()> body;
+};
+
+struct Measurement
+{
+    Summary ns_per_op;
+    double ops_per_cycle;  // 0 without a time stamp counter
+};
+
+static Measurement measure(const Benchmark& b, int warmup, int reps)
+{
+    for (int i = 0; i < warmup; i++)
+        b.body();
+
+    vector<double> ns;
+    vector<double> cycles;
+    for (int i = 0; i < reps; i++)
+    {
+        auto start = steady_clock::now();
+        uint64_t c0 = ticks();
+        b.body();
+        uint64_t c1 = ticks();
+        auto elapsed = duration_cast<nanoseconds>(steady_clock::now() - start);
+        ns.push_back(elapsed.count() / (double)b.ops);
+        cycles.push_back((c1 - c0) / (double)b.ops);
+    }
+
+    Measurement m;
+    m.ns_per_op = summarize(ns, true);
+    double cycles_per_op = summarize(cycles, true).median;
+    m.ops_per_cycle = cycles_per_op > 0 ? 1 / cycles_per_op : 0;
+    return m;
+}
+
+static vector<Benchmark> benchmarks(int num_threads)
+{
+    vector<Benchmark> list;
+    const int64_t draws = 1 << 22;
+
+    list.push_back({ "rng/tinymt32j_single01", "draw", draws, [=]() {
+        tinymt32j_t tiny;
+        tinymt32j_init_jump(&tiny, 42, 0);
+        float sum = 0;
+        for (int64_t i = 0; i < draws; i++)
+            sum += tinymt32j_single01(&tiny);
+        sink = (uint64_t)sum;
+    }});
+    list.push_back({ "rng/tinymt32j_uint32", "draw", draws, [=]() {
+        tinymt32j_t tiny;
+        tinymt32j_init_jump(&tiny, 42, 0);
+        uint32_t sum = 0;
+        for (int64_t i = 0; i < draws; i++)
+            sum ^= tinymt32j_uint32(&tiny);
+        sink = sum;
+    }});
+    list.push_back({ "rng/mt19937_float", "draw", draws, [=]() {
+        mt19937 mt(0);
+        const float multi = 2.3283064365386962890625e-10f;
+        float sum = 0;
+        for (int64_t i = 0; i < draws; i++)
+            sum += mt() * multi;
+        sink = (uint64_t)sum;
+    }});
+
+    // The compare of worker() on inputs drawn up front.
+    const int64_t pairs = 1 << 20;
+    shared_ptr<vector<float> > xy(new vector<float>(pairs * 2));
+    tinymt32j_t tiny;
+    tinymt32j_init_jump(&tiny, 42, 0);
+    for (float& v : *xy)
+        v = tinymt32j_single01(&tiny);
+    list.push_back({ "hit_test", "sample", pairs, [=]() {
+        const float* p = &(*xy)[0];
+        int64_t hits = 0;
+        for (int64_t i = 0; i < pairs; i++)
+        {
+            float x = p[2 * i];
+            float y = p[2 * i + 1];
+            if (x*x + y*y <= 1)
+                hits++;
+        }
+        sink = hits;
+    }});
+
+    // Jump ids spread over all 32 bits, as for long runs.
+    const int64_t streams = 1024;
+    shared_ptr<vector<uint32_t> > ids(new vector<uint32_t>(streams));
+    mt19937 mt(1);
+    for (uint32_t& id : *ids)
+        id = mt();
+    list.push_back({ "init_jump", "stream", streams, [=]() {
+        uint32_t sum = 0;
+        for (uint32_t id : *ids)
+        {
+            tinymt32j_t t;
+            tinymt32j_init_jump(&t, 42, id);
+            sum ^= t.s0;
+        }
+        sink = sum;
+    }});
+
+    // Dispatch through a warm WorkerPool, as CpuEstimator does: handing a
+    // run without any chunk to the threads and waiting for it.
+    shared_ptr<WorkerPool> pool(new WorkerPool(num_threads));
+    list.push_back({ "dispatch/run_" + to_string(num_threads), "run", 1, [=]() {
+        Run run(0, 0, 1);
+        run.thread_stats.assign(pool->size(), ThreadStats());
+        pool->run(&run);
+    }});
+    // Claiming one-sample chunks: the scheduling cost of a chunk plus
+    // seeding its stream (see init_jump, with small ids here).
+    const int64_t chunks = 1 << 14;
+    list.push_back({ "dispatch/chunk_" + to_string(num_threads), "chunk", chunks, [=]() {
+        Run run(chunks, 0, 1, 1);
+        run.thread_stats.assign(pool->size(), ThreadStats());
+        pool->run(&run);
+        sink = replica_points(&run, 0);
+    }});
+
+    // Summing per-chunk hits on the host.
+    const int64_t tasks = 1 << 20;
+    shared_ptr<Run> reduced(new Run(tasks, 0, 1, 1));
+    for (int64_t t = 0; t < tasks; t++)
+        reduced->task_points[t] = t & 1;
+    list.push_back({ "reduction", "chunk", tasks, [=]() {
+        sink = replica_points(reduced.get(), 0);
+    }});
+
+    return list;
+}
+
+int main(int argc, char* argv[])
+{
+    int num_threads = 4;
+    int reps = 20;
+    int warmup = 3;
+    const char* filter = nullptr;
+    const char* json_file = nullptr;
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 >= argc)
+            usage();
+        if (strcmp(argv[i], "--threads") == 0)
+            num_threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--reps") == 0)
+            reps = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--warmup") == 0)
+            warmup = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--filter") == 0)
+            filter = argv[++i];
+        else if (strcmp(argv[i], "--json") == 0)
+            json_file = argv[++i];
+        else
+            usage();
+    }
+    if (num_threads <= 0 || num_threads > 32 || reps <= 0 || warmup < 0)
+        usage();
+
+    FILE* json = nullptr;
+    if (json_file)
+    {
+        json = fopen(json_file, "w");
+        if (!json)
+        {
+            fprintf(stderr, "Can not open %s\n", json_file);
+            return EXIT_FAILURE;
+        }
+        fprintf(json, "{\n  \"reps\": %d,\n  \"warmup\": %d,\n  \"benchmarks\": [", reps, warmup);
+    }
+
+    fprintf(stdout, "%-28s %12s %12s %12s %10s %8s %12s\n",
+        "benchmark", "median ns", "min ns", "mean ns", "stddev", "dropped", "ops/cycle");
+    bool first = true;
+    for (const Benchmark& b : benchmarks(num_threads))
+    {
+        if (filter && b.name.find(filter) == string::npos)
+            continue;
+        Measurement m = measure(b, warmup, reps);
+        const Summary& s = m.ns_per_op;
+        fprintf(stdout, "%-28s %12.3f %12.3f %12.3f %10.3f %8u %12.4f\n",
+            b.name.c_str(), s.median, s.min, s.mean, s.stddev, (unsigned int)s.rejected, m.ops_per_cycle);
+        if (json)
+        {
+            fprintf(json, "%s\n    {\"name\": \"%s\", \"unit\": \"%s\", \"ops\": %lld, \"kept\": %u, \"rejected\": %u, "
+                "\"ns_per_op\": {\"min\": %.4f, \"median\": %.4f, \"mean\": %.4f, \"stddev\": %.4f, \"max\": %.4f}, ",
+                first ? "" : ",", b.name.c_str(), b.unit, (long long)b.ops, (unsigned int)s.count,
+                (unsigned int)s.rejected, s.min, s.median, s.mean, s.stddev, s.max);
+            if (m.ops_per_cycle > 0)
+                fprintf(json, "\"ops_per_cycle\": %.6f}", m.ops_per_cycle);
+            else
+                fprintf(json, "\"ops_per_cycle\": null}");
+        }
+        first = false;
+    }
+    fprintf(stdout, "\n");
+
+    if (json)
+    {
+        fprintf(json, "\n  ]\n}\n");
+        fclose(json);
+    }
+    return 0;
+}
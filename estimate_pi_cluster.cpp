@@ -0,0 +1,839 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+using namespace std;
+using namespace chrono;
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "estimator.h"
+#include "governor.h"
+#ifndef DISABLE_OPENCL
+#include "estimator_opencl.h"
+#endif
+#include "cluster_protocol.h"
+#include "stats.h"
+
+static void usage()
+{
+    fprintf(stdout, "usage: estimate_pi_cluster coordinate port samples [--seed s] [--lease-ms ms] [--lease-chunks n]\n"
+                    "       estimate_pi_cluster work host port [--threads n] [--opencl device_index] [--source dir]\n"
+                    "           [--leases n] [--chunks n]\n");
+    exit(1);
+}
+
+static double ms_since(steady_clock::time_point start)
+{
+    return duration<double, milli>(steady_clock::now() - start).count();
+}
+
+static bool set_nonblocking(int fd, bool nonblocking)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+        return false;
+    flags = nonblocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+    return fcntl(fd, F_SETFL, flags) == 0;
+}
+
+static void set_nodelay(int fd)
+{
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// Listening on port of every interface when host is NULL.
+static int connect_tcp(const char* host, const char* port)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = host ? 0 : AI_PASSIVE;
+    struct addrinfo* addrs;
+    if (getaddrinfo(host, port, &hints, &addrs) != 0)
+        return -1;
+    int fd = -1;
+    for (struct addrinfo* a = addrs; a && fd < 0; a = a->ai_next)
+    {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd < 0)
+            continue;
+        bool ok;
+        if (host)
+        {
+            ok = connect(fd, a->ai_addr, a->ai_addrlen) == 0;
+        }
+        else
+        {
+            int one = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            ok = bind(fd, a->ai_addr, a->ai_addrlen) == 0 && listen(fd, 64) == 0;
+        }
+        if (!ok)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addrs);
+    return fd;
+}
+
+static bool read_full(int fd, void* data, size_t size)
+{
+    char* p = (char*)data;
+    while (size > 0)
+    {
+        ssize_t n = read(fd, p, size);
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool write_full(int fd, const void* data, size_t size)
+{
+    const char* p = (const char*)data;
+    while (size > 0)
+    {
+        ssize_t n = write(fd, p, size);
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static ClusterMessage message(uint16_t type)
+{
+    ClusterMessage m;
+    memset(&m, 0, sizeof(m));
+    m.magic = CLUSTER_MAGIC;
+    m.version = CLUSTER_VERSION;
+    m.type = type;
+    return m;
+}
+
+static volatile sig_atomic_t quit = 0;
+
+static void on_signal(int)
+{
+    quit = 1;
+}
+
+//------------------------------------------------------------------------------
+
+/**
+ * Owns the chunks of one run. Chunk c is drawn from jump id c, as in a
+ * run on one host, so the counts do not depend on the node that computed
+ * it. Chunks are leased in ranges for lease_ms; the chunks of a lease that
+ * expires, or whose worker disconnects, go back to the front of the queue.
+ * A result counts only if it comes from the node the lease was granted
+ * to, for a chunk of that lease. A late result of an expired lease still
+ * counts if its chunk is not counted yet, and is compared with the count
+ * otherwise, until all the chunks of the lease are counted.
+ */
+class Coordinator
+{
+    struct Node
+    {
+        int fd;                   // -1 once disconnected
+        std::string peer;
+        std::string in;
+        std::string out;
+        int waiting;              // requests without a lease yet
+        int64_t want;             // chunks per lease asked for
+        int64_t leases;
+        int64_t chunks;           // counted from this node
+    };
+    struct Lease
+    {
+        uint64_t node;
+        int64_t first_chunk;
+        int64_t num_chunks;
+        int64_t remaining;        // chunks still owned and not counted
+        steady_clock::time_point deadline;
+        bool expired;             // kept to check its late results until settled
+    };
+
+    uint32_t seed_;
+    int64_t num_samples_;
+    int64_t num_chunks_;
+    uint32_t lease_ms_;
+    int64_t max_lease_chunks_;
+
+    std::vector<uint8_t> counted_;
+    std::vector<uint32_t> hits_;
+    std::vector<uint64_t> owner_;   // lease, 0 for none
+    int64_t fresh_;                 // chunks from here on were never leased
+    std::deque<std::pair<int64_t, int64_t>> returned_;  // first, count
+    int64_t num_counted_;
+    Count128 total_hits_;
+    Count128 total_samples_;
+
+    std::map<uint64_t, Lease> leases_;
+    uint64_t next_lease_;
+    std::map<uint64_t, Node> nodes_;
+    uint64_t next_node_;
+    int64_t reassigned_;
+    int64_t duplicates_;
+    int64_t mismatches_;
+    int64_t rejected_;            // results from nodes without the lease
+
+    void send(Node& n, const ClusterMessage& m)
+    {
+        n.out.append((const char*)&m, sizeof(m));
+    }
+
+    // The next chunks to lease, returned ones first.
+    bool take(int64_t want, int64_t& first, int64_t& count)
+    {
+        while (!returned_.empty())
+        {
+            std::pair<int64_t, int64_t>& r = returned_.front();
+            for (; r.second > 0 && counted_[r.first]; r.second--)
+                r.first++;
+            if (r.second == 0)
+            {
+                returned_.pop_front();
+                continue;
+            }
+            first = r.first;
+            for (count = 0; count < std::min(want, r.second) && !counted_[first + count]; count++)
+                ;
+            r.first += count;
+            r.second -= count;
+            if (r.second == 0)
+                returned_.pop_front();
+            return true;
+        }
+        if (fresh_ == num_chunks_)
+            return false;
+        first = fresh_;
+        count = std::min(want, num_chunks_ - fresh_);
+        fresh_ += count;
+        return true;
+    }
+
+    bool grant(uint64_t id, Node& n, int64_t want)
+    {
+        int64_t first, count;
+        if (!take(std::max<int64_t>(1, std::min(want, max_lease_chunks_)), first, count))
+            return false;
+        uint64_t lease_id = next_lease_++;
+        Lease& l = leases_[lease_id];
+        l.node = id;
+        l.first_chunk = first;
+        l.num_chunks = count;
+        l.remaining = count;
+        l.deadline = steady_clock::now() + milliseconds(lease_ms_);
+        l.expired = false;
+        for (int64_t c = first; c < first + count; c++)
+            owner_[c] = lease_id;
+        n.leases++;
+
+        ClusterMessage m = message(CLUSTER_LEASE);
+        m.seed = seed_;
+        m.lease_ms = lease_ms_;
+        m.lease = lease_id;
+        m.num_samples = num_samples_;
+        m.first_chunk = first;
+        m.num_chunks = count;
+        send(n, m);
+        return true;
+    }
+
+    void expire(std::map<uint64_t, Lease>::iterator it)
+    {
+        Lease& l = it->second;
+        l.expired = true;
+        int64_t begin = -1;
+        for (int64_t c = l.first_chunk; c <= l.first_chunk + l.num_chunks; c++)
+        {
+            bool back = c < l.first_chunk + l.num_chunks && !counted_[c] && owner_[c] == it->first;
+            if (back)
+            {
+                owner_[c] = 0;
+                reassigned_++;
+                if (begin < 0)
+                    begin = c;
+            }
+            else if (begin >= 0)
+            {
+                returned_.push_back(std::make_pair(begin, c - begin));
+                begin = -1;
+            }
+        }
+    }
+
+    // Every chunk of an expired lease was counted, from it or elsewhere.
+    bool settled(const Lease& l) const
+    {
+        for (int64_t c = l.first_chunk; c < l.first_chunk + l.num_chunks; c++)
+        {
+            if (!counted_[c])
+                return false;
+        }
+        return true;
+    }
+
+    void serveWaiting()
+    {
+        for (auto& n : nodes_)
+        {
+            for (; n.second.fd >= 0 && n.second.waiting > 0; n.second.waiting--)
+            {
+                if (!grant(n.first, n.second, n.second.want))
+                    return;
+            }
+        }
+    }
+
+    void count(uint64_t id, Node& n, const ClusterMessage& m)
+    {
+        int64_t c = m.first_chunk;
+        auto granted = leases_.find(m.lease);
+        if (granted == leases_.end() || granted->second.node != id || c < granted->second.first_chunk ||
+            c >= granted->second.first_chunk + granted->second.num_chunks)
+        {
+            // A lease that is done has all its chunks counted already.
+            if (!counted_[c])
+            {
+                if (rejected_++ == 0)
+                    fprintf(stderr, "Chunk %lld: result from %s without its lease\n", (long long)c,
+                            n.peer.c_str());
+            }
+            return;
+        }
+        if (counted_[c])
+        {
+            duplicates_++;
+            if ((uint32_t)m.hits != hits_[c])
+            {
+                mismatches_++;
+                fprintf(stderr, "Chunk %lld: %lld hits from %s, %u before\n", (long long)c, (long long)m.hits,
+                        n.peer.c_str(), hits_[c]);
+            }
+            return;
+        }
+        counted_[c] = 1;
+        hits_[c] = (uint32_t)m.hits;
+        num_counted_++;
+        n.chunks++;
+        total_hits_.add((uint64_t)m.hits);
+        total_samples_.add((uint64_t)(std::min(num_samples_, (c + 1) * CHUNK_SAMPLES) - c * CHUNK_SAMPLES));
+        auto l = leases_.find(owner_[c]);
+        if (l != leases_.end() && --l->second.remaining == 0)
+            leases_.erase(l);
+    }
+
+    // The whole messages in n.in; false on a protocol error.
+    bool handle(uint64_t id, Node& n)
+    {
+        size_t used = 0;
+        for (; used + sizeof(ClusterMessage) <= n.in.size(); used += sizeof(ClusterMessage))
+        {
+            ClusterMessage m;
+            memcpy(&m, n.in.data() + used, sizeof(m));
+            if (m.magic != CLUSTER_MAGIC || m.version != CLUSTER_VERSION)
+                return false;
+            if (m.type == CLUSTER_REQUEST)
+            {
+                n.want = m.num_chunks;
+                if (num_counted_ == num_chunks_)
+                    send(n, message(CLUSTER_DONE));
+                else if (n.waiting > 0 || !grant(id, n, m.num_chunks))
+                    n.waiting++;
+            }
+            else if (m.type == CLUSTER_RESULT)
+            {
+                if (m.first_chunk < 0 || m.first_chunk >= num_chunks_ || m.hits < 0 || m.hits > CHUNK_SAMPLES)
+                    return false;
+                count(id, n, m);
+            }
+            else
+            {
+                return false;
+            }
+        }
+        n.in.erase(0, used);
+        return true;
+    }
+
+    // Write what we can; false if the connection is gone.
+    bool flush(Node& n)
+    {
+        while (!n.out.empty())
+        {
+            ssize_t w = write(n.fd, n.out.data(), n.out.size());
+            if (w < 0)
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            n.out.erase(0, w);
+        }
+        return true;
+    }
+
+    void disconnect(uint64_t id, Node& n)
+    {
+        close(n.fd);
+        n.fd = -1;
+        n.waiting = 0;
+        for (auto l = leases_.begin(); l != leases_.end();)
+        {
+            auto next = std::next(l);
+            if (l->second.node == id)
+            {
+                if (!l->second.expired)
+                    expire(l);
+                leases_.erase(l);
+            }
+            l = next;
+        }
+    }
+
+public:
+    Coordinator(int64_t samples, uint32_t seed, uint32_t lease_ms, int64_t max_lease_chunks)
+        : seed_(seed), num_samples_(samples), num_chunks_((samples + CHUNK_SAMPLES - 1) / CHUNK_SAMPLES),
+          lease_ms_(lease_ms), max_lease_chunks_(max_lease_chunks), fresh_(0), num_counted_(0),
+          next_lease_(1), next_node_(0), reassigned_(0), duplicates_(0), mismatches_(0), rejected_(0)
+    {
+        counted_.assign(num_chunks_, 0);
+        hits_.assign(num_chunks_, 0);
+        owner_.assign(num_chunks_, 0);
+    }
+
+    int run(const char* port)
+    {
+        int listen_fd = connect_tcp(NULL, port);
+        if (listen_fd < 0 || !set_nonblocking(listen_fd, true))
+        {
+            fprintf(stderr, "Can not listen on port %s\n", port);
+            return EXIT_FAILURE;
+        }
+        fprintf(stdout, "listening on port %s, chunks = %lld\n", port, (long long)num_chunks_);
+        fflush(stdout);
+
+        auto start = steady_clock::now();
+        std::vector<struct pollfd> fds;
+        std::vector<uint64_t> ids;
+        while (!quit && num_counted_ < num_chunks_)
+        {
+            fds.clear();
+            ids.clear();
+            fds.push_back({ listen_fd, POLLIN, 0 });
+            for (auto& n : nodes_)
+            {
+                if (n.second.fd < 0)
+                    continue;
+                short events = POLLIN;
+                if (!n.second.out.empty())
+                    events |= POLLOUT;
+                fds.push_back({ n.second.fd, events, 0 });
+                ids.push_back(n.first);
+            }
+            // Often enough to notice expired leases.
+            if (poll(&fds[0], fds.size(), 100) < 0 && errno != EINTR)
+                break;
+            for (size_t i = 1; i < fds.size(); i++)
+            {
+                Node& n = nodes_[ids[i - 1]];
+                bool alive = true;
+                if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+                {
+                    char buf[4096];
+                    ssize_t r = read(n.fd, buf, sizeof(buf));
+                    if (r > 0)
+                    {
+                        n.in.append(buf, r);
+                        alive = handle(ids[i - 1], n);
+                    }
+                    else if (r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                    {
+                        alive = false;
+                    }
+                }
+                if (alive)
+                    alive = flush(n);
+                if (!alive)
+                {
+                    fprintf(stdout, "%s left\n", n.peer.c_str());
+                    fflush(stdout);
+                    disconnect(ids[i - 1], n);
+                }
+            }
+            if (fds[0].revents & POLLIN)
+            {
+                struct sockaddr_storage addr;
+                socklen_t len = sizeof(addr);
+                int fd;
+                while ((fd = accept(listen_fd, (struct sockaddr*)&addr, &len)) >= 0)
+                {
+                    set_nonblocking(fd, true);
+                    set_nodelay(fd);
+                    char host[NI_MAXHOST] = "?", serv[NI_MAXSERV] = "?";
+                    getnameinfo((struct sockaddr*)&addr, len, host, sizeof(host), serv, sizeof(serv),
+                                NI_NUMERICHOST | NI_NUMERICSERV);
+                    Node n;
+                    n.fd = fd;
+                    n.peer = std::string(host) + ":" + serv;
+                    n.waiting = 0;
+                    n.want = 1;
+                    n.leases = 0;
+                    n.chunks = 0;
+                    nodes_[next_node_++] = n;
+                    fprintf(stdout, "%s joined\n", n.peer.c_str());
+                    fflush(stdout);
+                    len = sizeof(addr);
+                }
+            }
+            auto now = steady_clock::now();
+            for (auto l = leases_.begin(); l != leases_.end();)
+            {
+                auto next = std::next(l);
+                if (!l->second.expired && l->second.deadline < now)
+                    expire(l);
+                if (l->second.expired && settled(l->second))
+                    leases_.erase(l);
+                l = next;
+            }
+            serveWaiting();
+            for (auto& n : nodes_)
+            {
+                if (n.second.fd >= 0)
+                    flush(n.second);
+            }
+        }
+        double elapsed = ms_since(start);
+
+        // Everyone still connected is told, waiting or not.
+        for (auto& n : nodes_)
+        {
+            if (n.second.fd < 0)
+                continue;
+            send(n.second, message(CLUSTER_DONE));
+            set_nonblocking(n.second.fd, false);
+            flush(n.second);
+            close(n.second.fd);
+        }
+        close(listen_fd);
+        if (num_counted_ < num_chunks_)
+            return EXIT_FAILURE;
+
+        double p = total_hits_.value() / total_samples_.value();
+        double pi = 4 * p;
+        fprintf(stdout, "samples = %s\n", total_samples_.str().c_str());
+        fprintf(stdout, "hits = %s\n", total_hits_.str().c_str());
+        fprintf(stdout, "duration = %.2fms\n", elapsed);
+        fprintf(stdout, "pi = %f (%f%% error)\n", pi, pi_error(pi));
+        fprintf(stdout, "ci95 = %f\n", 1.96 * 4 * sqrt(p * (1 - p) / total_samples_.value()));
+        fprintf(stdout, "reassigned chunks = %lld, duplicate results = %lld (%lld mismatched), rejected = %lld\n",
+                (long long)reassigned_, (long long)duplicates_, (long long)mismatches_, (long long)rejected_);
+        for (const auto& n : nodes_)
+        {
+            fprintf(stdout, "%-24s %8lld leases %10lld chunks\n", n.second.peer.c_str(), (long long)n.second.leases,
+                    (long long)n.second.chunks);
+        }
+        fprintf(stdout, "\n");
+        return mismatches_ == 0 ? 0 : EXIT_FAILURE;
+    }
+};
+
+static int coordinate(int argc, char* argv[])
+{
+    if (argc < 2)
+        usage();
+    const char* port = argv[0];
+    int64_t samples = atoll(argv[1]);
+    uint32_t seed = DEFAULT_SEED;
+    int lease_ms = 10000;
+    int64_t lease_chunks = 4096;
+    for (int i = 2; i < argc; i++)
+    {
+        if (i + 1 >= argc)
+            usage();
+        if (strcmp(argv[i], "--seed") == 0)
+            seed = (uint32_t)strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--lease-ms") == 0)
+            lease_ms = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--lease-chunks") == 0)
+            lease_chunks = atoll(argv[++i]);
+        else
+            usage();
+    }
+    if (samples <= 0 || (samples + CHUNK_SAMPLES - 1) / CHUNK_SAMPLES > MAX_CHUNKS || lease_ms <= 0 ||
+        lease_chunks <= 0)
+        usage();
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+    Coordinator coordinator(samples, seed, (uint32_t)lease_ms, lease_chunks);
+    return coordinator.run(port);
+}
+
+//------------------------------------------------------------------------------
+
+/**
+ * The reader thread takes the leases; CPU leases run on the pool and send
+ * their results from its threads, OpenCL leases run on the reader thread.
+ * Every lease finished asks for the next one, so a worker keeps `leases`
+ * in flight.
+ */
+class Worker
+{
+    int fd_;
+    std::mutex mutex_;            // of writes to fd_
+    int64_t want_;
+    std::atomic<int64_t> chunks_;
+    std::atomic<bool> failed_;
+
+    bool send(const ClusterMessage* m, size_t count)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return write_full(fd_, m, sizeof(ClusterMessage) * count);
+    }
+
+    // Results of a lease, and the request for the next.
+    void finish(const ClusterMessage& lease, const std::vector<int64_t>& hits)
+    {
+        std::vector<ClusterMessage> m(hits.size() + 1);
+        for (size_t i = 0; i < hits.size(); i++)
+        {
+            m[i] = message(CLUSTER_RESULT);
+            m[i].lease = lease.lease;
+            m[i].first_chunk = lease.first_chunk + (int64_t)i;
+            m[i].hits = hits[i];
+        }
+        m.back() = request();
+        chunks_ += (int64_t)hits.size();
+        send(&m[0], m.size());
+    }
+
+    // Stop reading; the coordinator gives the leases to others.
+    void fail(const std::string& error)
+    {
+        fprintf(stderr, "Error: %s\n", error.c_str());
+        failed_ = true;
+        shutdown(fd_, SHUT_RDWR);
+    }
+
+public:
+    Worker(int fd, int64_t want) : fd_(fd), want_(want), chunks_(0), failed_(false)
+    {
+    }
+
+    ClusterMessage request() const
+    {
+        ClusterMessage m = message(CLUSTER_REQUEST);
+        m.num_chunks = want_;
+        return m;
+    }
+
+    // A checkpoint at the end of every chunk gives the hits of each.
+    bool submit(CpuEstimator& cpu, const ClusterMessage& lease)
+    {
+        EstimateOptions options;
+        options.prefix_samples = lease.first_chunk * CHUNK_SAMPLES;
+        for (int64_t c = lease.first_chunk; c < lease.first_chunk + lease.num_chunks; c++)
+            options.checkpoints.push_back(std::min(lease.num_samples, (c + 1) * CHUNK_SAMPLES));
+        return cpu.submit(options.checkpoints.back(), lease.seed, options, [this, lease](const EstimateResult& r) {
+            if (!r.error.empty())
+            {
+                fail(r.error);
+                return;
+            }
+            std::vector<int64_t> hits(r.checkpoint_hits.size());
+            for (size_t i = 0; i < hits.size(); i++)
+                hits[i] = r.checkpoint_hits[i] - (i > 0 ? r.checkpoint_hits[i - 1] : 0);
+            finish(lease, hits);
+        });
+    }
+
+#ifndef DISABLE_OPENCL
+    bool run(OpenCLEstimator& opencl, const ClusterMessage& lease)
+    {
+        std::vector<int64_t> hits;
+        if (!opencl.runChunks(lease.seed, lease.first_chunk, lease.num_chunks, lease.num_samples, hits))
+            return false;
+        finish(lease, hits);
+        return true;
+    }
+#endif
+
+    bool start(int leases)
+    {
+        std::vector<ClusterMessage> m(leases, request());
+        return send(&m[0], m.size());
+    }
+
+    int64_t chunks() const
+    {
+        return chunks_;
+    }
+    bool failed() const
+    {
+        return failed_;
+    }
+};
+
+static int work(int argc, char* argv[])
+{
+    if (argc < 2)
+        usage();
+    const char* host = argv[0];
+    const char* port = argv[1];
+    int threads = detect_cpu_limits().effective;
+    int device_index = 0;
+    const char* source_dir = "..";
+    int leases = 2;
+    int64_t chunks = 0;
+    for (int i = 2; i < argc; i++)
+    {
+        if (i + 1 >= argc)
+            usage();
+        if (strcmp(argv[i], "--threads") == 0)
+            threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--opencl") == 0)
+            device_index = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--source") == 0)
+            source_dir = argv[++i];
+        else if (strcmp(argv[i], "--leases") == 0)
+            leases = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--chunks") == 0)
+            chunks = atoll(argv[++i]);
+        else
+            usage();
+    }
+    if (threads <= 0 || leases <= 0 || chunks < 0)
+        usage();
+    signal(SIGPIPE, SIG_IGN);
+
+    unique_ptr<CpuEstimator> cpu;
+#ifndef DISABLE_OPENCL
+    unique_ptr<OpenCLEstimator> opencl;
+#endif
+    if (device_index > 0)
+    {
+#ifndef DISABLE_OPENCL
+        std::string error;
+        std::vector<cl_device_id> devices;
+        if (!OpenCLEstimator::listDevices(devices, error))
+        {
+            fprintf(stderr, "Error: %s\n", error.c_str());
+            return EXIT_FAILURE;
+        }
+        if (device_index > (int)devices.size())
+        {
+            fprintf(stderr, "Invalid device_index!\n");
+            return EXIT_FAILURE;
+        }
+        opencl.reset(new OpenCLEstimator);
+        if (!opencl->create(devices[device_index - 1], "pi_v2", source_dir, N_THREADS, false))
+        {
+            fprintf(stderr, "Error: %s\n", opencl->error().c_str());
+            return EXIT_FAILURE;
+        }
+        fprintf(stdout, "opencl = %s\n", opencl->deviceName().c_str());
+        // A chunk is a work item: enough of them to fill the device.
+        if (chunks == 0)
+            chunks = (int64_t)opencl->globalWorkSize() / 16;
+#else
+        (void)source_dir;
+        fprintf(stderr, "Built without OpenCL\n");
+        return EXIT_FAILURE;
+#endif
+    }
+    else
+    {
+        cpu.reset(new CpuEstimator(threads));
+        cpu->setBudget(detect_cpu_limits().budget);
+        fprintf(stdout, "threads = %d\n", threads);
+        // A few chunks per thread and lease.
+        if (chunks == 0)
+            chunks = 4 * threads;
+    }
+
+    int fd = connect_tcp(host, port);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Can not connect to %s:%s\n", host, port);
+        return EXIT_FAILURE;
+    }
+    set_nodelay(fd);
+
+    auto start = steady_clock::now();
+    int64_t num_leases = 0;
+    bool done = false;
+    Worker worker(fd, chunks);
+    bool ok = worker.start(leases);
+    ClusterMessage m;
+    while (ok && read_full(fd, &m, sizeof(m)))
+    {
+        if (m.magic != CLUSTER_MAGIC || m.version != CLUSTER_VERSION)
+            break;
+        if (m.type == CLUSTER_DONE)
+        {
+            done = true;
+            break;
+        }
+        if (m.type != CLUSTER_LEASE)
+            break;
+        num_leases++;
+#ifndef DISABLE_OPENCL
+        if (opencl)
+            ok = worker.run(*opencl, m);
+        else
+#endif
+            ok = worker.submit(*cpu, m);
+    }
+#ifndef DISABLE_OPENCL
+    if (!ok && opencl)
+        fprintf(stderr, "Error: %s\n", opencl->error().c_str());
+#endif
+    if (!ok && cpu)
+        fprintf(stderr, "Error: %s\n", cpu->error().c_str());
+    // Leases in flight finish before the connection closes.
+    cpu.reset();
+    close(fd);
+
+    fprintf(stdout, "leases = %lld, chunks = %lld, duration = %.2fms\n", (long long)num_leases,
+            (long long)worker.chunks(), ms_since(start));
+    if (!done && !worker.failed())
+    {
+        fprintf(stderr, "Connection lost\n");
+        return EXIT_FAILURE;
+    }
+    return ok && !worker.failed() ? 0 : EXIT_FAILURE;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc >= 2 && strcmp(argv[1], "coordinate") == 0)
+        return coordinate(argc - 2, argv + 2);
+    if (argc >= 2 && strcmp(argv[1], "work") == 0)
+        return work(argc - 2, argv + 2);
+    usage();
+    return 1;
+}
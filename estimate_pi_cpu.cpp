@@ -1,128 +1,798 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <cmath>
-#include <random>
 #include <chrono>
-#include <thread>
+#include <memory>
 #include <vector>
+#include <algorithm>
 using namespace std;
 using namespace chrono;
 
-#include "tinymt32j.h"
-#define USE_TINYMT 1
+#include "estimator.h"
+#include "governor.h"
+#include "result_cache.h"
+#include "stats.h"
+#include "topology.h"
 
 static void usage()
 {
-    fprintf(stdout, "usage: estimate_pi_cpu num_threads num_samples\n");
+    fprintf(stdout, "usage: estimate_pi_cpu (num_threads | auto) num_samples [--cache file] [--convergence] [--ensemble replicas] [--perf] [--trace file]\n"
+                    "       [--repeat n [--warmup n]] [--scaling csv_file] [--history file] [--govern] [--budget cores]\n"
+                    "       [--metrics-port port] [--metrics-socket path] [--metrics-file file]\n"
+                    "       estimate_pi_cpu compare history_file [--baseline revision] [--alpha p] [--threshold percent]\n");
     exit(1);
 }
 
-class RandomNumber
+struct Options
 {
+    int num_threads;              // 0 for auto, set from limits
+    bool govern;                  // adapt the active threads while running
+    double budget;                // cores the threads may use, 0 for all; 2.5 or 250%
+    CpuLimits limits;
+    int64_t num_samples;
+    const char* cache_file;
+    bool convergence;
+    int num_replicas;
+    bool perf;
+    const char* trace_file;
+    int metrics_port;             // 0 for none
+    const char* metrics_socket;
+    const char* metrics_file;
+    int repeat;                   // 0 for a single run
+    int warmup;
+    const char* scaling_file;     // sweep 1..num_threads threads
+    const char* history_file;
+};
+
+inline static double
+ms_since(steady_clock::time_point start)
+{
+    return duration<double, milli>(steady_clock::now() - start).count();
+}
+
+// Adapts the active threads of estimator to the CPU available, with
+// --govern or auto.
+static unique_ptr<Governor> govern(const Options& opt, CpuEstimator& estimator)
+{
+    return unique_ptr<Governor>(opt.govern ? new Governor(estimator, opt.limits) : nullptr);
+}
+
+static void report_budget(const Options& opt, const EstimateResult& result)
+{
+    if (opt.budget <= 0)
+        return;
+    double compute_ms = result.phase_ms[HISTORY_COMPUTE];
+    double cores = compute_ms > 0 ? result.busy_ms / compute_ms : 0;
+    fprintf(stdout, "budget = %.2f cores, achieved = %.2f cores (%.1f%%)\n", opt.budget, cores,
+            cores / opt.budget * 100);
+}
+
+// Append a run of the given phase times to history_file, if set.
+static void record_history(const char* history_file, const Options& opt, int64_t samples,
+                           const char* extra, const double* phase_ms)
+{
+    if (!history_file)
+        return;
+    char config[64];
+    snprintf(config, sizeof(config), "threads=%d samples=%lld replicas=%d%s",
+        opt.num_threads, (long long)opt.num_samples, max(opt.num_replicas, 1), extra);
+    HistoryRecord r;
+    history_record_init(r, "cpu", config);
+    r.samples = samples;
+    for (int i = 0; i < HISTORY_NUM_PHASES; i++)
+        r.phase_ms[i] = phase_ms[i];
+    r.samples_per_sec = phase_ms[HISTORY_TOTAL] > 0 ? samples / (phase_ms[HISTORY_TOTAL] / 1000) : 0;
+    RunHistory history;
+    if (!history.open(history_file, true) || !history.append(r))
+        fprintf(stderr, "Can not write history %s\n", history_file);
+}
+
+// Hardware counters of every thread and of the whole run.
+static void report_perf(const vector<ThreadStats>& thread_stats)
+{
+    PerfValues total;
+    memset(&total, 0, sizeof(total));
+    int64_t samples = 0;
+    int error = 0;
+    for (const ThreadStats& t : thread_stats)
+    {
+        perf_add(total, t.perf);
+        samples += t.samples;
+        if (t.perf_error != 0)
+            error = t.perf_error;
+    }
+    if (error != 0)
+    {
+        perf_report_error(stdout, error);
+        fprintf(stdout, "\n");
+        return;
+    }
+    perf_report_header(stdout);
+    for (size_t i = 0; i < thread_stats.size(); i++)
+    {
+        char name[16];
+        snprintf(name, sizeof(name), "%u", (unsigned int)i);
+        perf_report(stdout, name, thread_stats[i].perf, thread_stats[i].samples);
+    }
+    perf_report(stdout, "all", total, samples);
+    fprintf(stdout, "\n");
+}
+
+static int run_ensemble(const Options& opt, Metrics* metrics)
+{
+    int num_threads = opt.num_threads;
+    int64_t num_samples = opt.num_samples;
+    int num_replicas = opt.num_replicas;
+
+    CpuEstimator estimator(num_threads);
+    unique_ptr<Governor> governor = govern(opt, estimator);
+    estimator.setBudget(opt.budget);
+    EstimateOptions options;
+    options.replicas = num_replicas;
+    options.perf = opt.perf;
+    options.metrics = metrics;
+    EstimateResult result;
+    if (!estimator.run(num_samples, DEFAULT_SEED, options, result))
+    {
+        fprintf(stderr, "Error: %s\n", estimator.error().c_str());
+        return EXIT_FAILURE;
+    }
+
+    vector<double> pis(num_replicas);
+    for (int r = 0; r < num_replicas; r++)
+    {
+        pis[r] = pi_estimate(result.replica_hits[r], num_samples);
+    }
+
+    fprintf(stdout, "threads = %d\n", num_threads);
+    fprintf(stdout, "chunks = %lld\n", (long long)result.chunks);
+    fprintf(stdout, "duration = %.2fms\n", result.phase_ms[HISTORY_TOTAL]);
+    if (governor)
+        governor->report(stdout);
+    report_budget(opt, result);
+    for (int r = 0; r < num_replicas; r++)
+        fprintf(stdout, "replica_%d: pi = %f (%f%% error)\n", r, pis[r], pi_error(pis[r]));
+    ensemble_report(stdout, pis, num_samples);
+    fprintf(stdout, "\n");
+    if (opt.perf)
+        report_perf(result.thread_stats);
+
+    record_history(opt.history_file, opt, num_samples * num_replicas, "", result.phase_ms);
+    return 0;
+}
+
+static Options parse_args(int argc, char* argv[])
+{
+    Options opt;
+    opt.num_threads = 1;
+    opt.govern = false;
+    opt.budget = 0;
+    opt.num_samples = 1000000000;
+    opt.cache_file = nullptr;
+    opt.convergence = false;
+    opt.num_replicas = 0;
+    opt.perf = false;
+    opt.trace_file = nullptr;
+    opt.metrics_port = 0;
+    opt.metrics_socket = nullptr;
+    opt.metrics_file = nullptr;
+    opt.repeat = 0;
+    opt.warmup = 1;
+    opt.scaling_file = nullptr;
+    opt.history_file = nullptr;
+    int num_positional = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--cache") == 0)
+        {
+            if (++i >= argc)
+                usage();
+            opt.cache_file = argv[i];
+        }
+        else if (strcmp(argv[i], "--convergence") == 0)
+        {
+            opt.convergence = true;
+        }
+        else if (strcmp(argv[i], "--perf") == 0)
+        {
+            opt.perf = true;
+        }
+        else if (strcmp(argv[i], "--trace") == 0)
+        {
+            if (++i >= argc)
+                usage();
+            opt.trace_file = argv[i];
+        }
+        else if (strcmp(argv[i], "--metrics-port") == 0)
+        {
+            if (++i >= argc)
+                usage();
+            opt.metrics_port = atoi(argv[i]);
+            if (opt.metrics_port <= 0 || opt.metrics_port > 65535)
+                usage();
+        }
+        else if (strcmp(argv[i], "--metrics-socket") == 0)
+        {
+            if (++i >= argc)
+                usage();
+            opt.metrics_socket = argv[i];
+        }
+        else if (strcmp(argv[i], "--metrics-file") == 0)
+        {
+            if (++i >= argc)
+                usage();
+            opt.metrics_file = argv[i];
+        }
+        else if (strcmp(argv[i], "--repeat") == 0)
+        {
+            if (++i >= argc)
+                usage();
+            opt.repeat = atoi(argv[i]);
+            if (opt.repeat <= 0)
+                usage();
+        }
+        else if (strcmp(argv[i], "--warmup") == 0)
+        {
+            if (++i >= argc)
+                usage();
+            opt.warmup = atoi(argv[i]);
+            if (opt.warmup < 0)
+                usage();
+        }
+        else if (strcmp(argv[i], "--history") == 0)
+        {
+            if (++i >= argc)
+                usage();
+            opt.history_file = argv[i];
+        }
+        else if (strcmp(argv[i], "--scaling") == 0)
+        {
+            if (++i >= argc)
+                usage();
+            opt.scaling_file = argv[i];
+        }
+        else if (strcmp(argv[i], "--ensemble") == 0)
+        {
+            if (++i >= argc)
+                usage();
+            opt.num_replicas = atoi(argv[i]);
+            if (opt.num_replicas <= 0)
+                usage();
+        }
+        else if (strcmp(argv[i], "--govern") == 0)
+        {
+            opt.govern = true;
+        }
+        else if (strcmp(argv[i], "--budget") == 0)
+        {
+            if (++i >= argc)
+                usage();
+            char* end;
+            opt.budget = strtod(argv[i], &end);
+            if (*end == '%')
+            {
+                opt.budget /= 100;
+                end++;
+            }
+            if (*end != 0 || opt.budget <= 0)
+                usage();
+        }
+        else if (num_positional == 0 && strcmp(argv[i], "auto") == 0)
+        {
+            opt.num_threads = 0;
+            opt.govern = true;
+            num_positional++;
+        }
+        else if (num_positional == 0)
+        {
+            opt.num_threads = atoi(argv[i]);
+            if (opt.num_threads <= 0 || opt.num_threads > 32)
+                usage();
+            num_positional++;
+        }
+        else if (num_positional == 1)
+        {
+            opt.num_samples = atoll(argv[i]);
+            if (opt.num_samples <= 0)
+                usage();
+            num_positional++;
+        }
+        else
+        {
+            usage();
+        }
+    }
+    if ((opt.num_samples + CHUNK_SAMPLES - 1) / CHUNK_SAMPLES * max(opt.num_replicas, 1) > MAX_CHUNKS)
+        usage();
+    if (opt.metrics_port > 0 && opt.metrics_socket)
+        usage();
+    // Repeated runs must all do the same work.
+    if ((opt.repeat > 0 || opt.scaling_file) && (opt.cache_file || opt.convergence))
+        usage();
+    // Ensembles neither use a cached prefix nor report convergence.
+    if (opt.num_replicas > 0 && (opt.cache_file || opt.convergence))
+        usage();
+
+    // Never more threads than the quota, cpuset or affinity allow.
+    opt.limits = detect_cpu_limits();
+    if (opt.num_threads == 0)
+    {
+        opt.num_threads = min(opt.limits.effective, 32);
+    }
+    else if (opt.limits.limited && opt.num_threads > opt.limits.effective)
+    {
+        fprintf(stderr, "%d threads exceed the %d CPUs available, using %d\n", opt.num_threads,
+                opt.limits.effective, opt.limits.effective);
+        opt.num_threads = opt.limits.effective;
+    }
+    // A quota below one CPU paces the one thread left.
+    if (opt.limits.budget > 0 && (opt.budget <= 0 || opt.budget > opt.limits.budget))
+    {
+        fprintf(stderr, "The %.2f CPUs quota sets the budget\n", opt.limits.budget);
+        opt.budget = opt.limits.budget;
+    }
+    return opt;
+}
+
+static int run_estimate(const Options& opt, Metrics* metrics)
+{
+    int num_threads = opt.num_threads;
+    int64_t num_samples = opt.num_samples;
+    const char* cache_file = opt.cache_file;
+    bool convergence = opt.convergence;
+    CpuEstimator estimator(num_threads);
+    unique_ptr<Governor> governor = govern(opt, estimator);
+    estimator.setBudget(opt.budget);
+    auto start = steady_clock::now();
+
+    // Continue from the stored prefix if it is not longer than what we
+    // are asked for. Checkpoints need every sample, so the stored prefix
+    // is only updated in that mode.
+    TRACE_BEGIN("cache lookup", -1);
+    EstimateOptions options;
+    options.perf = opt.perf;
+    options.metrics = metrics;
 #if USE_TINYMT
-    tinymt32j_t tinymt_;
+    ResultCache cache;
+    ResultEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.key.generator = RESULT_GENERATOR_TINYMT32J;
+    entry.key.seed = DEFAULT_SEED;
+    entry.key.chunk_samples = CHUNK_SAMPLES;
+    if (cache_file)
+    {
+        if (!cache.open(cache_file))
+        {
+            fprintf(stderr, "Can not open cache %s\n", cache_file);
+        }
+        else if (!convergence && cache.lookup(entry.key, entry) && entry.samples <= num_samples)
+        {
+            options.prefix_samples = entry.samples;
+            options.prefix_hits = entry.hits;
+            options.resume_state = entry.state;
+        }
+    }
 #else
-    mt19937 mt19937_;  // random number generator
-    const float MT19937_FLOAT_MULTI = 2.3283064365386962890625e-10f; // (2^32-1)^-1
+    if (cache_file)
+        fprintf(stderr, "Cache requires TinyMT, ignored\n");
 #endif
-public:
-    void seed(unsigned int seed)
+    TRACE_END("cache lookup");
+    if (metrics)
+        metrics->setPrefix(options.prefix_samples, options.prefix_hits);
+    double lookup_ms = ms_since(start);
+
+    // Checkpoints at 10^6, 10^7, ... and num_samples. As chunks do not
+    // depend on the number of samples, a checkpoint's count is exactly
+    // that of a run with as many samples.
+    if (convergence)
+    {
+        for (int64_t n = 1000000; n < num_samples; n *= 10)
+            options.checkpoints.push_back(n);
+    }
+    options.checkpoints.push_back(num_samples);
+
+    EstimateResult result;
+    if (!estimator.run(num_samples, DEFAULT_SEED, options, result))
     {
-    #if USE_TINYMT
-        tinymt32j_init_jump(&tinymt_, 42, seed);
-    #else
-        mt19937_.seed(seed);
-    #endif
+        fprintf(stderr, "Error: %s\n", estimator.error().c_str());
+        return EXIT_FAILURE;
     }
-    float operator() ()
+
+#if USE_TINYMT
+    if (cache_file)
     {
-    #if USE_TINYMT
-        return tinymt32j_single01(&tinymt_);
-    #else
-        return mt19937_() * MT19937_FLOAT_MULTI;
-    #endif
+        TRACE_SCOPE("cache store");
+        auto phase = steady_clock::now();
+        entry.samples = num_samples;
+        entry.hits = result.hits;
+        entry.state = result.last_state;
+        cache.store(entry);
+        PROBE2(cache__store, entry.samples, entry.hits);
+        result.phase_ms[HISTORY_REDUCE] += ms_since(phase);
+    }
+#endif
+    result.phase_ms[HISTORY_SETUP] += lookup_ms;
+    result.phase_ms[HISTORY_TOTAL] = ms_since(start);
+
+    double pi = result.pi;
+    double error = pi_error(pi);
+
+    fprintf(stdout, "threads = %d\n", num_threads);
+    fprintf(stdout, "samples = %lld\n", (long long)num_samples);
+    fprintf(stdout, "chunks = %lld\n", (long long)((num_samples + CHUNK_SAMPLES - 1) / CHUNK_SAMPLES));
+    fprintf(stdout, "hits = %lld\n", (long long)result.hits);
+    if (cache_file)
+        fprintf(stdout, "cached = %lld\n", (long long)options.prefix_samples);
+    fprintf(stdout, "duration = %.2fms\n", result.phase_ms[HISTORY_TOTAL]);
+    if (governor)
+        governor->report(stdout);
+    report_budget(opt, result);
+    fprintf(stdout, "pi = %f (%f%% error)\n", pi, error);
+    fprintf(stdout, "\n");
+
+    if (convergence)
+    {
+        fprintf(stdout, "%15s %15s %10s %10s %10s\n", "samples", "hits", "pi", "error%", "ci95");
+        for (size_t k = 0; k < options.checkpoints.size(); k++)
+        {
+            int64_t n = options.checkpoints[k];
+            int64_t hits = result.checkpoint_hits[k];
+            double p = pi_estimate(hits, n);
+            fprintf(stdout, "%15lld %15lld %10.6f %10.6f %10.6f\n",
+                (long long)n, (long long)hits, p, pi_error(p), pi_ci95(hits, n));
+        }
+        fprintf(stdout, "\n");
     }
-};
 
-void worker(int worker_id, int64_t samples, RandomNumber *rnd, int64_t *in)
+    if (opt.perf)
+        report_perf(result.thread_stats);
+
+    // Only the samples computed here count; a cached prefix makes the run
+    // incomparable to others.
+    record_history(opt.history_file, opt, num_samples - options.prefix_samples,
+        options.prefix_samples > 0 ? " cached" : "", result.phase_ms);
+    return 0;
+}
+
+// Time warmup + repeat whole runs on estimator, keeping the times of
+// the repeat ones in ms and the last run in result. Every run must give
+// the same hits; returns false if they do not. The repeat runs go to the
+// history when opt.history_file is given.
+static bool time_runs(CpuEstimator& estimator, int64_t num_samples, int num_replicas, int warmup, int repeat,
+                      const Options& opt, const char* history_file, Metrics* metrics,
+                      vector<double>& ms, EstimateResult& result)
 {
-    rnd->seed(worker_id);  // seed the prng 
-    int64_t localCounter = 0;
-    for (int64_t i = 0; i < samples; i++)
+    EstimateOptions options;
+    options.replicas = num_replicas;
+    options.perf = opt.perf;
+    options.metrics = metrics;
+    vector<int64_t> hits;
+    bool same = true;
+    ms.clear();
+    for (int i = 0; i < warmup + repeat; i++)
     {
-        float x = (*rnd)();
-        float y = (*rnd)();
-        if (x*x + y*y <= 1)
+        TRACE_SCOPE("iteration", i);
+        if (!estimator.run(num_samples, DEFAULT_SEED, options, result))
+        {
+            fprintf(stderr, "Error: %s\n", estimator.error().c_str());
+            return false;
+        }
+        if (i > 0 && result.replica_hits != hits)
+            same = false;
+        hits = result.replica_hits;
+        if (i >= warmup)
         {
-            localCounter++;
+            ms.push_back(result.phase_ms[HISTORY_TOTAL]);
+            record_history(history_file, opt, num_samples * num_replicas, " warm", result.phase_ms);
         }
     }
-    *in = localCounter;
+    return same;
 }
 
-int main(int argc, char* argv[])
+// Repeated runs on threads kept across them, see repeat_report().
+static int run_repeat(const Options& opt, Metrics* metrics)
 {
-    int num_threads = 1;
-    int64_t num_samples = 1000000000;
-    if (argc >= 2)
+    int num_replicas = max(opt.num_replicas, 1);
+    CpuEstimator estimator(opt.num_threads);
+    unique_ptr<Governor> governor = govern(opt, estimator);
+    estimator.setBudget(opt.budget);
+    EstimateResult result;
+    vector<double> ms;
+    bool same = time_runs(estimator, opt.num_samples, num_replicas, opt.warmup, opt.repeat,
+                          opt, opt.history_file, metrics, ms, result);
+    if (ms.empty())
+        return EXIT_FAILURE;
+
+    fprintf(stdout, "threads = %d\n", opt.num_threads);
+    fprintf(stdout, "samples = %lld\n", (long long)opt.num_samples);
+    if (opt.num_replicas > 0)
+        fprintf(stdout, "replicas = %d\n", opt.num_replicas);
+    fprintf(stdout, "chunks = %lld\n", (long long)result.chunks);
+    if (governor)
+        governor->report(stdout);
+    report_budget(opt, result);
+    fprintf(stdout, "pi = %f (%f%% error)\n", result.pi, pi_error(result.pi));
+    repeat_report(stdout, ms, opt.num_samples * num_replicas, opt.warmup);
+    fprintf(stdout, "\n");
+    if (opt.perf)
+        report_perf(result.thread_stats);
+
+    if (!same)
     {
-        num_threads = atoi(argv[1]);
-        if (num_threads <= 0 || num_threads > 32)
-            usage();
+        fprintf(stderr, "Error: repeated runs gave different hits\n");
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
+
+struct ScalingPoint
+{
+    const char* mode;
+    int threads;
+    const char* region;
+    int64_t samples;
+    double ms;                    // median
+    double cv;
+    double speedup;
+    double efficiency;
+    double serial;                // Karp-Flatt, NAN for 1 thread
+};
+
+/**
+ * Strong scaling (num_samples in total) and weak scaling (num_samples
+ * per thread) over powers of two up to num_threads, plus the number of
+ * physical cores and of logical CPUs. Each point is the median of
+ * repeat runs. The table goes to stdout as Markdown and to csv_file.
+ */
+static int run_scaling(const Options& opt, Metrics* metrics)
+{
+    Topology topo = detect_topology();
+    vector<int> counts;
+    for (int p = 1; p <= opt.num_threads; p *= 2)
+        counts.push_back(p);
+    if (topo.physical <= opt.num_threads)
+        counts.push_back(topo.physical);
+    if (topo.logical <= opt.num_threads)
+        counts.push_back(topo.logical);
+    counts.push_back(opt.num_threads);
+    sort(counts.begin(), counts.end());
+    counts.erase(unique(counts.begin(), counts.end()), counts.end());
+
+    int repeat = opt.repeat > 0 ? opt.repeat : 3;
+    vector<ScalingPoint> points;
+    bool same = true;
+    const char* modes[2] = { "strong", "weak" };
+    for (const char* mode : modes)
+    {
+        bool weak = mode == modes[1];
+        double t1 = 0;
+        for (int p : counts)
+        {
+            int64_t samples = weak ? opt.num_samples * p : opt.num_samples;
+            if ((samples + CHUNK_SAMPLES - 1) / CHUNK_SAMPLES > MAX_CHUNKS)
+                break;
+            CpuEstimator estimator(p);
+            EstimateResult result;
+            vector<double> ms;
+            same = time_runs(estimator, samples, 1, opt.warmup, repeat, opt, nullptr, metrics, ms, result) && same;
+            if (ms.empty())
+                break;
+            Summary s = summarize(ms, false);
+
+            ScalingPoint sp;
+            sp.mode = mode;
+            sp.threads = p;
+            sp.region = p <= topo.physical ? "physical" : p <= topo.logical ? "smt" : "oversubscribed";
+            sp.samples = samples;
+            sp.ms = s.median;
+            sp.cv = s.mean > 0 ? s.stddev / s.mean : 0;
+            if (p == 1)
+                t1 = s.median;
+            // Weak scaling uses the scaled speedup: p times the work in Tp.
+            sp.speedup = weak ? p * t1 / s.median : t1 / s.median;
+            sp.efficiency = sp.speedup / p;
+            sp.serial = p > 1 ? karp_flatt(sp.speedup, p) : NAN;
+            points.push_back(sp);
+        }
+    }
+
+    FILE* csv = fopen(opt.scaling_file, "w");
+    if (!csv)
+        fprintf(stderr, "Can not open %s\n", opt.scaling_file);
+    else
+        fprintf(csv, "mode,threads,region,samples,median_ms,cv,speedup,efficiency,karp_flatt\n");
+
+    fprintf(stdout, "logical CPUs = %d, physical cores = %d, packages = %d\n",
+        topo.logical, topo.physical, topo.packages);
+    fprintf(stdout, "repeat = %d (warmup %d), median of each\n", repeat, opt.warmup);
+    const char* last_mode = "";
+    for (const ScalingPoint& sp : points)
+    {
+        if (strcmp(sp.mode, last_mode) != 0)
+        {
+            fprintf(stdout, "\n%s scaling, %lld samples%s\n\n", sp.mode, (long long)opt.num_samples,
+                strcmp(sp.mode, "weak") == 0 ? " per thread" : "");
+            fprintf(stdout, "| threads | region | time (ms) | cv | speedup | efficiency | serial fraction |\n");
+            fprintf(stdout, "|--------:|--------|----------:|---:|--------:|-----------:|----------------:|\n");
+            last_mode = sp.mode;
+        }
+        char serial[32] = "-";
+        if (!std::isnan(sp.serial))
+            snprintf(serial, sizeof(serial), "%.4f", sp.serial);
+        fprintf(stdout, "| %d | %s | %.2f | %.1f%% | %.2fx | %.1f%% | %s |\n",
+            sp.threads, sp.region, sp.ms, 100 * sp.cv, sp.speedup, 100 * sp.efficiency, serial);
+        if (csv)
+        {
+            fprintf(csv, "%s,%d,%s,%lld,%.4f,%.5f,%.5f,%.5f,%s\n", sp.mode, sp.threads, sp.region,
+                (long long)sp.samples, sp.ms, sp.cv, sp.speedup, sp.efficiency,
+                std::isnan(sp.serial) ? "" : serial);
+        }
     }
-    if (argc >= 3)
+    fprintf(stdout, "\n");
+    if (csv)
+        fclose(csv);
+
+    if (!same)
     {
-        num_samples = atoll(argv[2]);
-        if (num_samples <= 0)
+        fprintf(stderr, "Error: repeated runs gave different hits\n");
+        return EXIT_FAILURE;
+    }
+    return csv ? 0 : EXIT_FAILURE;
+}
+
+/**
+ * Compare the latest revision of every configuration in the history
+ * against a baseline revision (by default the one run before it), on
+ * this host only. A one-sided Mann-Whitney test on samples/s decides;
+ * returns EXIT_FAILURE if any configuration got significantly slower.
+ */
+static int run_compare(int argc, char* argv[])
+{
+    if (argc < 1)
+        usage();
+    const char* history_file = argv[0];
+    const char* baseline = nullptr;
+    double alpha = 0.01;
+    double threshold = 1;         // percent
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 >= argc)
+            usage();
+        if (strcmp(argv[i], "--baseline") == 0)
+            baseline = argv[++i];
+        else if (strcmp(argv[i], "--alpha") == 0)
+            alpha = atof(argv[++i]);
+        else if (strcmp(argv[i], "--threshold") == 0)
+            threshold = atof(argv[++i]);
+        else
             usage();
     }
 
-    auto start = system_clock::now();
+    RunHistory history;
+    vector<HistoryRecord> records;
+    if (!history.open(history_file, false) || !history.read(records))
+    {
+        fprintf(stderr, "Can not read history %s\n", history_file);
+        return EXIT_FAILURE;
+    }
+    uint64_t host = host_fingerprint();
 
-    RandomNumber* rnd = new RandomNumber[num_threads];
-    int64_t* in_points = new int64_t[num_threads];
+    // Configurations in the order they first appear.
+    vector<string> keys;
+    for (const HistoryRecord& r : records)
+    {
+        string key = string(r.binary) + " " + r.config;
+        if (r.host == host && find(keys.begin(), keys.end(), key) == keys.end())
+            keys.push_back(key);
+    }
 
-    int64_t total_points = num_samples;
-    int64_t circle_points = 0;
-    if (num_threads > 1)
+    fprintf(stdout, "%-48s %-12s %-12s %6s %6s %12s %12s %8s %8s\n", "config", "baseline", "candidate",
+        "n_base", "n_cand", "base Ms/s", "cand Ms/s", "change", "p");
+    int slower = 0;
+    for (const string& key : keys)
     {
-        vector<thread> threads;
-        for (int i = 0; i < num_threads; i++)
+        vector<const HistoryRecord*> runs;
+        for (const HistoryRecord& r : records)
+        {
+            if (r.host == host && string(r.binary) + " " + r.config == key)
+                runs.push_back(&r);
+        }
+        string candidate = runs.back()->revision;
+        string base;
+        if (baseline)
+        {
+            base = baseline;
+        }
+        else
         {
-            int64_t samples = num_samples / num_threads;
-            if (i == num_threads - 1)
+            for (size_t i = runs.size(); i-- > 0;)
             {
-                samples += num_samples - samples * num_threads;
+                if (candidate != runs[i]->revision)
+                {
+                    base = runs[i]->revision;
+                    break;
+                }
             }
-            threads.emplace_back(worker, i, samples, &(rnd[i]), &(in_points[i]));
         }
-        for (int i = 0; i < num_threads; i++)
+        vector<double> a, b;
+        for (const HistoryRecord* r : runs)
         {
-            threads[i].join();
-            circle_points += in_points[i];
+            if (candidate == r->revision)
+                a.push_back(r->samples_per_sec / 1e6);
+            else if (base == r->revision)
+                b.push_back(r->samples_per_sec / 1e6);
         }
+        if (a.size() < 2 || b.size() < 2 || base == candidate)
+        {
+            fprintf(stdout, "%-48s %-12s %-12s %6u %6u %12s %12s %8s %8s\n", key.c_str(),
+                base.empty() ? "-" : base.c_str(), candidate.c_str(), (unsigned int)b.size(),
+                (unsigned int)a.size(), "-", "-", "-", "-");
+            continue;
+        }
+        double ma = summarize(a, false).median;
+        double mb = summarize(b, false).median;
+        double change = 100 * (ma - mb) / mb;
+        double p = mann_whitney_less(a, b);
+        bool slowdown = p < alpha && change < -threshold;
+        if (slowdown)
+            slower++;
+        fprintf(stdout, "%-48s %-12s %-12s %6u %6u %12.2f %12.2f %7.2f%% %8.4f%s\n", key.c_str(),
+            base.c_str(), candidate.c_str(), (unsigned int)b.size(), (unsigned int)a.size(),
+            mb, ma, change, p, slowdown ? "  SLOWER" : "");
     }
-    else
+    fprintf(stdout, "\n");
+    if (slower > 0)
     {
-        worker(0, total_points, &(rnd[0]), &(in_points[0]));
-        circle_points = in_points[0];
+        fprintf(stdout, "%d configuration(s) significantly slower (alpha %g, threshold %g%%)\n",
+            slower, alpha, threshold);
+        return EXIT_FAILURE;
     }
+    return 0;
+}
 
-    double pi = 4 * circle_points / (double)total_points;
-    double pi_true = acos(-1.0);  // true value of pi
-    double error = abs(pi - pi_true) / pi_true * 100;
-    
-    auto duration = duration_cast<microseconds>(system_clock::now() - start);
+int main(int argc, char* argv[])
+{
+    if (argc >= 2 && strcmp(argv[1], "compare") == 0)
+        return run_compare(argc - 2, argv + 2);
 
-    fprintf(stdout, "threads = %d\n", num_threads);
-    fprintf(stdout, "samples = %lld\n", (long long)num_samples);
-    fprintf(stdout, "duration = %.2fms\n", duration.count()/1000.0);
-    fprintf(stdout, "pi = %f (%f%% error)\n", pi, error);
-    fprintf(stdout, "\n");
+    Options opt = parse_args(argc, argv);
 
-    delete []rnd;
-    delete []in_points;
+    if (opt.trace_file)
+    {
+        tracer().enable();
+        TRACE_THREAD_NAME("main");
+    }
 
-    return 0;
+    // Metrics are exported from a thread of their own while the run goes.
+    Metrics metrics;
+    MetricsExporter exporter;
+    bool export_metrics = opt.metrics_port > 0 || opt.metrics_socket || opt.metrics_file;
+    if (opt.metrics_port > 0 && !exporter.listenTcp(opt.metrics_port))
+        fprintf(stderr, "Can not listen on port %d\n", opt.metrics_port);
+    if (opt.metrics_socket && !exporter.listenUnix(opt.metrics_socket))
+        fprintf(stderr, "Can not listen on %s\n", opt.metrics_socket);
+    if (opt.metrics_file)
+        exporter.dumpTo(opt.metrics_file);
+    if (export_metrics)
+        exporter.start(&metrics);
+
+    int ret;
+    if (opt.scaling_file)
+        ret = run_scaling(opt, export_metrics ? &metrics : nullptr);
+    else if (opt.repeat > 0)
+        ret = run_repeat(opt, export_metrics ? &metrics : nullptr);
+    else if (opt.num_replicas > 0)
+        ret = run_ensemble(opt, export_metrics ? &metrics : nullptr);
+    else
+        ret = run_estimate(opt, export_metrics ? &metrics : nullptr);
+
+    if (!exporter.stop())
+        fprintf(stderr, "Can not write metrics %s\n", opt.metrics_file);
+
+    if (opt.trace_file && !tracer().write(opt.trace_file))
+        fprintf(stderr, "Can not write trace %s\n", opt.trace_file);
+
+    return ret;
 }
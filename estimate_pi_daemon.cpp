@@ -0,0 +1,623 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <csignal>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+using namespace std;
+using namespace chrono;
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "estimator.h"
+#ifndef DISABLE_OPENCL
+#include "estimator_opencl.h"
+#endif
+#include "daemon_protocol.h"
+#include "governor.h"
+#include "stats.h"
+
+static void usage()
+{
+    fprintf(stdout, "usage: estimate_pi_daemon serve socket [--threads n] [--opencl device_index] [--queues n] [--source dir]\n"
+                    "           [--max-inflight n] [--max-samples n] [--warm chunks] [--govern]\n"
+                    "       estimate_pi_daemon request socket samples [--count n] [--batch n] [--seed s] [--priority p] [--opencl]\n");
+    exit(1);
+}
+
+static double us_since(steady_clock::time_point start)
+{
+    return duration<double, micro>(steady_clock::now() - start).count();
+}
+
+static bool set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+static int connect_unix(const char* path, bool listening)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (listening)
+    {
+        unlink(path);
+        if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0)
+        {
+            close(fd);
+            return -1;
+        }
+    }
+    else if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+//------------------------------------------------------------------------------
+
+static int wake_pipe[2] = { -1, -1 };
+
+static volatile sig_atomic_t quit = 0;
+
+static void on_signal(int)
+{
+    quit = 1;
+    ssize_t n = write(wake_pipe[1], "q", 1);
+    (void)n;
+}
+
+struct Connection
+{
+    int fd;
+    std::string in;
+    std::string out;
+};
+
+// An estimate that finished, handed from an engine thread to the loop,
+// with the ids of the requests it answers.
+struct Completion
+{
+    uint64_t connection;
+    std::vector<uint32_t> ids;
+    DaemonResponse response;
+};
+
+/**
+ * One thread polls the socket and the connections. Requests are admitted
+ * or refused right away; admitted ones are submitted to the warm engines,
+ * whose threads queue the responses and wake the loop through a pipe.
+ */
+class Daemon
+{
+    // Before the engines, whose threads may still complete estimates
+    // while they are destroyed.
+    std::mutex mutex_;            // of completions_
+    std::vector<Completion> completions_;
+
+    CpuEstimator cpu_;
+#ifndef DISABLE_OPENCL
+    unique_ptr<OpenCLEstimator> opencl_;
+#endif
+    unique_ptr<Governor> governor_;
+    int listen_fd_;
+    std::map<uint64_t, Connection> connections_;
+    uint64_t next_connection_;
+    int inflight_;
+    int max_inflight_;
+    int64_t max_samples_;
+
+    static DaemonResponse response(uint32_t id, int status)
+    {
+        DaemonResponse r;
+        memset(&r, 0, sizeof(r));
+        r.magic = DAEMON_MAGIC;
+        r.id = id;
+        r.status = status;
+        return r;
+    }
+
+    void reply(Connection& c, const DaemonResponse& r)
+    {
+        c.out.append((const char*)&r, sizeof(r));
+    }
+
+    Estimator* backend(uint8_t b)
+    {
+        if (b == DAEMON_CPU)
+            return &cpu_;
+#ifndef DISABLE_OPENCL
+        if (b == DAEMON_OPENCL)
+            return opencl_.get();
+#endif
+        return nullptr;
+    }
+
+    // Admit the whole requests in c.in, leaving a partial one. Requests of
+    // the same backend, seed, samples and priority ask for the same
+    // estimate, so each one that arrived together runs once and answers
+    // all of them; only the estimates count against max_inflight_.
+    void admit(uint64_t id, Connection& c)
+    {
+        struct Batch
+        {
+            DaemonRequest req;
+            std::vector<uint32_t> ids;
+        };
+        std::vector<Batch> batches;
+        auto received = steady_clock::now();
+        size_t used = 0;
+        for (; used + sizeof(DaemonRequest) <= c.in.size(); used += sizeof(DaemonRequest))
+        {
+            DaemonRequest req;
+            memcpy(&req, c.in.data() + used, sizeof(req));
+            if (req.magic != DAEMON_MAGIC || req.version != DAEMON_VERSION || req.backend > DAEMON_OPENCL ||
+                req.samples <= 0)
+            {
+                reply(c, response(req.id, DAEMON_INVALID));
+                continue;
+            }
+            if (!backend(req.backend))
+            {
+                reply(c, response(req.id, DAEMON_NO_BACKEND));
+                continue;
+            }
+            if (req.samples > max_samples_)
+            {
+                reply(c, response(req.id, DAEMON_BUSY));
+                continue;
+            }
+            Batch* batch = nullptr;
+            for (Batch& b : batches)
+                if (b.req.backend == req.backend && b.req.seed == req.seed && b.req.samples == req.samples &&
+                    b.req.priority == req.priority)
+                    batch = &b;
+            if (!batch)
+            {
+                if (inflight_ + (int)batches.size() >= max_inflight_)
+                {
+                    reply(c, response(req.id, DAEMON_BUSY));
+                    continue;
+                }
+                batches.push_back(Batch());
+                batch = &batches.back();
+                batch->req = req;
+            }
+            batch->ids.push_back(req.id);
+        }
+        c.in.erase(0, used);
+
+        for (Batch& batch : batches)
+        {
+            // Each connection is a tenant, so that a client pipelining many
+            // requests does not hold back the others.
+            EstimateOptions options;
+            options.tenant = (int)id;
+            options.priority = batch.req.priority;
+            std::vector<uint32_t> ids = batch.ids;
+            bool ok = backend(batch.req.backend)->submit(batch.req.samples, batch.req.seed, options,
+                [this, id, ids, received](const EstimateResult& result) {
+                    Completion done;
+                    done.connection = id;
+                    done.ids = ids;
+                    done.response = response(0, result.error.empty() ? DAEMON_OK : DAEMON_FAILED);
+                    done.response.samples = result.samples;
+                    done.response.hits = result.hits;
+                    done.response.pi = result.pi;
+                    done.response.ci95 = result.ci95;
+                    done.response.server_us = us_since(received);
+                    done.response.compute_us = result.phase_ms[HISTORY_COMPUTE] * 1000;
+                    done.response.total_us = result.phase_ms[HISTORY_TOTAL] * 1000;
+                    bool first;
+                    {
+                        std::lock_guard<std::mutex> lock(mutex_);
+                        first = completions_.empty();
+                        completions_.push_back(done);
+                    }
+                    // One wakeup per batch of completions.
+                    if (first)
+                    {
+                        ssize_t n = write(wake_pipe[1], "c", 1);
+                        (void)n;
+                    }
+                });
+            if (ok)
+                inflight_++;
+            else
+                for (uint32_t request_id : batch.ids)
+                    reply(c, response(request_id, DAEMON_INVALID));
+        }
+    }
+
+    void drain()
+    {
+        char buf[64];
+        while (read(wake_pipe[0], buf, sizeof(buf)) > 0)
+            ;
+        std::vector<Completion> done;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            done.swap(completions_);
+        }
+        for (const Completion& d : done)
+        {
+            inflight_--;
+            auto c = connections_.find(d.connection);
+            if (c == connections_.end())
+                continue;
+            DaemonResponse r = d.response;
+            for (uint32_t request_id : d.ids)
+            {
+                r.id = request_id;
+                reply(c->second, r);
+            }
+        }
+    }
+
+    // Write what we can; false if the connection is gone.
+    bool flush(Connection& c)
+    {
+        while (!c.out.empty())
+        {
+            ssize_t n = write(c.fd, c.out.data(), c.out.size());
+            if (n < 0)
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            c.out.erase(0, n);
+        }
+        return true;
+    }
+
+public:
+    Daemon(int threads, int max_inflight, int64_t max_samples)
+        : cpu_(threads), listen_fd_(-1), next_connection_(0), inflight_(0),
+          max_inflight_(max_inflight), max_samples_(max_samples)
+    {
+        cpu_.setBudget(detect_cpu_limits().budget);
+    }
+
+    // Start states of the first chunks, and one estimate on each engine
+    // so that the first request does not pay for cold caches.
+    void warm(int64_t chunks)
+    {
+        cpu_.warm(DEFAULT_SEED, chunks);
+        EstimateResult result;
+        cpu_.run(CHUNK_SAMPLES, DEFAULT_SEED, EstimateOptions(), result);
+#ifndef DISABLE_OPENCL
+        if (opencl_)
+            opencl_->run(1, DEFAULT_SEED, EstimateOptions(), result);
+#endif
+    }
+
+    // An OpenCL session of queues lanes, so that as many requests run on
+    // the device at once.
+    bool openDevice(int device_index, const char* source_dir, int queues)
+    {
+#ifndef DISABLE_OPENCL
+        std::string error;
+        std::vector<cl_device_id> devices;
+        if (!OpenCLEstimator::listDevices(devices, error))
+        {
+            fprintf(stderr, "Error: %s\n", error.c_str());
+            return false;
+        }
+        if (device_index <= 0 || device_index > (int)devices.size())
+        {
+            fprintf(stderr, "Invalid device_index!\n");
+            return false;
+        }
+        opencl_.reset(new OpenCLEstimator);
+        if (!opencl_->create(devices[device_index - 1], "pi_v2", source_dir, N_THREADS, false, queues))
+        {
+            fprintf(stderr, "Error: %s\n", opencl_->error().c_str());
+            return false;
+        }
+        fprintf(stdout, "opencl = %s\n", opencl_->deviceName().c_str());
+        return true;
+#else
+        (void)device_index;
+        (void)source_dir;
+        (void)queues;
+        fprintf(stderr, "Built without OpenCL\n");
+        return false;
+#endif
+    }
+
+    // Adapt the active threads of the CPU engine to the CPU available.
+    void govern()
+    {
+        governor_.reset(new Governor(cpu_, detect_cpu_limits()));
+    }
+
+    int serve(const char* path)
+    {
+        listen_fd_ = connect_unix(path, true);
+        if (listen_fd_ < 0 || !set_nonblocking(listen_fd_))
+        {
+            fprintf(stderr, "Can not listen on %s\n", path);
+            return EXIT_FAILURE;
+        }
+        fprintf(stdout, "listening on %s\n", path);
+        fflush(stdout);
+
+        std::vector<struct pollfd> fds;
+        std::vector<uint64_t> ids;
+        while (!quit)
+        {
+            fds.clear();
+            ids.clear();
+            fds.push_back({ listen_fd_, POLLIN, 0 });
+            fds.push_back({ wake_pipe[0], POLLIN, 0 });
+            for (auto& c : connections_)
+            {
+                short events = POLLIN;
+                if (!c.second.out.empty())
+                    events |= POLLOUT;
+                fds.push_back({ c.second.fd, events, 0 });
+                ids.push_back(c.first);
+            }
+            if (poll(&fds[0], fds.size(), -1) < 0 && errno != EINTR)
+                break;
+            if (fds[1].revents & POLLIN)
+                drain();
+            for (size_t i = 2; i < fds.size(); i++)
+            {
+                auto it = connections_.find(ids[i - 2]);
+                Connection& c = it->second;
+                bool alive = true;
+                if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+                {
+                    char buf[4096];
+                    ssize_t n = read(c.fd, buf, sizeof(buf));
+                    if (n > 0)
+                    {
+                        c.in.append(buf, n);
+                        admit(it->first, c);
+                    }
+                    else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                    {
+                        alive = false;
+                    }
+                }
+                if (alive)
+                    alive = flush(c);
+                if (!alive)
+                {
+                    close(c.fd);
+                    connections_.erase(it);
+                }
+            }
+            if (fds[0].revents & POLLIN)
+            {
+                int fd;
+                while ((fd = accept(listen_fd_, NULL, NULL)) >= 0)
+                {
+                    set_nonblocking(fd);
+                    Connection c;
+                    c.fd = fd;
+                    connections_[next_connection_++] = c;
+                }
+            }
+            // Responses of the completions drained above.
+            for (auto& c : connections_)
+                flush(c.second);
+        }
+
+        for (auto& c : connections_)
+            close(c.second.fd);
+        close(listen_fd_);
+        unlink(path);
+        return 0;
+    }
+};
+
+static int serve(int argc, char* argv[])
+{
+    if (argc < 1)
+        usage();
+    const char* path = argv[0];
+    int threads = detect_cpu_limits().effective;
+    bool govern = false;
+    int device_index = 0;
+    int queues = 2;
+    const char* source_dir = "..";
+    int max_inflight = 0;
+    int64_t max_samples = 1LL << 36;
+    int64_t warm_chunks = 1024;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--govern") == 0)
+            govern = true;
+        else if (i + 1 >= argc)
+            usage();
+        else if (strcmp(argv[i], "--threads") == 0)
+            threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--opencl") == 0)
+            device_index = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--queues") == 0)
+            queues = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--source") == 0)
+            source_dir = argv[++i];
+        else if (strcmp(argv[i], "--max-inflight") == 0)
+            max_inflight = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--max-samples") == 0)
+            max_samples = atoll(argv[++i]);
+        else if (strcmp(argv[i], "--warm") == 0)
+            warm_chunks = atoll(argv[++i]);
+        else
+            usage();
+    }
+    if (threads <= 0 || queues <= 0 || max_inflight < 0 || max_samples <= 0 || warm_chunks < 0 || warm_chunks > MAX_CHUNKS)
+        usage();
+    // Enough requests to keep every thread busy, few enough to bound the
+    // queueing delay of the last one.
+    if (max_inflight == 0)
+        max_inflight = 4 * threads;
+
+    if (pipe(wake_pipe) != 0 || !set_nonblocking(wake_pipe[0]))
+        return EXIT_FAILURE;
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    Daemon daemon(threads, max_inflight, max_samples);
+    if (device_index > 0 && !daemon.openDevice(device_index, source_dir, queues))
+        return EXIT_FAILURE;
+    auto start = steady_clock::now();
+    daemon.warm(warm_chunks);
+    if (govern)
+        daemon.govern();
+    fprintf(stdout, "threads = %d, max_inflight = %d, warm = %.2fms\n", threads, max_inflight, us_since(start) / 1000);
+    return daemon.serve(path);
+}
+
+//------------------------------------------------------------------------------
+
+static bool read_full(int fd, void* data, size_t size)
+{
+    char* p = (char*)data;
+    while (size > 0)
+    {
+        ssize_t n = read(fd, p, size);
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+/**
+ * Send count requests, batch at a time, and report the round trip and
+ * the daemon overhead (round trip minus engine compute time).
+ */
+static int request(int argc, char* argv[])
+{
+    if (argc < 2)
+        usage();
+    const char* path = argv[0];
+    int64_t samples = atoll(argv[1]);
+    int count = 1;
+    int batch = 1;
+    uint32_t seed = DEFAULT_SEED;
+    uint8_t backend = DAEMON_CPU;
+    int priority = 0;
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--opencl") == 0)
+            backend = DAEMON_OPENCL;
+        else if (i + 1 >= argc)
+            usage();
+        else if (strcmp(argv[i], "--count") == 0)
+            count = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--batch") == 0)
+            batch = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--seed") == 0)
+            seed = (uint32_t)strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--priority") == 0)
+            priority = atoi(argv[++i]);
+        else
+            usage();
+    }
+    if (samples <= 0 || count <= 0 || batch <= 0 || priority < INT8_MIN || priority > INT8_MAX)
+        usage();
+
+    int fd = connect_unix(path, false);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Can not connect to %s\n", path);
+        return EXIT_FAILURE;
+    }
+
+    vector<double> rtt_us, overhead_us, server_us;
+    DaemonResponse last;
+    memset(&last, 0, sizeof(last));
+    int failed = 0;
+    uint32_t next_id = 0;
+    for (int sent = 0; sent < count; sent += batch)
+    {
+        int n = std::min(batch, count - sent);
+        vector<DaemonRequest> reqs(n);
+        for (DaemonRequest& req : reqs)
+        {
+            memset(&req, 0, sizeof(req));
+            req.magic = DAEMON_MAGIC;
+            req.version = DAEMON_VERSION;
+            req.backend = backend;
+            req.priority = (int8_t)priority;
+            req.id = next_id++;
+            req.seed = seed;
+            req.samples = samples;
+        }
+        auto start = steady_clock::now();
+        if (write(fd, &reqs[0], sizeof(DaemonRequest) * n) != (ssize_t)(sizeof(DaemonRequest) * n))
+            break;
+        for (int i = 0; i < n; i++)
+        {
+            DaemonResponse r;
+            if (!read_full(fd, &r, sizeof(r)) || r.magic != DAEMON_MAGIC)
+            {
+                fprintf(stderr, "Connection lost\n");
+                close(fd);
+                return EXIT_FAILURE;
+            }
+            double rtt = us_since(start);
+            if (r.status != DAEMON_OK)
+            {
+                failed++;
+                continue;
+            }
+            rtt_us.push_back(rtt);
+            overhead_us.push_back(rtt - r.compute_us);
+            server_us.push_back(r.server_us - r.compute_us);
+            last = r;
+        }
+    }
+    close(fd);
+
+    fprintf(stdout, "requests = %d (%d failed), batch = %d\n", count, failed, batch);
+    if (!rtt_us.empty())
+    {
+        fprintf(stdout, "samples = %lld\n", (long long)last.samples);
+        fprintf(stdout, "pi = %f (%f%% error)\n", last.pi, pi_error(last.pi));
+        fprintf(stdout, "%-16s %10s %10s %10s %10s\n", "us", "min", "median", "p99", "max");
+        const char* names[3] = { "round trip", "overhead", "daemon overhead" };
+        const vector<double>* values[3] = { &rtt_us, &overhead_us, &server_us };
+        for (int k = 0; k < 3; k++)
+        {
+            Summary s = summarize(*values[k], false);
+            fprintf(stdout, "%-16s %10.1f %10.1f %10.1f %10.1f\n", names[k], s.min, s.median, s.p99, s.max);
+        }
+    }
+    fprintf(stdout, "\n");
+    return failed == 0 ? 0 : EXIT_FAILURE;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc >= 2 && strcmp(argv[1], "serve") == 0)
+        return serve(argc - 2, argv + 2);
+    if (argc >= 2 && strcmp(argv[1], "request") == 0)
+        return request(argc - 2, argv + 2);
+    usage();
+    return 1;
+}
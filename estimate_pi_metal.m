@@ -40,11 +40,16 @@ NS_ASSUME_NONNULL_END
         
         NSString* source = [NSString stringWithContentsOfFile:@"../pi.metal"
             encoding:NSUTF8StringEncoding error:NULL];
-        if (source == nil)
+        NSString* tinymt = [NSString stringWithContentsOfFile:@"../tinymt32j.h"
+            encoding:NSUTF8StringEncoding error:NULL];
+        if (source == nil || tinymt == nil)
         {
             NSLog(@"Failed to load source.");
             return nil;
         }
+        // The TinyMT header is shared with the CPU and OpenCL versions.
+        source = [source stringByReplacingOccurrencesOfString:@"#include \"tinymt32j.h\""
+            withString:tinymt];
         
         MTLCompileOptions* compileOptions = [MTLCompileOptions new];
         id<MTLLibrary> lib = [device newLibraryWithSource:source
@@ -1,10 +1,7 @@
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
-#ifdef __APPLE__
-#include <OpenCL/opencl.h>
-#else
-#include <CL/cl.h>
-#endif
+#include <cstring>
 
 #ifdef _WIN32
 #define NOMINMAX
@@ -12,102 +9,20 @@
 #define GPA_ENABLED 1
 #endif
 
+#include "estimator_opencl.h"
+#include "stats.h"
+#include "tinymt32j.h"
+#include "trace.h"
+#include "metrics.h"
+#include "history.h"
+
 #include <vector>
-#include <random>
 #include <chrono>
-#include <fstream>
-#include <memory>
 using namespace std;
 using namespace std::chrono;
 
 //------------------------------------------------------------------------------
 
-class CLSource
-{
-    std::string data_;
-public:
-    CLSource()
-    {
-    }
-    const std::string& data() const
-    {
-        return data_;
-    }
-    bool load(const std::string& filename)
-    {
-        std::ifstream f(filename);
-        if (!f.good())
-            return false;
-        f.seekg(0, std::ios::end);
-        size_t size = f.tellg();
-        data_.resize(size);
-        f.seekg(0);
-        f.read(&data_[0], size);
-        // some file may contains trailing '\0'
-        size_t sz = strlen(&data_[0]);
-        if (sz < size)
-            data_.resize(sz);
-        // make sure we end with a '\n'
-        if (data_.empty() || data_.back() != '\n')
-            data_.append(1, '\n');
-        return true;
-    }
-    int resolveInclude(const std::string& name, const CLSource& inc)
-    {
-        int n = 0;
-        std::string incStr0 = "#include <" + name + ">";
-        std::string incStr1 = "#include \"" + name + "\"";
-        for (;;)
-        {
-            auto startPos = data_.find(incStr0);
-            if (startPos != std::string::npos)
-            {
-                data_.replace(startPos, incStr0.length(), inc.data());
-                n++;
-                continue;
-            }
-            startPos = data_.find(incStr1);
-            if (startPos != std::string::npos)
-            {
-                data_.replace(startPos, incStr1.length(), inc.data());
-                n++;
-                continue;
-            }
-            break;
-        }
-        return n;
-    }
-};
-
-static bool loadSource(const std::string& dir, CLSource& src)
-{
-    CLSource mt19937;
-    if (!mt19937.load(dir + "/3rdparty/RandomCL/generators/mt19937.cl"))
-        return false;
-
-    CLSource tinymt32, tinymt, tinymt32_jump_table, tinymt32def;
-    if (!tinymt32.load(dir + "/3rdparty/RandomCL/generators/TinyMT/tinymt32_jump.clh"))
-        return false;
-    if (!tinymt.load(dir + "/3rdparty/RandomCL/generators/TinyMT/tinymt.clh"))
-        return false;
-    if (!tinymt32_jump_table.load(dir + "/3rdparty/RandomCL/generators/TinyMT/tinymt32_jump_table.clh"))
-        return false;
-    if (!tinymt32def.load(dir + "/3rdparty/RandomCL/generators/TinyMT/tinymt32def.h"))
-        return false;
-    tinymt32.resolveInclude("tinymt.clh", tinymt);
-    tinymt32.resolveInclude("tinymt32_jump_table.clh", tinymt32_jump_table);
-    tinymt32.resolveInclude("tinymt32def.h", tinymt32def);
-
-    if (!src.load(dir + "/pi.cl"))
-        return false;
-    src.resolveInclude("mt19937.cl", mt19937);
-    src.resolveInclude("tinymt32_jump.clh", tinymt32);
-
-    return true;
-}
-
-//------------------------------------------------------------------------------
-
 #if GPA_ENABLED
 GPAApiManager* GPAApiManager::m_pGpaApiManager = nullptr;
 GPAFuncTableInfo* g_pFuncTableInfo = nullptr;
@@ -290,58 +205,327 @@ do {                               \
     }                              \
 } while(0)
 
-#define N_THREADS        1000*100
-#define ITERS_PER_THREAD 10000
+
+static double msSince(steady_clock::time_point start)
+{
+    return duration<double, milli>(steady_clock::now() - start).count();
+}
+
+// Append a run of the given phase times to historyFile, if set.
+static void recordHistory(const char* historyFile, const std::string& config, int64_t samples, const double* phaseMs)
+{
+    if (!historyFile)
+        return;
+    HistoryRecord r;
+    history_record_init(r, "opencl", config);
+    r.samples = samples;
+    for (int i = 0; i < HISTORY_NUM_PHASES; i++)
+        r.phase_ms[i] = phaseMs[i];
+    r.samples_per_sec = phaseMs[HISTORY_TOTAL] > 0 ? samples / (phaseMs[HISTORY_TOTAL] / 1000) : 0;
+    RunHistory history;
+    if (!history.open(historyFile, true) || !history.append(r))
+        fprintf(stderr, "Can not write history %s\n", historyFile);
+}
+
+// Device time against the share of the device the runs may use.
+static void reportBudget(const OpenCLEstimator& estimator, const EstimateResult& result)
+{
+    if (estimator.budget() <= 0)
+        return;
+    double computeMs = result.phase_ms[HISTORY_COMPUTE];
+    double share = computeMs > 0 ? result.busy_ms / computeMs : 0;
+    fprintf(stdout, "budget = %.1f%%, achieved = %.1f%%\n", estimator.budget() * 100, share * 100);
+}
+
+// Run numReplicas independent copies of the estimate in a single dispatch
+// of the ensemble variant of kernelName, see OpenCLEstimator.
+static int runEnsemble(OpenCLEstimator& estimator, const char* kernelName, int64_t samples, cl_uint numReplicas,
+                       Metrics* metrics)
+{
+    EstimateOptions options;
+    options.kernel = kernelName;
+    options.replicas = (int)numReplicas;
+    options.metrics = metrics;
+    EstimateResult result;
+    if (!estimator.run(samples, DEFAULT_SEED, options, result))
+    {
+        fprintf(stderr, "Error: %s\n", estimator.error().c_str());
+        return EXIT_FAILURE;
+    }
+
+    vector<double> pis(numReplicas);
+    for (cl_uint r = 0; r < numReplicas; r++)
+        pis[r] = pi_estimate(result.replica_hits[r], result.samples);
+
+    fprintf(stdout, "local_work_size = %d\n", (unsigned int)estimator.localWorkSize());
+    fprintf(stdout, "global_work_size = %lld\n", (long long)result.chunks);
+    fprintf(stdout, "duration = %.2fms\n", result.phase_ms[HISTORY_TOTAL]);
+    for (cl_uint r = 0; r < numReplicas; r++)
+        fprintf(stdout, "replica_%u: pi = %f (%f%% error)\n", r, pis[r], pi_error(pis[r]));
+    ensemble_report(stdout, pis, result.samples);
+    fprintf(stdout, "\n");
+    return 0;
+}
+// Time warmup + repeat runs of the estimator, each a dispatch with its
+// readback and reduction. The context, program and buffer are set up once.
+static int runRepeat(OpenCLEstimator& estimator, int64_t samples, int repeat, int warmup,
+                     Metrics* metrics, const char* historyFile, const std::string& config)
+{
+    EstimateOptions options;
+    options.metrics = metrics;
+    EstimateResult result;
+    vector<double> ms;
+    int64_t hits = 0;
+    bool same = true;
+    for (int i = 0; i < warmup + repeat; i++)
+    {
+        TRACE_SCOPE("iteration", i);
+        if (!estimator.run(samples, DEFAULT_SEED, options, result))
+        {
+            fprintf(stderr, "Error: %s\n", estimator.error().c_str());
+            return EXIT_FAILURE;
+        }
+        if (i > 0 && result.hits != hits)
+            same = false;
+        hits = result.hits;
+        if (i >= warmup)
+        {
+            ms.push_back(result.phase_ms[HISTORY_TOTAL]);
+            recordHistory(historyFile, config + " warm", result.samples, result.phase_ms);
+        }
+    }
+
+    fprintf(stdout, "local_work_size = %d\n", (unsigned int)estimator.localWorkSize());
+    fprintf(stdout, "global_work_size = %d\n", (unsigned int)estimator.globalWorkSize());
+    fprintf(stdout, "samples = %lld\n", (long long)result.samples);
+    reportBudget(estimator, result);
+    fprintf(stdout, "pi = %f (%f%% error)\n", result.pi, pi_error(result.pi));
+    repeat_report(stdout, ms, result.samples, warmup);
+    fprintf(stdout, "\n");
+
+    if (!same)
+    {
+        fprintf(stderr, "Error: repeated runs gave different hits\n");
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
+
+// One estimate of samples, repeated for every counter pass of GPA.
+static int runEstimate(OpenCLEstimator& estimator, int64_t samples, unsigned int numPasses, bool gpaActive,
+                       Metrics* metrics, const char* historyFile, const std::string& config, double* phaseMs)
+{
+    EstimateResult result;
+    double totalMs = 0;
+    for (unsigned int pass = 0; pass < numPasses; pass++)
+    {
+        if (!GPA_BeginPass(pass))
+            fprintf(stderr, "GPA_BeginPass failed, pass=%u\n", pass);
+
+        // Every pass runs the whole estimate; count the samples once.
+        EstimateOptions options;
+        options.metrics = pass == 0 ? metrics : nullptr;
+        if (!estimator.run(samples, DEFAULT_SEED, options, result))
+        {
+            fprintf(stderr, "Error: %s\n", estimator.error().c_str());
+            return EXIT_FAILURE;
+        }
+        totalMs += result.phase_ms[HISTORY_TOTAL];
+        for (int i = HISTORY_COMPUTE; i < HISTORY_TOTAL; i++)
+            phaseMs[i] += result.phase_ms[i] / numPasses;
+
+        if (!GPA_EndPass(pass))
+            fprintf(stderr, "GPA_EndPass failed, pass=%u\n", pass);
+    }
+
+    fprintf(stdout, "local_work_size = %d\n", (unsigned int)estimator.localWorkSize());
+    fprintf(stdout, "global_work_size = %d\n", (unsigned int)estimator.globalWorkSize());
+    fprintf(stdout, "iterates = %d\n", ITERS_PER_THREAD);
+    fprintf(stdout, "samples = %lld (%lld required)\n",
+        (long long)result.samples, (long long)ITERS_PER_THREAD * N_THREADS);
+    fprintf(stdout, "duration = %.2fms\n", totalMs / numPasses);
+    reportBudget(estimator, result);
+    fprintf(stdout, "pi = %f (%f%% error)\n", result.pi, pi_error(result.pi));
+    fprintf(stdout, "\n");
+
+    // Counter passes slow the kernel down, such runs are not recorded.
+    phaseMs[HISTORY_TOTAL] = phaseMs[HISTORY_SETUP] + totalMs / numPasses;
+    if (!gpaActive)
+        recordHistory(historyFile, config, result.samples, phaseMs);
+
+    GPA_Uninit();
+    return 0;
+}
+
+// Compare the first draws of streams with low and high jump ids against
+// tinymt32j.h on the host, they must be bit-identical.
+static int verifyStreams(cl_context context, cl_command_queue commands, cl_program program)
+{
+    const cl_uint numStreams = 4096;
+    const cl_uint draws = 16;
+    const cl_uint seed = 42;
+    const size_t offsets[2] = { 0, 0xFFFFFFFFu - numStreams + 1 };
+
+    int err;
+    cl_kernel kernel = clCreateKernel(program, "dump_streams", &err);
+    CL_CHECK_RESULT(kernel, "Error: Failed to create compute kernel!\n");
+    size_t size = sizeof(cl_uint) * numStreams * draws * 2;
+    cl_mem out = clCreateBuffer(context, CL_MEM_WRITE_ONLY, size, NULL, NULL);
+    CL_CHECK_RESULT(out, "Error: Failed to allocate device memory!\n");
+    err  = clSetKernelArg(kernel, 0, sizeof(cl_uint), &draws);
+    err |= clSetKernelArg(kernel, 1, sizeof(cl_uint), &seed);
+    err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &out);
+    CL_CHECK_SUCCESS(err, "Error: Failed to set kernel arguments!\n");
+
+    vector<cl_uint> device(numStreams * draws * 2);
+    int mismatches = 0;
+    for (size_t offset : offsets)
+    {
+        size_t global_work_size = numStreams;
+        err = clEnqueueNDRangeKernel(commands, kernel, 1, &offset, &global_work_size, NULL, 0, NULL, NULL);
+        CL_CHECK_SUCCESS(err, "Error: Failed to execute kernel!\n");
+        err = clEnqueueReadBuffer(commands, out, CL_TRUE, 0, size, &device[0], 0, NULL, NULL);
+        CL_CHECK_SUCCESS(err, "Error: Failed to read output buffer!\n");
+
+        for (cl_uint s = 0; s < numStreams; s++)
+        {
+            tinymt32j_t tiny;
+            tinymt32j_init_jump(&tiny, seed, (uint)(offset + s));
+            for (cl_uint i = 0; i < draws; i++)
+            {
+                cl_uint u = tinymt32j_uint32(&tiny);
+                float f = tinymt32j_single01(&tiny);
+                cl_uint fbits;
+                memcpy(&fbits, &f, sizeof(fbits));
+                const cl_uint* d = &device[(s * draws + i) * 2];
+                if ((d[0] != u || d[1] != fbits) && mismatches++ == 0)
+                    fprintf(stderr, "stream %u, draw %u: device %08x %08x, host %08x %08x\n",
+                        (unsigned int)(offset + s), i, d[0], d[1], u, fbits);
+            }
+        }
+    }
+    fprintf(stdout, "streams = %u x 2, draws = %u, mismatches = %d\n\n", numStreams, draws, mismatches);
+
+    clReleaseMemObject(out);
+    clReleaseKernel(kernel);
+    return mismatches == 0 ? 0 : EXIT_FAILURE;
+}
 
 int main(int argc, char* argv[])
 {
     int deviceIndex = 1;
     const char* kernelName = "pi_v2";
     bool profiling = true;
-    if (argc >= 2)
-        deviceIndex = atoi(argv[1]);
-    if (argc >= 3)
-        kernelName = argv[2];
-    if (argc >= 4)
-        profiling = (strcmp(argv[3], "1") == 0);
+    cl_uint numReplicas = 0;
+    bool verify = false;
+    const char* traceFile = nullptr;
+    const char* metricsFile = nullptr;
+    const char* historyFile = nullptr;
+    int repeat = 0;
+    int warmup = 1;
+    double budget = 0;            // share of the device, 0.3 or 30%
+    int numPositional = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--ensemble") == 0 && i + 1 < argc)
+        {
+            char* end;
+            long n = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || n <= 0 || n > INT32_MAX)
+            {
+                fprintf(stderr, "--ensemble needs a positive number of replicas, not %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            numReplicas = (cl_uint)n;
+            continue;
+        }
+        if (strcmp(argv[i], "--verify-streams") == 0)
+        {
+            verify = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+        {
+            traceFile = argv[++i];
+            continue;
+        }
+        if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+        {
+            repeat = atoi(argv[++i]);
+            continue;
+        }
+        if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc)
+        {
+            warmup = std::max(atoi(argv[++i]), 0);
+            continue;
+        }
+        if (strcmp(argv[i], "--history") == 0 && i + 1 < argc)
+        {
+            historyFile = argv[++i];
+            continue;
+        }
+        if (strcmp(argv[i], "--metrics-file") == 0 && i + 1 < argc)
+        {
+            metricsFile = argv[++i];
+            continue;
+        }
+        if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc)
+        {
+            char* end;
+            budget = strtod(argv[++i], &end);
+            if (*end == '%')
+                budget /= 100;
+            continue;
+        }
+        if (numPositional == 0)
+            deviceIndex = atoi(argv[i]);
+        else if (numPositional == 1)
+            kernelName = argv[i];
+        else if (numPositional == 2)
+            profiling = (strcmp(argv[i], "1") == 0);
+        numPositional++;
+    }
+    if (numReplicas > 0 || verify || repeat > 0)
+        profiling = false;
     fprintf(stdout, "device_index: %d\n", deviceIndex);
-    fprintf(stdout, "kernel: %s\n", kernelName);
+    // Ensembles run the _ensemble variant of the kernel.
+    string runKernel = numReplicas > 0 ? string(kernelName) + "_ensemble" : string(kernelName);
+    fprintf(stdout, "kernel: %s\n", runKernel.c_str());
     fprintf(stdout, "profiling: %d\n", profiling ? 1 : 0);
     fprintf(stdout, "\n");
 
-    CLSource src;
-    if (!loadSource("..", src))
+    if (traceFile)
     {
-        fprintf(stderr, "Error: Can not load source\n");
-        return EXIT_FAILURE;
+        tracer().enable();
+        TRACE_THREAD_NAME("host");
     }
 
+    double phaseMs[HISTORY_NUM_PHASES] = { 0 };
+    auto phase = steady_clock::now();
     int err;
-    const int MAX_PLATFORMS = 2;
-    const int MAX_DEVICES = 8;
-    cl_platform_id platformIDs[MAX_PLATFORMS] = {0};
-    cl_device_id deviceIDs[MAX_DEVICES] = {0};
-    cl_uint numPlatforms = 0;
-    cl_uint numDevices = 0;
-    err = clGetPlatformIDs(MAX_PLATFORMS, platformIDs, &numPlatforms);
-    CL_CHECK_SUCCESS(err, "Error: Failed to get platform ID!\n");
-    for (cl_uint i = 0; i < numPlatforms; i++)
+    std::string error;
+
+    // The kernel sources load while the platforms are enumerated.
+    OpenCLEstimator estimator;
+    estimator.prefetch("..");
+    vector<cl_device_id> deviceIDs;
+    bool listed = OpenCLEstimator::listDevices(deviceIDs, error);
+    double enumerateMs = msSince(phase);
+    if (!listed)
     {
-        cl_uint num = 0;
-        err = clGetDeviceIDs(platformIDs[i], CL_DEVICE_TYPE_GPU, MAX_DEVICES-numDevices, deviceIDs+numDevices, &num);
-        CL_CHECK_SUCCESS(err, "Error: Failed to get device ID!\n");
-        numDevices += num;
+        fprintf(stderr, "Error: %s\n", error.c_str());
+        return EXIT_FAILURE;
     }
-    if (numDevices == 0)
+    if (deviceIDs.empty())
     {
         fprintf(stderr, "Error: no GPU found\n");
         return EXIT_FAILURE;
     }
-    for (cl_uint i = 0; i < numDevices; i++)
+    for (size_t i = 0; i < deviceIDs.size(); i++)
     {
         char deviceName[101] = {0};
         clGetDeviceInfo(deviceIDs[i], CL_DEVICE_NAME, 100, deviceName, NULL);
-        fprintf(stdout, "Device_%d: %s\n", i + 1, deviceName);
+        fprintf(stdout, "Device_%d: %s\n", (int)i + 1, deviceName);
 
         char deviceVersion[101] = {0};
         clGetDeviceInfo(deviceIDs[i], CL_DEVICE_VERSION, 100, deviceVersion, NULL);
@@ -353,48 +537,46 @@ int main(int argc, char* argv[])
     }
     fprintf(stdout, "\n");
 
-    if (deviceIndex <= 0 || deviceIndex > (int)numDevices)
+    if (deviceIndex <= 0 || deviceIndex > (int)deviceIDs.size())
     {
          fprintf(stderr, "Invalid device_index!\n");
          return EXIT_FAILURE;
     }
     fprintf(stdout, "Selected Device: Device_%d\n\n", deviceIndex);
-    cl_device_id device = deviceIDs[deviceIndex - 1];
-
-    // Create a compute context
-    cl_context context = clCreateContext(0, 1, &device, NULL, NULL, &err);
-    CL_CHECK_RESULT(context, "Error: Failed to create a compute context!\n");
-
-    // Create a command queue
-    cl_command_queue commands = clCreateCommandQueue(context, device, 0, &err);
-    CL_CHECK_RESULT(commands, "Error: Failed to create a command queue!\n");
 
-    // Create the compute program from the source buffer
-    const char* strings[1] = { src.data().c_str() };
-    cl_program program = clCreateProgramWithSource(context, 1, (const char **)strings, NULL, &err);
-    CL_CHECK_RESULT(program, "Error: Failed to create compute program!\n");
-
-    // Build the program
-    err = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
-    if (err != CL_SUCCESS)
+    // Context, queue with timestamps of commands when tracing, program
+    // and buffers, kept for every run below.
+    bool timed = traceFile || metricsFile;
+    if (!estimator.create(deviceIDs[deviceIndex - 1], kernelName, "..", N_THREADS, timed))
     {
-        size_t len;
-        char buffer[2048];
-        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, sizeof(buffer), buffer, &len);
-        fprintf(stderr, "%s\n", buffer);
+        fprintf(stderr, "Error: %s\n", estimator.error().c_str());
+        return EXIT_FAILURE;
     }
-    CL_CHECK_SUCCESS(err, "Error: Failed to build program!\n");
-
-    // Create the compute kernel
-    cl_kernel kernel = clCreateKernel(program, kernelName, &err);
-    CL_CHECK_RESULT(kernel, "Error: Failed to create compute kernel!\n");
+    phaseMs[HISTORY_SETUP] = msSince(phase);
+    estimator.setBudget(budget);
+
+    // Every phase on its own, and what running them side by side saved.
+    const OpenCLStartup& startup = estimator.startup();
+    double serialMs = enumerateMs + startup.source_ms + startup.context_ms + startup.build_ms + startup.buffers_ms +
+                      startup.kernels_ms;
+    fprintf(stdout, "startup: enumerate = %.3fms, source = %.3fms, context = %.3fms, build = %.3fms\n",
+            enumerateMs, startup.source_ms, startup.context_ms, startup.build_ms);
+    fprintf(stdout, "         buffers = %.3fms (during build), kernels = %.3fms\n", startup.buffers_ms,
+            startup.kernels_ms);
+    fprintf(stdout, "         total = %.3fms, serial = %.3fms, overlap saved = %.3fms\n\n", phaseMs[HISTORY_SETUP],
+            serialMs, std::max(serialMs - phaseMs[HISTORY_SETUP], 0.0));
+    Metrics metrics;
+    if (metricsFile)
+        metrics.setDevice(estimator.deviceName().c_str());
 
     unsigned int numPasses = 1;
+    bool gpaActive = false;
     if (profiling)
     {
-        if (GPA_Init(commands, numPasses))
+        if (GPA_Init(estimator.queue(), numPasses))
         {
             fprintf(stdout, "GPA init OK, numPasses=%u\n\n", numPasses);
+            gpaActive = true;
         }
         else
         {
@@ -403,83 +585,29 @@ int main(int argc, char* argv[])
         }
     }
 
-    auto start = system_clock::now();
-
-    size_t max_workgroup_size = 0;
-    cl_uint max_workitem_dims = 0;
-    err = clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &max_workgroup_size, NULL);
-    CL_CHECK_SUCCESS(err, "Error: Failed to query CL_DEVICE_MAX_WORK_GROUP_SIZE!\n");
-    err = clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS, sizeof(cl_uint), &max_workitem_dims, NULL);
-    CL_CHECK_SUCCESS(err, "Error: Failed to query CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS!\n");
-    unique_ptr<size_t[]> max_workitem_sizes(new size_t[max_workitem_dims]);
-    err = clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(size_t)*max_workitem_dims, max_workitem_sizes.get(), NULL);
-    CL_CHECK_SUCCESS(err, "Error: Failed to query CL_DEVICE_MAX_WORK_ITEM_SIZES!\n");
-    // Calculate global_work_size/local_work_size
-    size_t local_work_size = std::min(max_workgroup_size, max_workitem_sizes[0]);
-    size_t global_work_size = ((N_THREADS - 1) / local_work_size + 1) * local_work_size;
-
-    // Prepare input && output buffer
-    cl_mem results = clCreateBuffer(context, CL_MEM_WRITE_ONLY, sizeof(cl_uint) * global_work_size, NULL, NULL);
-    CL_CHECK_RESULT(results, "Error: Failed to allocate device memory!\n");
-
-    // Set the arguments to our compute kernel
-    cl_uint iters = ITERS_PER_THREAD;
-    cl_uint seed = 42;
-    err  = clSetKernelArg(kernel, 0, sizeof(cl_uint), &iters);
-    err |= clSetKernelArg(kernel, 1, sizeof(cl_uint), &seed);
-    err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &results);
-    CL_CHECK_SUCCESS(err, "Error: Failed to set kernel arguments!\n");
-
-    for (unsigned int pass = 0; pass < numPasses; pass++)
-    {
-        if (!GPA_BeginPass(pass))
-            fprintf(stderr, "GPA_BeginPass failed, pass=%u\n", pass);
-
-        // Execute the kernel
-        err = clEnqueueNDRangeKernel(commands, kernel, 1, NULL, &global_work_size, &local_work_size, 0, NULL, NULL);
-        CL_CHECK_SUCCESS(err, "Error: Failed to execute kernel!\n");
-
-        if (!GPA_EndPass(pass))
-            fprintf(stderr, "GPA_EndPass failed, pass=%u\n", pass);
-    }
-
-    // Blocks until commands have completed
-    clFinish(commands);
-
-    // Read back the results from the device
-    vector<cl_uint> host_results(global_work_size);
-    err = clEnqueueReadBuffer(commands, results, CL_TRUE, 0, sizeof(cl_uint) * global_work_size, &host_results[0], 0, NULL, NULL);
-    CL_CHECK_SUCCESS(err, "Error: Failed to read output buffer!\n");
-
-    // Calculate pi
-    cl_ulong total = 0;
-    for (cl_uint threadCount : host_results) 
-    {
-        total += threadCount;
-    }
-    double pi = static_cast<double>(total) / (ITERS_PER_THREAD * global_work_size) * 4;
-    double pi_true = acos(-1.0);  // true value of pi
-    double error = abs(pi - pi_true) / pi_true * 100;
-
-    auto duration = duration_cast<microseconds>(system_clock::now() - start);
-
-    fprintf(stdout, "local_work_size = %d\n", (unsigned int)local_work_size);
-    fprintf(stdout, "global_work_size = %d\n", (unsigned int)global_work_size);
-    fprintf(stdout, "iterates = %d\n", ITERS_PER_THREAD);
-    fprintf(stdout, "samples = %lld (%lld required)\n", 
-        (long long)(ITERS_PER_THREAD * global_work_size), (long long)(ITERS_PER_THREAD * N_THREADS));
-    fprintf(stdout, "duration = %.2fms\n", duration.count()/(1000.0*numPasses));
-    fprintf(stdout, "pi = %f (%f%% error)\n", pi, error);
-    fprintf(stdout, "\n");
-
-    GPA_Uninit();
-
-    // Shutdown and cleanup
-    clReleaseMemObject(results);
-    clReleaseKernel(kernel);
-    clReleaseProgram(program);
-    clReleaseCommandQueue(commands);
-    clReleaseContext(context);
-
-    return 0;
+    // The sample count of the original fixed dispatch: ITERS_PER_THREAD
+    // on each work item.
+    size_t global_work_size = estimator.globalWorkSize();
+    int64_t samples = (int64_t)ITERS_PER_THREAD * global_work_size;
+
+    // Runs are comparable on the same kernel, size and device.
+    char config[160];
+    snprintf(config, sizeof(config), "kernel=%s items=%u device=%s",
+        runKernel.c_str(), (unsigned int)global_work_size, estimator.deviceName().c_str());
+
+    if (verify)
+        err = verifyStreams(estimator.context(), estimator.queue(), estimator.program());
+    else if (numReplicas > 0)
+        err = runEnsemble(estimator, kernelName, samples, numReplicas, metricsFile ? &metrics : nullptr);
+    else if (repeat > 0)
+        err = runRepeat(estimator, samples, repeat, warmup, metricsFile ? &metrics : nullptr, historyFile, config);
+    else
+        err = runEstimate(estimator, samples, numPasses, gpaActive, metricsFile ? &metrics : nullptr,
+                          historyFile, config, phaseMs);
+
+    if (traceFile && !tracer().write(traceFile))
+        fprintf(stderr, "Can not write trace %s\n", traceFile);
+    if (metricsFile && !metrics_write(&metrics, metricsFile))
+        fprintf(stderr, "Can not write metrics %s\n", metricsFile);
+    return err;
 }
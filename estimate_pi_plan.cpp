@@ -0,0 +1,328 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace std;
+using namespace chrono;
+
+#include "estimator.h"
+#ifndef DISABLE_OPENCL
+#include "estimator_opencl.h"
+#endif
+#include "governor.h"
+#include "planner.h"
+#include "stats.h"
+
+static void usage()
+{
+    fprintf(stdout, "usage: estimate_pi_plan calibrate file [--threads n,...] [--opencl device_index,...] [--kernels name,...]\n"
+                    "           [--source dir]\n"
+                    "       estimate_pi_plan run file (samples | --ci95 e | --deadline ms) [--seed s] [--log file]\n"
+                    "           [--source dir]\n");
+    exit(1);
+}
+
+static double ms_since(steady_clock::time_point start)
+{
+    return duration<double, milli>(steady_clock::now() - start).count();
+}
+
+static vector<string> split(const char* list)
+{
+    vector<string> items;
+    string s(list);
+    size_t begin = 0;
+    while (begin <= s.size())
+    {
+        size_t end = s.find(',', begin);
+        if (end == string::npos)
+            end = s.size();
+        if (end > begin)
+            items.push_back(s.substr(begin, end - begin));
+        begin = end + 1;
+    }
+    return items;
+}
+
+// The engine of option, with the number of work items it runs in
+// parallel.
+static unique_ptr<Estimator> create_engine(const string& name, const char* source_dir, int64_t& parallel,
+                                           string& error)
+{
+    int threads = 0;
+    if (name == "inline")
+    {
+        parallel = 1;
+        return unique_ptr<Estimator>(new CpuEstimator(0));
+    }
+    if (sscanf(name.c_str(), "cpu:%d", &threads) == 1 && threads > 0)
+    {
+        parallel = threads;
+        return unique_ptr<Estimator>(new CpuEstimator(threads));
+    }
+#ifndef DISABLE_OPENCL
+    int device_index = 0;
+    char kernel[64] = {0};
+    if (sscanf(name.c_str(), "opencl:%d:%63s", &device_index, kernel) == 2)
+    {
+        vector<cl_device_id> devices;
+        if (!OpenCLEstimator::listDevices(devices, error))
+            return nullptr;
+        if (device_index <= 0 || device_index > (int)devices.size())
+        {
+            error = "Invalid device_index!";
+            return nullptr;
+        }
+        unique_ptr<OpenCLEstimator> opencl(new OpenCLEstimator);
+        if (!opencl->create(devices[device_index - 1], kernel, source_dir, N_THREADS, false))
+        {
+            error = opencl->error();
+            return nullptr;
+        }
+        parallel = (int64_t)opencl->globalWorkSize();
+        return unique_ptr<Estimator>(opencl.release());
+    }
+#else
+    (void)source_dir;
+#endif
+    error = "Unknown option " + name;
+    return nullptr;
+}
+
+// Wall time of the fastest of a few warm runs.
+static bool time_run(Estimator& engine, int64_t samples, double& ms)
+{
+    ms = 0;
+    for (int i = 0; i < 3; i++)
+    {
+        EstimateResult result;
+        auto start = steady_clock::now();
+        if (!engine.run(samples, DEFAULT_SEED, EstimateOptions(), result))
+            return false;
+        double t = ms_since(start);
+        ms = i == 0 ? t : std::min(ms, t);
+    }
+    return true;
+}
+
+/**
+ * Measure the setup, the fixed cost and the cost per sample of every
+ * option, from warm runs of a small and a large size.
+ */
+static int calibrate(int argc, char* argv[])
+{
+    if (argc < 1)
+        usage();
+    const char* path = argv[0];
+    vector<string> threads = { to_string(detect_cpu_limits().effective) };
+    vector<string> devices;
+    vector<string> kernels = { "pi_v2" };
+    const char* source_dir = "..";
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 >= argc)
+            usage();
+        if (strcmp(argv[i], "--threads") == 0)
+            threads = split(argv[++i]);
+        else if (strcmp(argv[i], "--opencl") == 0)
+            devices = split(argv[++i]);
+        else if (strcmp(argv[i], "--kernels") == 0)
+            kernels = split(argv[++i]);
+        else if (strcmp(argv[i], "--source") == 0)
+            source_dir = argv[++i];
+        else
+            usage();
+    }
+
+    vector<string> names = { "inline" };
+    for (const string& t : threads)
+        names.push_back("cpu:" + t);
+    for (const string& d : devices)
+    {
+        for (const string& k : kernels)
+            names.push_back("opencl:" + d + ":" + k);
+    }
+
+    vector<PlanOption> options;
+    fprintf(stdout, "%-24s %10s %10s %12s %14s\n", "option", "setup ms", "fixed ms", "ns/sample", "samples/s");
+    for (const string& name : names)
+    {
+        PlanOption o;
+        o.name = name;
+        string error;
+        auto start = steady_clock::now();
+        unique_ptr<Estimator> engine = create_engine(name, source_dir, o.parallel, error);
+        if (!engine)
+        {
+            fprintf(stderr, "%s: %s\n", name.c_str(), error.c_str());
+            return EXIT_FAILURE;
+        }
+        o.setup_ms = ms_since(start);
+
+        // Small: one step of the critical path. Large: enough steps for
+        // the per-sample cost to dominate.
+        int64_t n1 = o.opencl() ? o.parallel : CHUNK_SAMPLES;
+        int64_t n2 = o.opencl() ? o.parallel * 1000 : o.inlined() ? 8 * CHUNK_SAMPLES : o.parallel * 8 * CHUNK_SAMPLES;
+        double ms1, ms2;
+        if (!time_run(*engine, n1, ms1) || !time_run(*engine, n2, ms2))
+        {
+            fprintf(stderr, "%s: %s\n", name.c_str(), engine->error().c_str());
+            return EXIT_FAILURE;
+        }
+        o.fit(n1, ms1, n2, ms2);
+        fprintf(stdout, "%-24s %10.3f %10.3f %12.4f %14.4g\n", name.c_str(), o.setup_ms, o.fixed_ms, o.ns_per_sample,
+                n2 / (o.fixed_ms + o.ns_per_sample * o.critical(n2) / 1e6) * 1000);
+        options.push_back(o);
+    }
+
+    Calibration calibration;
+    calibration.load(path);
+    calibration.replace(host_fingerprint(), options);
+    if (!calibration.save(path))
+    {
+        fprintf(stderr, "Can not write %s\n", path);
+        return EXIT_FAILURE;
+    }
+    fprintf(stdout, "\n");
+    return 0;
+}
+
+// Append a prediction and the actual time to log, a CSV file.
+static void log_plan(const char* log, const string& request, const PlanOption& option, const Plan& plan,
+                     double actual_ms)
+{
+    FILE* f = fopen(log, "a");
+    if (!f)
+    {
+        fprintf(stderr, "Can not write %s\n", log);
+        return;
+    }
+    if (ftell(f) == 0)
+        fprintf(f, "time,host,request,option,samples,predicted_ms,actual_ms\n");
+    fprintf(f, "%llu,%016llx,%s,%s,%lld,%.3f,%.3f\n", (unsigned long long)time(NULL),
+            (unsigned long long)host_fingerprint(), request.c_str(), option.name.c_str(), (long long)plan.samples,
+            plan.predicted_ms, actual_ms);
+    fclose(f);
+}
+
+/**
+ * Predict every calibrated option, run the chosen one in this process
+ * and compare the prediction with the actual wall time, engine setup
+ * included.
+ */
+static int run(int argc, char* argv[])
+{
+    if (argc < 2)
+        usage();
+    const char* path = argv[0];
+    int64_t samples = 0;
+    double ci95 = 0;
+    double deadline_ms = 0;
+    uint32_t seed = DEFAULT_SEED;
+    const char* log = nullptr;
+    const char* source_dir = "..";
+    int i = 1;
+    if (argv[1][0] != '-')
+        samples = atoll(argv[i++]);
+    for (; i < argc; i++)
+    {
+        if (i + 1 >= argc)
+            usage();
+        if (strcmp(argv[i], "--ci95") == 0)
+            ci95 = atof(argv[++i]);
+        else if (strcmp(argv[i], "--deadline") == 0)
+            deadline_ms = atof(argv[++i]);
+        else if (strcmp(argv[i], "--seed") == 0)
+            seed = (uint32_t)strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--log") == 0)
+            log = argv[++i];
+        else if (strcmp(argv[i], "--source") == 0)
+            source_dir = argv[++i];
+        else
+            usage();
+    }
+    if ((samples > 0) + (ci95 > 0) + (deadline_ms > 0) != 1)
+        usage();
+
+    Calibration calibration;
+    calibration.load(path);
+    vector<PlanOption> options = calibration.options(host_fingerprint());
+    if (options.empty())
+    {
+        fprintf(stderr, "No calibration of this host in %s, run estimate_pi_plan calibrate first\n", path);
+        return EXIT_FAILURE;
+    }
+
+    string request;
+    Plan plan;
+    if (deadline_ms > 0)
+    {
+        request = "deadline=" + to_string(deadline_ms);
+        plan = plan_deadline(options, deadline_ms);
+    }
+    else
+    {
+        if (ci95 > 0)
+        {
+            request = "ci95=" + to_string(ci95);
+            samples = samples_for_ci95(ci95);
+        }
+        else
+        {
+            request = "samples=" + to_string(samples);
+        }
+        plan = plan_fastest(options, samples);
+    }
+    if (plan.option < 0)
+    {
+        fprintf(stderr, "No option meets the deadline\n");
+        return EXIT_FAILURE;
+    }
+
+    fprintf(stdout, "%-24s %14s %14s\n", "option", "samples", "predicted ms");
+    for (size_t k = 0; k < options.size(); k++)
+    {
+        int64_t n = deadline_ms > 0 ? options[k].samples_within(deadline_ms) : samples;
+        fprintf(stdout, "%-24s %14lld %14.3f%s\n", options[k].name.c_str(), (long long)n, options[k].predict_ms(n),
+                (int)k == plan.option ? "  <-" : "");
+    }
+
+    const PlanOption& option = options[plan.option];
+    auto start = steady_clock::now();
+    string error;
+    int64_t parallel;
+    unique_ptr<Estimator> engine = create_engine(option.name, source_dir, parallel, error);
+    EstimateResult result;
+    if (!engine || !engine->run(plan.samples, seed, EstimateOptions(), result))
+    {
+        fprintf(stderr, "Error: %s\n", engine ? engine->error().c_str() : error.c_str());
+        return EXIT_FAILURE;
+    }
+    double actual_ms = ms_since(start);
+
+    fprintf(stdout, "samples = %lld\n", (long long)result.samples);
+    fprintf(stdout, "pi = %f (%f%% error)\n", result.pi, pi_error(result.pi));
+    fprintf(stdout, "ci95 = %f\n", result.ci95);
+    fprintf(stdout, "plan = %s, predicted = %.3fms, actual = %.3fms (%+.1f%%)\n", option.name.c_str(),
+            plan.predicted_ms, actual_ms, (actual_ms - plan.predicted_ms) / plan.predicted_ms * 100);
+    fprintf(stdout, "\n");
+    if (log)
+        log_plan(log, request, option, plan, actual_ms);
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc >= 2 && strcmp(argv[1], "calibrate") == 0)
+        return calibrate(argc - 2, argv + 2);
+    if (argc >= 2 && strcmp(argv[1], "run") == 0)
+        return run(argc - 2, argv + 2);
+    usage();
+    return 1;
+}
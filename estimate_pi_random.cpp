@@ -0,0 +1,191 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+using namespace std;
+using namespace chrono;
+
+#include "random_producer.h"
+#include "stats.h"
+
+static void usage()
+{
+    fprintf(stdout, "usage: estimate_pi_random [--threads n] [--consumers n] [--shared] [--blocks n] [--seconds s]\n"
+                    "           [--seed s] [--pin] [--verify]\n");
+    exit(1);
+}
+
+// What one consumer thread got.
+struct Consumer
+{
+    int64_t blocks;
+    int64_t inside;
+    int64_t waits;
+    double wait_ms;
+};
+
+// Borrow blocks until the deadline, using every pair of uniforms as a
+// point so that all of the data is read.
+static void consume(RandomChannel* channel, steady_clock::time_point deadline, Consumer* c)
+{
+    TRACE_THREAD_NAME("consumer");
+    RandomBlock block;
+    while (steady_clock::now() < deadline && channel->borrow(block))
+    {
+        int64_t inside = 0;
+        for (size_t i = 0; i < block.size; i += 2)
+        {
+            float x = block.data[i];
+            float y = block.data[i + 1];
+            inside += x * x + y * y <= 1;
+        }
+        channel->give_back(block);
+        c->inside += inside;
+        c->blocks++;
+    }
+}
+
+// Compare the first block of stream with tinymt32j_single01() on its
+// lanes, return the number of differences.
+static int verify(RandomProducer& producer, uint32_t seed, uint32_t stream)
+{
+    shared_ptr<RandomChannel> channel = producer.attach(stream, 2);
+    RandomBlock block;
+    int mismatches = 0;
+    if (!channel->borrow(block))
+        return -1;
+    for (int k = 0; k < RANDOM_LANES; k++)
+    {
+        tinymt32j_t tiny;
+        tinymt32j_init_jump(&tiny, seed, stream * RANDOM_LANES + k);
+        for (size_t i = k; i < block.size; i += RANDOM_LANES)
+        {
+            float f = tinymt32j_single01(&tiny);
+            if (f != block.data[i] && mismatches++ == 0)
+                fprintf(stderr, "lane %d, draw %u: %.9g, host %.9g\n", k, (unsigned int)(i / RANDOM_LANES),
+                        block.data[i], f);
+        }
+    }
+    channel->give_back(block);
+    producer.detach(channel);
+    return mismatches;
+}
+
+// Bytes per second of memcpy between two buffers far larger than the
+// caches, for a reference.
+static double copy_bandwidth()
+{
+    size_t size = 64 << 20;
+    unique_ptr<char[]> a(new char[size]), b(new char[size]);
+    memset(a.get(), 1, size);
+    memset(b.get(), 2, size);
+    double best = 0;
+    for (int i = 0; i < 5; i++)
+    {
+        auto start = steady_clock::now();
+        memcpy(b.get(), a.get(), size);
+        double s = duration<double>(steady_clock::now() - start).count();
+        best = std::max(best, size / s);
+    }
+    return best;
+}
+
+int main(int argc, char* argv[])
+{
+    int threads = (int)std::max(thread::hardware_concurrency() / 2, 1u);
+    int consumers = 1;
+    bool shared = false;
+    int blocks = 8;
+    double seconds = 2;
+    uint32_t seed = 42;
+    bool pinned = false;
+    bool verifying = false;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--shared") == 0)
+            shared = true;
+        else if (strcmp(argv[i], "--pin") == 0)
+            pinned = true;
+        else if (strcmp(argv[i], "--verify") == 0)
+            verifying = true;
+        else if (i + 1 >= argc)
+            usage();
+        else if (strcmp(argv[i], "--threads") == 0)
+            threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--consumers") == 0)
+            consumers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--blocks") == 0)
+            blocks = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--seconds") == 0)
+            seconds = atof(argv[++i]);
+        else if (strcmp(argv[i], "--seed") == 0)
+            seed = (uint32_t)strtoul(argv[++i], NULL, 10);
+        else
+            usage();
+    }
+    if (threads <= 0 || consumers <= 0 || blocks <= 0 || seconds <= 0)
+        usage();
+
+    fprintf(stdout, "producer threads = %d%s, consumers = %d, %s channel%s of %d x %d KiB blocks\n", threads,
+            pinned ? " (pinned)" : "", consumers, shared ? "1 shared" : "one", shared ? "" : " each", blocks,
+            (int)(RANDOM_BLOCK_FLOATS * sizeof(float) / 1024));
+    RandomProducer producer(threads, seed, pinned);
+    if (verifying)
+    {
+        int mismatches = verify(producer, seed, 0);
+        fprintf(stdout, "verify: mismatches = %d\n", mismatches);
+        if (mismatches != 0)
+            return EXIT_FAILURE;
+    }
+
+    // Stream ids 1.. so that the verified stream 0 is not reused.
+    vector<shared_ptr<RandomChannel> > channels;
+    for (int c = 0; c < (shared ? 1 : consumers); c++)
+        channels.push_back(producer.attach(c + 1, blocks, shared));
+    vector<Consumer> results(consumers, Consumer());
+    vector<thread> workers;
+    int64_t produced = producer.blocks();
+    auto start = steady_clock::now();
+    auto deadline = start + duration_cast<steady_clock::duration>(duration<double>(seconds));
+    for (int c = 0; c < consumers; c++)
+        workers.push_back(thread(consume, channels[shared ? 0 : c].get(), deadline, &results[c]));
+    for (auto& w : workers)
+        w.join();
+    double elapsed = duration<double>(steady_clock::now() - start).count();
+    produced = producer.blocks() - produced;
+
+    int64_t total = 0;
+    int64_t inside = 0;
+    const double bytes = RANDOM_BLOCK_FLOATS * sizeof(float);
+    fprintf(stdout, "%-10s %10s %10s %10s %12s\n", "consumer", "blocks", "GB/s", "waits", "waited ms");
+    for (int c = 0; c < consumers; c++)
+    {
+        const Consumer& r = results[c];
+        RandomChannel* channel = channels[shared ? 0 : c].get();
+        fprintf(stdout, "%-10d %10lld %10.3f", c, (long long)r.blocks, r.blocks * bytes / elapsed / 1e9);
+        if (shared)
+            fprintf(stdout, "\n");
+        else
+            fprintf(stdout, " %10lld %12.3f\n", (long long)channel->waits(), channel->wait_ms());
+        total += r.blocks;
+        inside += r.inside;
+    }
+    if (shared)
+        fprintf(stdout, "shared: waits = %lld, waited = %.3fms\n", (long long)channels[0]->waits(),
+                channels[0]->wait_ms());
+    for (auto& channel : channels)
+        producer.detach(channel);
+
+    double pi = 4.0 * inside / (total * RANDOM_BLOCK_FLOATS / 2.0);
+    fprintf(stdout, "total = %.3f GB/s (%.3g uniforms/s), memcpy = %.3f GB/s\n", total * bytes / elapsed / 1e9,
+            total * RANDOM_BLOCK_FLOATS / elapsed, copy_bandwidth() / 1e9);
+    fprintf(stdout, "producer: blocks = %lld, idle waits = %lld\n", (long long)produced,
+            (long long)producer.idle_waits());
+    fprintf(stdout, "pi = %f (%f%% error)\n", pi, pi_error(pi));
+    fprintf(stdout, "\n");
+    return 0;
+}
@@ -0,0 +1,234 @@
+/* C++ API of libestimatepi: long-lived estimators per backend. */
+
+#ifndef __ESTIMATOR_H__
+#define __ESTIMATOR_H__
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "pi_cpu.h"
+#include "history.h"
+
+/**
+ * Stops a submitted estimate. Copies share the flag; the CPU workers
+ * check it before every chunk and the OpenCL backend between batches of
+ * work items, so a cancelled estimate ends within about one chunk. A
+ * default-constructed token can not be cancelled.
+ */
+class CancelToken
+{
+    std::shared_ptr<std::atomic<bool> > flag_;
+public:
+    static CancelToken create()
+    {
+        CancelToken t;
+        t.flag_ = std::make_shared<std::atomic<bool> >(false);
+        return t;
+    }
+    bool valid() const
+    {
+        return flag_ != nullptr;
+    }
+    void cancel()
+    {
+        if (flag_)
+            flag_->store(true);
+    }
+    bool cancelled() const
+    {
+        return flag_ && flag_->load(std::memory_order_relaxed);
+    }
+    const std::atomic<bool>* flag() const
+    {
+        return flag_.get();
+    }
+};
+
+/**
+ * What to compute besides the plain count. Replicas, checkpoints and
+ * resuming are CPU features; the OpenCL backend supports replicas only.
+ */
+struct EstimateOptions
+{
+    int replicas;
+    int first_replica;            // replica_hits[r] is of replica first_replica + r
+    // Of replica 0, increasing within (prefix_samples, samples]; with
+    // first_replica 0 only.
+    std::vector<int64_t> checkpoints;
+    int64_t prefix_samples;       // already counted, see ResultCache
+    int64_t prefix_hits;
+#if USE_TINYMT
+    tinymt32j_t resume_state;     // state after prefix_samples
+#endif
+    bool perf;                    // hardware counters per thread
+    Metrics* metrics;
+    CancelToken cancel;
+    // Scheduling among concurrent estimates of the CPU backend, see
+    // WorkerPool: higher priorities first, then tenants by weight.
+    int tenant;
+    int priority;
+    std::string kernel;           // OpenCL variant, empty for the engine's
+
+    EstimateOptions() : replicas(1), first_replica(0), prefix_samples(0), prefix_hits(0), perf(false), metrics(nullptr),
+                        tenant(0), priority(0)
+    {
+#if USE_TINYMT
+        memset(&resume_state, 0, sizeof(resume_state));
+#endif
+    }
+};
+
+/**
+ * A cancelled estimate is partial: samples and hits cover the chunks of
+ * replica 0 that were done, checkpoint_hits the checkpoints they reach.
+ */
+struct EstimateResult
+{
+    std::string error;            // empty on success
+    bool cancelled;
+    int64_t samples;              // per replica, including the prefix
+    int64_t hits;                 // of replica 0, including the prefix
+    double pi;
+    double ci95;
+    double phase_ms[HISTORY_NUM_PHASES];
+    int64_t chunks;               // chunks or work items computed
+    double busy_ms;               // thread or device time spent computing
+    std::vector<int64_t> replica_hits;      // without the prefix, done chunks only
+    std::vector<int64_t> checkpoint_hits;   // including the prefix
+    std::vector<ThreadStats> thread_stats;
+#if USE_TINYMT
+    tinymt32j_t last_state;       // of the last chunk of replica 0
+#endif
+
+    EstimateResult() : cancelled(false), samples(0), hits(0), pi(0), ci95(0), chunks(0), busy_ms(0)
+    {
+        for (int i = 0; i < HISTORY_NUM_PHASES; i++)
+            phase_ms[i] = 0;
+#if USE_TINYMT
+        memset(&last_state, 0, sizeof(last_state));
+#endif
+    }
+};
+
+/**
+ * A backend kept across estimates, so that each run only pays for the
+ * work: the CPU threads, or the OpenCL context and built program, are
+ * set up once.
+ */
+class Estimator
+{
+public:
+    virtual ~Estimator()
+    {
+    }
+    // Estimate pi from samples samples of the sequence of seed. Returns
+    // false on failure, error() then tells why.
+    virtual bool run(int64_t samples, uint32_t seed, const EstimateOptions& options, EstimateResult& result) = 0;
+    // Start an estimate and return at once; done gets the result, with
+    // error set if it failed, on a thread of the estimator. Returns false
+    // without calling done if the estimate is rejected, error() tells why.
+    // Submissions may overlap and share the backend.
+    typedef std::function<void(const EstimateResult&)> Callback;
+    virtual bool submit(int64_t samples, uint32_t seed, const EstimateOptions& options, Callback done) = 0;
+    // Why the last estimate failed. A copy, since estimates fail on other
+    // threads; the result of a submission has its own error.
+    virtual std::string error() const = 0;
+
+    // submit() with a future of the result.
+    std::future<EstimateResult> async(int64_t samples, uint32_t seed, const EstimateOptions& options)
+    {
+        std::shared_ptr<std::promise<EstimateResult> > promise = std::make_shared<std::promise<EstimateResult> >();
+        std::future<EstimateResult> future = promise->get_future();
+        if (!submit(samples, seed, options, [promise](const EstimateResult& r) { promise->set_value(r); }))
+        {
+            EstimateResult r;
+            r.error = error();
+            promise->set_value(r);
+        }
+        return future;
+    }
+};
+
+/**
+ * The chunked engine of pi_cpu.h on a WorkerPool, shared by all the runs
+ * in progress. Without threads, estimates run inline on the thread that
+ * submits them, which is cheapest for tiny ones.
+ */
+class CpuEstimator : public Estimator
+{
+    WorkerPool pool_;
+    StreamCache streams_;
+    mutable std::mutex mutex_;    // of error_
+    std::string error_;
+
+    Run* prepare(int64_t samples, uint32_t seed, const EstimateOptions& options);
+public:
+    explicit CpuEstimator(int num_threads);
+    int threads() const
+    {
+        return pool_.size();
+    }
+    // Threads taking chunks, see WorkerPool::set_active().
+    int activeThreads()
+    {
+        return pool_.active();
+    }
+    void setActiveThreads(int threads)
+    {
+        pool_.set_active(threads);
+    }
+    // Threads that compute a run, the caller's when inline.
+    int workers() const
+    {
+        return std::max(pool_.size(), 1);
+    }
+    // Compute the start states of the first chunks of seed once, for the
+    // runs that follow. Not while runs are in progress.
+    void warm(uint32_t seed, int64_t chunks)
+    {
+        streams_.fill(seed, chunks);
+    }
+    // Cores worth of compute the threads may use together, 0 for no
+    // limit, see WorkerPool::set_budget(). Inline runs are not paced.
+    double budget()
+    {
+        return pool_.budget();
+    }
+    void setBudget(double cores)
+    {
+        pool_.set_budget(cores);
+    }
+    // Share of the threads tenant gets next to the other tenants with
+    // estimates of the same priority, 1 by default.
+    void setWeight(int tenant, int weight)
+    {
+        pool_.set_weight(tenant, weight);
+    }
+    bool run(int64_t samples, uint32_t seed, const EstimateOptions& options, EstimateResult& result) override;
+    bool submit(int64_t samples, uint32_t seed, const EstimateOptions& options, Callback done) override;
+    std::string error() const override
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return error_;
+    }
+};
+
+// Handles behind the C API of estimate_pi.h.
+struct epi_estimator
+{
+    Estimator* impl;
+    mutable std::string error;    // returned by epi_error()
+};
+
+struct epi_cancel
+{
+    CancelToken token;
+};
+
+#endif /* EOF */
@@ -0,0 +1,239 @@
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+#include <vector>
+using namespace std;
+using namespace chrono;
+
+#include "estimator.h"
+#include "estimate_pi.h"
+#include "stats.h"
+
+static double ms_since(steady_clock::time_point start)
+{
+    return duration<double, milli>(steady_clock::now() - start).count();
+}
+
+CpuEstimator::CpuEstimator(int num_threads) : pool_(num_threads)
+{
+}
+
+Run* CpuEstimator::prepare(int64_t samples, uint32_t seed, const EstimateOptions& options)
+{
+    if (samples <= 0 || options.replicas <= 0 || options.first_replica < 0 || options.prefix_samples > samples ||
+        (samples + CHUNK_SAMPLES - 1) / CHUNK_SAMPLES * ((int64_t)options.first_replica + options.replicas) >
+            MAX_CHUNKS ||
+        (options.first_replica > 0 && (options.prefix_samples > 0 || !options.checkpoints.empty())))
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        error_ = "invalid number of samples or replicas";
+        return nullptr;
+    }
+    // Each checkpoint is counted from the chunk it ends in and the ones
+    // before it, which needs them increasing past the prefix.
+    for (size_t k = 0; k < options.checkpoints.size(); k++)
+    {
+        int64_t previous = k > 0 ? options.checkpoints[k - 1] : options.prefix_samples;
+        if (options.checkpoints[k] <= previous || options.checkpoints[k] > samples)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            error_ = "checkpoints must increase within (prefix_samples, samples]";
+            return nullptr;
+        }
+    }
+    Run* run = new Run(samples, options.prefix_samples, options.replicas);
+    run->seed = seed;
+    run->first_replica = options.first_replica;
+    run->perf = options.perf;
+    run->metrics = options.metrics;
+    run->cancel = options.cancel.flag();
+    run->streams = &streams_;
+#if USE_TINYMT
+    run->resume_state = options.resume_state;
+#endif
+    run->checkpoints = options.checkpoints;
+    run->checkpoint_points.resize(run->checkpoints.size());
+    run->thread_stats.assign(workers(), ThreadStats());
+    if (run->metrics)
+        run->metrics->start(workers(), run->num_samples * run->num_replicas);
+    return run;
+}
+
+// Counts of a finished run. Only the completed tasks count when it was
+// cancelled, they are a prefix in replica-major order.
+static void reduce_run(const Run& run, int64_t prefix_hits, EstimateResult& result)
+{
+    int64_t done = completed_tasks(&run);
+    int64_t done0 = min(done, run.tasks_per_replica);
+    result.cancelled = done < run.num_tasks;
+    result.samples = done0 == run.tasks_per_replica ? run.num_samples
+        : done0 > 0 ? (run.first_chunk + done0) * run.chunk_samples : run.prefix_samples;
+
+    // A checkpoint is made of the chunks before it and the part of the
+    // chunk it ends in.
+    TRACE_BEGIN("reduce", (int64_t)run.checkpoints.size());
+    result.checkpoint_hits.clear();
+    int64_t points = prefix_hits;
+    int64_t task = 0;
+    for (size_t k = 0; k < run.checkpoints.size() && run.checkpoints[k] <= result.samples; k++)
+    {
+        int64_t full_tasks = run.checkpoints[k] / run.chunk_samples - run.first_chunk;
+        for (; task < full_tasks; task++)
+            points += run.task_points[task];
+        result.checkpoint_hits.push_back(points);
+        if (run.checkpoints[k] % run.chunk_samples != 0)
+            result.checkpoint_hits[k] += run.checkpoint_points[k];
+        PROBE3(checkpoint, k, run.checkpoints[k], result.checkpoint_hits[k]);
+    }
+    // Tasks never claimed have no hits.
+    result.replica_hits.resize(run.num_replicas);
+    for (int r = 0; r < run.num_replicas; r++)
+        result.replica_hits[r] = replica_points(&run, r);
+    TRACE_END("reduce");
+
+    result.hits = prefix_hits + result.replica_hits[0];
+    result.pi = result.samples > 0 ? pi_estimate(result.hits, result.samples) : 0;
+    result.ci95 = result.samples > 0 ? pi_ci95(result.hits, result.samples) : 0;
+    result.chunks = done;
+    result.thread_stats = run.thread_stats;
+    for (const ThreadStats& s : run.thread_stats)
+        result.busy_ms += s.busy_ns / 1e6;
+#if USE_TINYMT
+    result.last_state = run.last_state;
+#endif
+}
+
+bool CpuEstimator::submit(int64_t samples, uint32_t seed, const EstimateOptions& options, Callback done)
+{
+    auto start = steady_clock::now();
+    Run* run = prepare(samples, seed, options);
+    if (!run)
+        return false;
+    double setup_ms = ms_since(start);
+    int num_threads = workers();
+    PROBE3(run__start, num_threads, run->num_samples, run->num_tasks);
+    (void)num_threads;
+
+    // options is kept for the cancel flag the run points to.
+    auto compute = steady_clock::now();
+    auto finish = [=]() {
+        PROBE4(run__end, num_threads, run->num_samples, total_points(run), elapsed_ns(compute));
+        EstimateResult result;
+        result.phase_ms[HISTORY_SETUP] = setup_ms;
+        result.phase_ms[HISTORY_COMPUTE] = ms_since(compute);
+        auto phase = steady_clock::now();
+        reduce_run(*run, options.prefix_hits, result);
+        result.phase_ms[HISTORY_REDUCE] = ms_since(phase);
+        result.phase_ms[HISTORY_TOTAL] = ms_since(start);
+        delete run;
+        done(result);
+    };
+    if (pool_.size() == 0)
+    {
+        run_worker(run, 0);
+        finish();
+    }
+    else
+    {
+        pool_.submit(run, finish, options.tenant, options.priority);
+    }
+    return true;
+}
+
+bool CpuEstimator::run(int64_t samples, uint32_t seed, const EstimateOptions& options, EstimateResult& result)
+{
+    EstimateResult r = async(samples, seed, options).get();
+    if (!r.error.empty())
+        return false;
+    result = std::move(r);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+int epi_api_version(void)
+{
+    return EPI_API_VERSION;
+}
+
+epi_estimator* epi_cpu_create(int num_threads)
+{
+    if (num_threads <= 0)
+        return nullptr;
+    epi_estimator* e = new epi_estimator;
+    e->impl = new CpuEstimator(num_threads);
+    return e;
+}
+
+static void to_epi_result(const EstimateResult& r, epi_result* result)
+{
+    result->samples = r.samples;
+    result->hits = r.hits;
+    result->pi = r.pi;
+    result->ci95 = r.ci95;
+    result->setup_ms = r.phase_ms[HISTORY_SETUP];
+    result->compute_ms = r.phase_ms[HISTORY_COMPUTE];
+    result->reduce_ms = r.phase_ms[HISTORY_REDUCE];
+    result->total_ms = r.phase_ms[HISTORY_TOTAL];
+    result->cancelled = r.cancelled ? 1 : 0;
+}
+
+int epi_run(epi_estimator* estimator, int64_t samples, uint32_t seed, epi_result* result)
+{
+    EstimateResult r;
+    if (!estimator || !result || !estimator->impl->run(samples, seed, EstimateOptions(), r))
+        return -1;
+    to_epi_result(r, result);
+    return 0;
+}
+
+int epi_submit(epi_estimator* estimator, int64_t samples, uint32_t seed, epi_cancel* cancel,
+               epi_callback done, void* user)
+{
+    if (!estimator || !done)
+        return -1;
+    EstimateOptions options;
+    if (cancel)
+        options.cancel = cancel->token;
+    bool ok = estimator->impl->submit(samples, seed, options, [=](const EstimateResult& r) {
+        epi_result result;
+        to_epi_result(r, &result);
+        done(r.error.empty() ? 0 : -1, &result, user);
+    });
+    return ok ? 0 : -1;
+}
+
+epi_cancel* epi_cancel_create(void)
+{
+    epi_cancel* c = new epi_cancel;
+    c->token = CancelToken::create();
+    return c;
+}
+
+void epi_cancel_request(epi_cancel* cancel)
+{
+    if (cancel)
+        cancel->token.cancel();
+}
+
+// Submissions keep their own reference to the flag.
+void epi_cancel_destroy(epi_cancel* cancel)
+{
+    delete cancel;
+}
+
+const char* epi_error(const epi_estimator* estimator)
+{
+    if (!estimator)
+        return "no estimator";
+    estimator->error = estimator->impl->error();
+    return estimator->error.c_str();
+}
+
+void epi_destroy(epi_estimator* estimator)
+{
+    if (!estimator)
+        return;
+    delete estimator->impl;
+    delete estimator;
+}
@@ -0,0 +1,823 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace std;
+using namespace std::chrono;
+
+#include "estimator_opencl.h"
+#include "estimate_pi.h"
+#include "stats.h"
+
+//------------------------------------------------------------------------------
+
+class CLSource
+{
+    std::string data_;
+public:
+    CLSource()
+    {
+    }
+    const std::string& data() const
+    {
+        return data_;
+    }
+    bool load(const std::string& filename)
+    {
+        std::ifstream f(filename);
+        if (!f.good())
+            return false;
+        f.seekg(0, std::ios::end);
+        size_t size = f.tellg();
+        data_.resize(size);
+        f.seekg(0);
+        f.read(&data_[0], size);
+        // some file may contains trailing '\0'
+        size_t sz = strlen(&data_[0]);
+        if (sz < size)
+            data_.resize(sz);
+        // make sure we end with a '\n'
+        if (data_.empty() || data_.back() != '\n')
+            data_.append(1, '\n');
+        return true;
+    }
+    int resolveInclude(const std::string& name, const CLSource& inc)
+    {
+        int n = 0;
+        std::string incStr0 = "#include <" + name + ">";
+        std::string incStr1 = "#include \"" + name + "\"";
+        for (;;)
+        {
+            auto startPos = data_.find(incStr0);
+            if (startPos != std::string::npos)
+            {
+                data_.replace(startPos, incStr0.length(), inc.data());
+                n++;
+                continue;
+            }
+            startPos = data_.find(incStr1);
+            if (startPos != std::string::npos)
+            {
+                data_.replace(startPos, incStr1.length(), inc.data());
+                n++;
+                continue;
+            }
+            break;
+        }
+        return n;
+    }
+};
+
+static bool loadSource(const std::string& dir, CLSource& src)
+{
+    CLSource mt19937;
+    if (!mt19937.load(dir + "/3rdparty/RandomCL/generators/mt19937.cl"))
+        return false;
+
+    CLSource tinymt32j;
+    if (!tinymt32j.load(dir + "/tinymt32j.h"))
+        return false;
+
+    if (!src.load(dir + "/pi.cl"))
+        return false;
+    src.resolveInclude("mt19937.cl", mt19937);
+    src.resolveInclude("tinymt32j.h", tinymt32j);
+
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+#define CL_CHECK_RESULT(res, msg) \
+do {                              \
+    if (!(res))                   \
+        return fail(msg);         \
+} while(0)
+
+#define CL_CHECK_SUCCESS(res, msg) \
+do {                               \
+    if ((res) != CL_SUCCESS)       \
+        return fail(msg);          \
+} while(0)
+
+static double msSince(steady_clock::time_point start)
+{
+    return duration<double, milli>(steady_clock::now() - start).count();
+}
+
+// Put the device timestamps of a finished command on the trace timeline.
+// The device clock is aligned by taking its QUEUED time as hostUs, the
+// host time just before the command was enqueued.
+static void traceCommand(cl_event event, double hostUs, const char* name)
+{
+    cl_ulong queued = 0, submit = 0, start = 0, end = 0;
+    if (clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &queued, NULL) != CL_SUCCESS ||
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_SUBMIT, sizeof(cl_ulong), &submit, NULL) != CL_SUCCESS ||
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL) != CL_SUCCESS ||
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL) != CL_SUCCESS)
+        return;
+    // queued -> submitted to the device -> running
+    tracer().addComplete("OpenCL queue", "queued", hostUs, (submit - queued) / 1000.0);
+    tracer().addComplete("OpenCL queue", "submitted", hostUs + (submit - queued) / 1000.0, (start - submit) / 1000.0);
+    tracer().addComplete("OpenCL device", name, hostUs + (start - queued) / 1000.0, (end - start) / 1000.0);
+}
+
+// Execution time of a finished command, 0 if the queue does not profile.
+static int64_t commandNs(cl_event event)
+{
+    cl_ulong start = 0, end = 0;
+    if (clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL) != CL_SUCCESS ||
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL) != CL_SUCCESS)
+        return 0;
+    return (int64_t)(end - start);
+}
+
+//------------------------------------------------------------------------------
+
+OpenCLEstimator::OpenCLEstimator()
+    : device_(NULL), context_(NULL), program_(NULL), localWorkSize_(0), globalWorkSize_(0), timestamps_(false),
+      budget_(0), built_(false), startup_(), quit_(false)
+{
+}
+
+OpenCLEstimator::~OpenCLEstimator()
+{
+    {
+        std::lock_guard<std::mutex> lock(jobMutex_);
+        quit_ = true;
+    }
+    jobReady_.notify_all();
+    for (std::thread& t : dispatchers_)
+        t.join();
+    release();
+}
+
+void OpenCLEstimator::release()
+{
+    for (Lane& lane : lanes_)
+    {
+        for (auto& k : lane.kernels)
+            clReleaseKernel(k.second);
+        cl_mem buffers[4] = { lane.results, lane.groupSums, lane.replicaSums, lane.chunkSums };
+        for (cl_mem buffer : buffers)
+        {
+            if (buffer)
+                clReleaseMemObject(buffer);
+        }
+        if (lane.queue)
+            clReleaseCommandQueue(lane.queue);
+    }
+    lanes_.clear();
+    freeLanes_.clear();
+    if (program_)
+        clReleaseProgram(program_);
+    if (context_)
+        clReleaseContext(context_);
+    program_ = NULL;
+    context_ = NULL;
+}
+
+// The last failure on this thread, the error of the job it runs: lanes
+// fail concurrently and error_ only keeps the last of them.
+static thread_local std::string threadError;
+
+bool OpenCLEstimator::fail(const std::string& message)
+{
+    threadError = message;
+    std::lock_guard<std::mutex> lock(errorMutex_);
+    error_ = message;
+    return false;
+}
+
+// A free lane, waiting for one if they are all taken.
+OpenCLEstimator::Lane* OpenCLEstimator::takeLane()
+{
+    std::unique_lock<std::mutex> lock(laneMutex_);
+    laneFree_.wait(lock, [&] { return !freeLanes_.empty(); });
+    Lane* lane = freeLanes_.back();
+    freeLanes_.pop_back();
+    return lane;
+}
+
+void OpenCLEstimator::returnLane(Lane* lane)
+{
+    {
+        std::lock_guard<std::mutex> lock(laneMutex_);
+        freeLanes_.push_back(lane);
+    }
+    laneFree_.notify_one();
+}
+
+// The kernel object of name on lane, made on first use. NULL on failure.
+cl_kernel OpenCLEstimator::kernel(Lane& lane, const std::string& name)
+{
+    auto k = lane.kernels.find(name);
+    if (k != lane.kernels.end())
+        return k->second;
+    int err;
+    cl_kernel kernel = clCreateKernel(program_, name.c_str(), &err);
+    if (!kernel)
+    {
+        fail("Failed to create compute kernel " + name + "!");
+        return NULL;
+    }
+    lane.kernels[name] = kernel;
+    return kernel;
+}
+
+bool OpenCLEstimator::listDevices(std::vector<cl_device_id>& devices, std::string& error)
+{
+    const int MAX_PLATFORMS = 2;
+    const int MAX_DEVICES = 8;
+    cl_platform_id platformIDs[MAX_PLATFORMS] = {0};
+    cl_device_id deviceIDs[MAX_DEVICES] = {0};
+    cl_uint numPlatforms = 0;
+    cl_uint numDevices = 0;
+    TRACE_SCOPE("platforms");
+    if (clGetPlatformIDs(MAX_PLATFORMS, platformIDs, &numPlatforms) != CL_SUCCESS)
+    {
+        error = "Failed to get platform ID!";
+        return false;
+    }
+    for (cl_uint i = 0; i < numPlatforms; i++)
+    {
+        cl_uint num = 0;
+        if (clGetDeviceIDs(platformIDs[i], CL_DEVICE_TYPE_GPU, MAX_DEVICES-numDevices, deviceIDs+numDevices, &num) != CL_SUCCESS)
+        {
+            error = "Failed to get device ID!";
+            return false;
+        }
+        numDevices += num;
+    }
+    devices.assign(deviceIDs, deviceIDs + numDevices);
+    return true;
+}
+
+void OpenCLEstimator::prefetch(const std::string& sourceDir)
+{
+    if (sourceLoaded_.valid())
+        sourceLoaded_.wait();
+    sourceDir_ = sourceDir;
+    sourceLoaded_ = std::async(std::launch::async, [this, sourceDir] {
+        TRACE_THREAD_NAME("source");
+        TRACE_SCOPE("load_source");
+        auto start = steady_clock::now();
+        CLSource src;
+        bool ok = loadSource(sourceDir, src);
+        source_ = src.data();
+        startup_.source_ms = msSince(start);
+        return ok;
+    });
+}
+
+void CL_CALLBACK OpenCLEstimator::buildFinished(cl_program, void* estimator)
+{
+    OpenCLEstimator* e = (OpenCLEstimator*)estimator;
+    std::lock_guard<std::mutex> lock(e->buildMutex_);
+    e->built_ = true;
+    e->buildDone_.notify_all();
+}
+
+bool OpenCLEstimator::create(cl_device_id device, const char* kernelName, const std::string& sourceDir,
+                             size_t minWorkItems, bool timestamps, int lanes)
+{
+    release();
+    if (setup(device, kernelName, sourceDir, minWorkItems, timestamps, lanes))
+        return true;
+    // Lanes that never became free would block the next run for good.
+    release();
+    return false;
+}
+
+// The steps overlap where they can: the sources load on a thread of their
+// own while the context and queues are made, and the program builds in
+// the background, reporting through buildFinished(), while the device
+// limits are queried and the buffers made. Only the kernels wait for the
+// build.
+bool OpenCLEstimator::setup(cl_device_id device, const char* kernelName, const std::string& sourceDir,
+                            size_t minWorkItems, bool timestamps, int lanes)
+{
+    int err;
+    auto start = steady_clock::now();
+    if (!sourceLoaded_.valid() || sourceDir_ != sourceDir)
+        prefetch(sourceDir);
+    device_ = device;
+    kernelName_ = kernelName;
+    timestamps_ = timestamps;
+    char deviceName[101] = {0};
+    clGetDeviceInfo(device, CL_DEVICE_NAME, 100, deviceName, NULL);
+    deviceName_ = deviceName;
+
+    // Create a compute context
+    TRACE_BEGIN("context", -1);
+    auto phase = steady_clock::now();
+    context_ = clCreateContext(0, 1, &device, NULL, NULL, &err);
+    CL_CHECK_RESULT(context_, "Failed to create a compute context!");
+
+    // Create the command queues, with timestamps of commands when asked
+    cl_command_queue_properties properties = timestamps ? CL_QUEUE_PROFILING_ENABLE : 0;
+    lanes_.resize(std::max(lanes, 1));
+    for (Lane& lane : lanes_)
+    {
+        lane.queue = NULL;
+        lane.results = lane.groupSums = lane.replicaSums = lane.chunkSums = NULL;
+        lane.maxReplicas = 0;
+        lane.maxChunks = 0;
+    }
+    for (Lane& lane : lanes_)
+    {
+        lane.queue = clCreateCommandQueue(context_, device, properties, &err);
+        CL_CHECK_RESULT(lane.queue, "Failed to create a command queue!");
+    }
+    startup_.context_ms = msSince(phase);
+    TRACE_END("context");
+
+    // Create the compute program from the source buffer
+    TRACE_BEGIN("wait_source", -1);
+    bool loaded = sourceLoaded_.get();
+    TRACE_END("wait_source");
+    CL_CHECK_RESULT(loaded, "Can not load source");
+    const char* strings[1] = { source_.c_str() };
+    program_ = clCreateProgramWithSource(context_, 1, (const char **)strings, NULL, &err);
+    CL_CHECK_RESULT(program_, "Failed to create compute program!");
+
+    // Build the program in the background
+    TRACE_BEGIN("build", -1);
+    auto build = steady_clock::now();
+    built_ = false;
+    err = clBuildProgram(program_, 0, NULL, NULL, buildFinished, this);
+
+    // Meanwhile, the work sizes and the output buffers. A started build
+    // calls back into this object, so failures return after it finished.
+    phase = steady_clock::now();
+    bool ready = true;
+    size_t max_workgroup_size = 0;
+    cl_uint max_workitem_dims = 0;
+    int info = clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &max_workgroup_size, NULL);
+    info |= clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS, sizeof(cl_uint), &max_workitem_dims, NULL);
+    unique_ptr<size_t[]> max_workitem_sizes(new size_t[std::max(max_workitem_dims, (cl_uint)1)]);
+    if (info == CL_SUCCESS)
+        info = clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(size_t)*max_workitem_dims, max_workitem_sizes.get(), NULL);
+    if (info != CL_SUCCESS || max_workgroup_size == 0)
+    {
+        ready = fail("Failed to query the work-group limits!");
+    }
+    else
+    {
+        // Calculate global_work_size/local_work_size
+        localWorkSize_ = std::min(max_workgroup_size, max_workitem_sizes[0]);
+        globalWorkSize_ = ((minWorkItems - 1) / localWorkSize_ + 1) * localWorkSize_;
+
+        // Prepare the output buffers
+        TRACE_SCOPE("buffers", -1);
+        for (Lane& lane : lanes_)
+        {
+            lane.results = clCreateBuffer(context_, CL_MEM_WRITE_ONLY, sizeof(cl_uint) * globalWorkSize_, NULL, NULL);
+            if (!lane.results)
+            {
+                ready = fail("Failed to allocate device memory!");
+                break;
+            }
+        }
+    }
+    startup_.buffers_ms = msSince(phase);
+
+    if (err == CL_SUCCESS)
+    {
+        std::unique_lock<std::mutex> lock(buildMutex_);
+        buildDone_.wait(lock, [&] { return built_; });
+    }
+    startup_.build_ms = msSince(build);
+    TRACE_END("build");
+    cl_build_status status = CL_BUILD_SUCCESS - 1;
+    clGetProgramBuildInfo(program_, device, CL_PROGRAM_BUILD_STATUS, sizeof(status), &status, NULL);
+    if (err != CL_SUCCESS || status != CL_BUILD_SUCCESS)
+    {
+        size_t len;
+        char buffer[2048] = {0};
+        clGetProgramBuildInfo(program_, device, CL_PROGRAM_BUILD_LOG, sizeof(buffer) - 1, buffer, &len);
+        return fail(std::string("Failed to build program!\n") + buffer);
+    }
+    if (!ready)
+        return false;
+
+    // Create the compute kernel of every lane
+    TRACE_BEGIN("kernel", -1);
+    phase = steady_clock::now();
+    for (Lane& lane : lanes_)
+    {
+        if (!kernel(lane, kernelName_))
+            return false;
+        freeLanes_.push_back(&lane);
+    }
+    startup_.kernels_ms = msSince(phase);
+    TRACE_END("kernel");
+    startup_.total_ms = msSince(start);
+    return true;
+}
+
+bool OpenCLEstimator::run(int64_t samples, uint32_t seed, const EstimateOptions& options, EstimateResult& result)
+{
+    if (lanes_.empty())
+        return fail("No device session");
+    if (!options.checkpoints.empty() || options.prefix_samples > 0)
+        return fail("Checkpoints and cached prefixes need the CPU backend");
+    int64_t iters = (samples + (int64_t)globalWorkSize_ - 1) / (int64_t)globalWorkSize_;
+    if (samples <= 0 || options.replicas <= 0 || options.first_replica < 0 || iters > 0xFFFFFFFFLL ||
+        ((int64_t)options.first_replica + options.replicas) * (int64_t)globalWorkSize_ > 0x100000000LL)
+        return fail("Invalid number of samples or replicas");
+    result = EstimateResult();
+
+    auto start = steady_clock::now();
+    Lane* lane = takeLane();
+    bool ok;
+    if (options.replicas == 1 && options.first_replica == 0)
+    {
+        const std::string& name = options.kernel.empty() ? kernelName_ : options.kernel;
+        cl_kernel k = kernel(*lane, name);
+        ok = k && runSingle(*lane, k, name, (cl_uint)iters, seed, options.metrics, options.cancel, result);
+    }
+    else
+    {
+        // The ensemble variant of the kernel asked for, pi_v2 by default.
+        std::string name = (options.kernel.empty() ? std::string("pi_v2") : options.kernel) + "_ensemble";
+        ok = runEnsemble(*lane, name, (cl_uint)iters, seed, (cl_uint)options.first_replica,
+                         (cl_uint)options.replicas, options.metrics, options.cancel, result);
+    }
+    returnLane(lane);
+    if (!ok)
+        return false;
+    result.hits = result.replica_hits[0];
+    result.pi = result.samples > 0 ? pi_estimate(result.hits, result.samples) : 0;
+    result.ci95 = result.samples > 0 ? pi_ci95(result.hits, result.samples) : 0;
+    result.phase_ms[HISTORY_TOTAL] = msSince(start);
+    return true;
+}
+
+// Submissions run on a thread per lane, in the order they came, as many
+// at once as there are lanes. A submission cancelled while it waits never
+// reaches the device.
+void OpenCLEstimator::dispatch()
+{
+    for (;;)
+    {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(jobMutex_);
+            jobReady_.wait(lock, [&] { return quit_ || !jobs_.empty(); });
+            if (jobs_.empty())
+                return;
+            job = std::move(jobs_.front());
+            jobs_.pop_front();
+        }
+        EstimateResult result;
+        if (job.options.cancel.cancelled())
+            result.cancelled = true;
+        else if (!run(job.samples, job.seed, job.options, result))
+            result.error = threadError;
+        job.done(result);
+    }
+}
+
+bool OpenCLEstimator::submit(int64_t samples, uint32_t seed, const EstimateOptions& options, Callback done)
+{
+    if (lanes_.empty())
+        return fail("No device session");
+    std::lock_guard<std::mutex> lock(jobMutex_);
+    while (dispatchers_.size() < lanes_.size())
+        dispatchers_.emplace_back(&OpenCLEstimator::dispatch, this);
+    Job job;
+    job.samples = samples;
+    job.seed = seed;
+    job.options = options;
+    job.done = std::move(done);
+    jobs_.push_back(std::move(job));
+    jobReady_.notify_one();
+    return true;
+}
+
+// Dispatch the work items in batches when the run can be cancelled, two
+// in flight so that the device does not idle while the host checks.
+// Every work item draws from the stream of its global id, so batches
+// give the same counts as a single dispatch. Paced runs have one batch in
+// flight and charge each to the pacer of the session, shared by all the
+// lanes, waiting until it lets them through.
+bool OpenCLEstimator::runSingle(Lane& lane, cl_kernel kernel, const std::string& kernelName, cl_uint iters,
+                                cl_uint seed, Metrics* metrics, const CancelToken& cancel, EstimateResult& result)
+{
+    int err;
+    auto phase = steady_clock::now();
+    err  = clSetKernelArg(kernel, 0, sizeof(cl_uint), &iters);
+    err |= clSetKernelArg(kernel, 1, sizeof(cl_uint), &seed);
+    err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &lane.results);
+    CL_CHECK_SUCCESS(err, "Failed to set kernel arguments!");
+    result.phase_ms[HISTORY_SETUP] = msSince(phase);
+
+    struct Batch
+    {
+        cl_event event;
+        size_t offset;
+        size_t size;
+        double enqueuedUs;
+        steady_clock::time_point enqueued;
+    };
+    double budget = budget_;
+    bool paced = budget > 0 && budget < 1;
+    size_t batchSize = globalWorkSize_;
+    if (cancel.valid() || paced)
+    {
+        size_t batches = paced ? OPENCL_PACED_BATCHES : OPENCL_BATCHES;
+        batchSize = std::max((globalWorkSize_ / batches + localWorkSize_ - 1) / localWorkSize_, (size_t)1) * localWorkSize_;
+    }
+    size_t depth = paced ? 1 : 2;
+    steady_clock::time_point next = steady_clock::now();
+    std::deque<Batch> inFlight;
+    size_t offset = 0;
+    size_t done = 0;
+    int64_t kernelNs = 0;
+
+    phase = steady_clock::now();
+    while (offset < globalWorkSize_ || !inFlight.empty())
+    {
+        while (offset < globalWorkSize_ && inFlight.size() < depth && !cancel.cancelled())
+        {
+            if (paced)
+            {
+                TRACE_SCOPE("pace", (int64_t)offset);
+                std::this_thread::sleep_until(next);
+            }
+            // Execute the kernel
+            TRACE_BEGIN("enqueue", (int64_t)offset);
+            Batch b;
+            b.offset = offset;
+            b.size = std::min(batchSize, globalWorkSize_ - offset);
+            PROBE2(cl__enqueue, kernelName.c_str(), b.size);
+            b.enqueuedUs = tracer().nowUs();
+            b.enqueued = steady_clock::now();
+            err = clEnqueueNDRangeKernel(lane.queue, kernel, 1, &b.offset, &b.size, &localWorkSize_, 0, NULL, &b.event);
+            if (err != CL_SUCCESS)
+                clFinish(lane.queue);
+            CL_CHECK_SUCCESS(err, "Failed to execute kernel!");
+            TRACE_END("enqueue");
+            inFlight.push_back(b);
+            offset += b.size;
+        }
+        if (inFlight.empty())
+            break;
+
+        // Blocks until the oldest batch has completed
+        Batch b = inFlight.front();
+        inFlight.pop_front();
+        TRACE_BEGIN("finish", (int64_t)b.offset);
+        clWaitForEvents(1, &b.event);
+        TRACE_END("finish");
+        int64_t wallNs = duration_cast<nanoseconds>(steady_clock::now() - b.enqueued).count();
+        PROBE3(cl__complete, kernelName.c_str(), b.size, wallNs);
+        int64_t busyNs = wallNs;
+        if (timestamps_)
+        {
+            if (tracer().enabled())
+                traceCommand(b.event, b.enqueuedUs, kernelName.c_str());
+            busyNs = commandNs(b.event);
+            kernelNs += busyNs;
+        }
+        clReleaseEvent(b.event);
+        done += b.size;
+        result.busy_ms += busyNs / 1e6;
+        if (paced)
+            next = pacer_.charge(busyNs);
+    }
+    result.phase_ms[HISTORY_COMPUTE] = msSince(phase);
+
+    // Read back the results of the finished work items
+    phase = steady_clock::now();
+    TRACE_BEGIN("readback", -1);
+    vector<cl_uint> host_results(done);
+    if (done > 0)
+    {
+        err = clEnqueueReadBuffer(lane.queue, lane.results, CL_TRUE, 0, sizeof(cl_uint) * done, &host_results[0], 0, NULL, NULL);
+        CL_CHECK_SUCCESS(err, "Failed to read output buffer!");
+    }
+    TRACE_END("readback");
+
+    TRACE_BEGIN("reduce", -1);
+    cl_ulong total = 0;
+    for (cl_uint threadCount : host_results)
+    {
+        total += threadCount;
+    }
+    TRACE_END("reduce");
+    result.phase_ms[HISTORY_REDUCE] = msSince(phase);
+    result.replica_hits.assign(1, (int64_t)total);
+    result.samples = (int64_t)iters * done;
+    result.chunks = (int64_t)done;
+    result.cancelled = done < globalWorkSize_;
+
+    if (metrics && timestamps_)
+        metrics->addKernel(result.samples, (int64_t)total, kernelNs);
+    return true;
+}
+
+// Run replicas [firstReplica, firstReplica + numReplicas) of the estimate
+// in a single dispatch of the ensemble kernel; replica r draws work item i
+// from jump id r * globalWorkSize_ + i, through the global offset. Hits are
+// reduced per work-group and then per replica on the device, only
+// numReplicas counters are read back.
+bool OpenCLEstimator::runEnsemble(Lane& lane, const std::string& kernelName, cl_uint iters, cl_uint seed,
+                                  cl_uint firstReplica, cl_uint numReplicas, Metrics* metrics,
+                                  const CancelToken& cancel, EstimateResult& result)
+{
+    int err;
+    // Work-group sums are indexed by group id, so the ensemble is a
+    // single dispatch and can only be cancelled before it starts.
+    if (cancel.cancelled())
+    {
+        result.cancelled = true;
+        result.replica_hits.assign(numReplicas, 0);
+        return true;
+    }
+    auto phase = steady_clock::now();
+    cl_uint groupsPerReplica = (cl_uint)(globalWorkSize_ / localWorkSize_);
+    cl_kernel ensemble = kernel(lane, kernelName);
+    cl_kernel reduce = kernel(lane, "reduce_replicas");
+    if (!ensemble || !reduce)
+        return false;
+    // Grown for the most replicas so far, smaller ensembles use a part.
+    if (numReplicas > lane.maxReplicas)
+    {
+        if (lane.groupSums)
+            clReleaseMemObject(lane.groupSums);
+        if (lane.replicaSums)
+            clReleaseMemObject(lane.replicaSums);
+        lane.replicaSums = NULL;
+        lane.maxReplicas = 0;
+        lane.groupSums = clCreateBuffer(context_, CL_MEM_READ_WRITE, sizeof(cl_uint) * groupsPerReplica * numReplicas, NULL, NULL);
+        CL_CHECK_RESULT(lane.groupSums, "Failed to allocate device memory!");
+        lane.replicaSums = clCreateBuffer(context_, CL_MEM_WRITE_ONLY, sizeof(cl_ulong) * numReplicas, NULL, NULL);
+        CL_CHECK_RESULT(lane.replicaSums, "Failed to allocate device memory!");
+        lane.maxReplicas = numReplicas;
+    }
+
+    err  = clSetKernelArg(ensemble, 0, sizeof(cl_uint), &iters);
+    err |= clSetKernelArg(ensemble, 1, sizeof(cl_uint), &seed);
+    err |= clSetKernelArg(ensemble, 2, sizeof(cl_mem), &lane.groupSums);
+    err |= clSetKernelArg(ensemble, 3, sizeof(cl_uint) * localWorkSize_, NULL);
+    err |= clSetKernelArg(reduce, 0, sizeof(cl_uint), &groupsPerReplica);
+    err |= clSetKernelArg(reduce, 1, sizeof(cl_mem), &lane.groupSums);
+    err |= clSetKernelArg(reduce, 2, sizeof(cl_mem), &lane.replicaSums);
+    CL_CHECK_SUCCESS(err, "Failed to set kernel arguments!");
+    result.phase_ms[HISTORY_SETUP] = msSince(phase);
+
+    phase = steady_clock::now();
+    size_t ensemble_offset = globalWorkSize_ * firstReplica;
+    size_t ensemble_work_size = globalWorkSize_ * numReplicas;
+    size_t replica_work_size = numReplicas;
+    cl_event events[2] = { NULL, NULL };
+    double enqueuedUs[2];
+    TRACE_BEGIN("enqueue", -1);
+    PROBE2(cl__enqueue, kernelName.c_str(), ensemble_work_size);
+    enqueuedUs[0] = tracer().nowUs();
+    err = clEnqueueNDRangeKernel(lane.queue, ensemble, 1, &ensemble_offset, &ensemble_work_size, &localWorkSize_, 0,
+                                 NULL, timestamps_ ? &events[0] : NULL);
+    CL_CHECK_SUCCESS(err, "Failed to execute kernel!");
+    PROBE2(cl__enqueue, "reduce_replicas", replica_work_size);
+    enqueuedUs[1] = tracer().nowUs();
+    err = clEnqueueNDRangeKernel(lane.queue, reduce, 1, NULL, &replica_work_size, NULL, 0, NULL,
+                                 timestamps_ ? &events[1] : NULL);
+    CL_CHECK_SUCCESS(err, "Failed to execute kernel!");
+    TRACE_END("enqueue");
+
+    TRACE_BEGIN("readback", -1);
+    vector<cl_ulong> host_results(numReplicas);
+    err = clEnqueueReadBuffer(lane.queue, lane.replicaSums, CL_TRUE, 0, sizeof(cl_ulong) * numReplicas, &host_results[0], 0, NULL, NULL);
+    CL_CHECK_SUCCESS(err, "Failed to read output buffer!");
+    TRACE_END("readback");
+    // Host time from enqueue to the results, both kernels included.
+    PROBE3(cl__complete, "reduce_replicas", replica_work_size,
+        duration_cast<nanoseconds>(steady_clock::now() - phase).count());
+    result.phase_ms[HISTORY_COMPUTE] = msSince(phase);
+
+    phase = steady_clock::now();
+    result.replica_hits.resize(numReplicas);
+    int64_t hits = 0;
+    for (cl_uint r = 0; r < numReplicas; r++)
+    {
+        result.replica_hits[r] = (int64_t)host_results[r];
+        hits += result.replica_hits[r];
+    }
+    result.samples = (int64_t)iters * globalWorkSize_;
+    result.chunks = (int64_t)ensemble_work_size;
+    result.phase_ms[HISTORY_REDUCE] = msSince(phase);
+
+    if (timestamps_)
+    {
+        if (tracer().enabled())
+        {
+            traceCommand(events[0], enqueuedUs[0], kernelName.c_str());
+            traceCommand(events[1], enqueuedUs[1], "reduce_replicas");
+        }
+        if (metrics)
+            metrics->addKernel((int64_t)iters * globalWorkSize_ * numReplicas, hits, commandNs(events[0]) + commandNs(events[1]));
+        clReleaseEvent(events[0]);
+        clReleaseEvent(events[1]);
+    }
+    return true;
+}
+
+bool OpenCLEstimator::runChunks(uint32_t seed, int64_t firstChunk, int64_t numChunks, int64_t numSamples,
+                                std::vector<int64_t>& hits)
+{
+    if (lanes_.empty())
+        return fail("No device session");
+    if (firstChunk < 0 || numChunks <= 0 || firstChunk + numChunks > MAX_CHUNKS ||
+        firstChunk * CHUNK_SAMPLES >= numSamples)
+        return fail("Invalid chunks");
+    Lane* lane = takeLane();
+    bool ok = runChunks(*lane, seed, firstChunk, numChunks, numSamples, hits);
+    returnLane(lane);
+    return ok;
+}
+
+bool OpenCLEstimator::runChunks(Lane& lane, uint32_t seed, int64_t firstChunk, int64_t numChunks,
+                                int64_t numSamples, std::vector<int64_t>& hits)
+{
+    int err;
+    cl_kernel chunks = kernel(lane, "pi_chunks");
+    if (!chunks)
+        return false;
+    if ((size_t)numChunks > lane.maxChunks)
+    {
+        if (lane.chunkSums)
+            clReleaseMemObject(lane.chunkSums);
+        lane.maxChunks = 0;
+        lane.chunkSums = clCreateBuffer(context_, CL_MEM_WRITE_ONLY, sizeof(cl_uint) * numChunks, NULL, NULL);
+        CL_CHECK_RESULT(lane.chunkSums, "Failed to allocate device memory!");
+        lane.maxChunks = (size_t)numChunks;
+    }
+    cl_uint iters = CHUNK_SAMPLES;
+    cl_ulong total = (cl_ulong)numSamples;
+    err  = clSetKernelArg(chunks, 0, sizeof(cl_uint), &iters);
+    err |= clSetKernelArg(chunks, 1, sizeof(cl_uint), &seed);
+    err |= clSetKernelArg(chunks, 2, sizeof(cl_ulong), &total);
+    err |= clSetKernelArg(chunks, 3, sizeof(cl_mem), &lane.chunkSums);
+    CL_CHECK_SUCCESS(err, "Failed to set kernel arguments!");
+
+    // Few work items of many samples each; the runtime picks the
+    // work-group size, numChunks need not be a multiple of it.
+    size_t offset = (size_t)firstChunk;
+    size_t size = (size_t)numChunks;
+    TRACE_BEGIN("enqueue", firstChunk);
+    PROBE2(cl__enqueue, "pi_chunks", size);
+    auto enqueued = steady_clock::now();
+    err = clEnqueueNDRangeKernel(lane.queue, chunks, 1, &offset, &size, NULL, 0, NULL, NULL);
+    CL_CHECK_SUCCESS(err, "Failed to execute kernel!");
+    TRACE_END("enqueue");
+
+    TRACE_BEGIN("readback", -1);
+    vector<cl_uint> host_results(size);
+    err = clEnqueueReadBuffer(lane.queue, lane.chunkSums, CL_TRUE, 0, sizeof(cl_uint) * size, &host_results[0], 0, NULL, NULL);
+    CL_CHECK_SUCCESS(err, "Failed to read output buffer!");
+    TRACE_END("readback");
+    PROBE3(cl__complete, "pi_chunks", size, duration_cast<nanoseconds>(steady_clock::now() - enqueued).count());
+    (void)enqueued;
+
+    hits.assign(host_results.begin(), host_results.end());
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+epi_estimator* epi_opencl_create(int device_index, const char* kernel, const char* source_dir,
+                                 char* error, int error_size)
+{
+    std::string message;
+    std::vector<cl_device_id> devices;
+    unique_ptr<OpenCLEstimator> estimator(new OpenCLEstimator);
+    bool ok = OpenCLEstimator::listDevices(devices, message);
+    if (ok && (device_index <= 0 || device_index > (int)devices.size()))
+    {
+        message = "Invalid device_index!";
+        ok = false;
+    }
+    if (ok && !estimator->create(devices[device_index - 1], kernel, source_dir, N_THREADS, false))
+    {
+        message = estimator->error();
+        ok = false;
+    }
+    if (ok)
+    {
+        epi_estimator* e = new epi_estimator;
+        e->impl = estimator.release();
+        return e;
+    }
+    if (error && error_size > 0)
+        snprintf(error, error_size, "%s", message.c_str());
+    return nullptr;
+}
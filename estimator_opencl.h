@@ -0,0 +1,222 @@
+/* OpenCL backend of libestimatepi. */
+
+#ifndef __ESTIMATOR_OPENCL_H__
+#define __ESTIMATOR_OPENCL_H__
+
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "estimator.h"
+
+// Default dispatch: work items and samples per work item.
+#define N_THREADS        1000*100
+#define ITERS_PER_THREAD 10000
+
+// Dispatches per run when it can be cancelled, and when it is paced.
+#define OPENCL_BATCHES        16
+#define OPENCL_PACED_BATCHES  256
+
+/**
+ * Wall time of the steps of OpenCLEstimator::create(), in ms. Sources
+ * load while the context and queues are made, and the device limits and
+ * buffers are set up while the program builds, so the steps add up to
+ * more than total.
+ */
+struct OpenCLStartup
+{
+    double source_ms;             // reading and splicing the sources
+    double context_ms;            // context and queues
+    double build_ms;              // from clBuildProgram to its notification
+    double buffers_ms;            // device limits and buffers
+    double kernels_ms;
+    double total_ms;
+};
+
+/**
+ * A device session: context, built program and one or more lanes, kept
+ * across runs. A lane is a command queue with its own kernel objects,
+ * made on first use for every kernel variant, and its own buffers, which
+ * grow and are kept for the next runs. A run or submission takes a free
+ * lane for its duration, so as many host threads as there are lanes run
+ * concurrently, and repeated runs only pay for enqueue and readback.
+ *
+ * A run is a single dispatch of globalWorkSize() work items of
+ * ceil(samples / globalWorkSize()) iterations each, so the samples are
+ * rounded up to a multiple of globalWorkSize(). Replicas run as one
+ * pi_v2_ensemble dispatch reduced on the device; checkpoints and cached
+ * prefixes are not supported. Runs with a CancelToken are cut into
+ * OPENCL_BATCHES dispatches of consecutive work items. With a budget
+ * below the whole device, single runs are cut into OPENCL_PACED_BATCHES
+ * dispatches, one at a time per lane. Every lane charges the device time
+ * of its dispatches to one Pacer of the session and waits after each
+ * until it is out of debt, so that all of them together keep the device
+ * busy budget() of the wall time. Pending submissions finish before the
+ * estimator is destroyed.
+ */
+class OpenCLEstimator : public Estimator
+{
+    struct Lane
+    {
+        cl_command_queue queue;
+        std::map<std::string, cl_kernel> kernels;
+        cl_mem results;           // globalWorkSize_ counts
+        cl_mem groupSums;         // of pi_v2_ensemble
+        cl_mem replicaSums;
+        cl_uint maxReplicas;      // that groupSums and replicaSums hold
+        cl_mem chunkSums;         // of pi_chunks
+        size_t maxChunks;
+    };
+
+    cl_device_id device_;
+    cl_context context_;
+    cl_program program_;
+    std::string kernelName_;
+    std::string deviceName_;
+    size_t localWorkSize_;
+    size_t globalWorkSize_;
+    bool timestamps_;
+    std::vector<Lane> lanes_;     // fixed once created
+    std::vector<Lane*> freeLanes_;
+    std::mutex laneMutex_;
+    std::condition_variable laneFree_;
+    std::atomic<double> budget_;  // share of the device, 0 if unlimited
+    Pacer pacer_;                 // of all the lanes, at budget_ below 1
+    mutable std::mutex errorMutex_; // of error_
+    std::string error_;
+    // Sources loaded ahead of create(), see prefetch()
+    std::string sourceDir_;
+    std::string source_;
+    std::future<bool> sourceLoaded_;
+    // Set by the notification of clBuildProgram
+    std::mutex buildMutex_;
+    std::condition_variable buildDone_;
+    bool built_;
+    OpenCLStartup startup_;
+
+    struct Job
+    {
+        int64_t samples;
+        uint32_t seed;
+        EstimateOptions options;
+        Callback done;
+    };
+    std::mutex jobMutex_;
+    std::condition_variable jobReady_;
+    std::deque<Job> jobs_;
+    std::vector<std::thread> dispatchers_;  // one per lane, started by the first submit()
+    bool quit_;
+
+    Lane* takeLane();
+    void returnLane(Lane* lane);
+    bool fail(const std::string& message);
+    cl_kernel kernel(Lane& lane, const std::string& name);
+    bool runSingle(Lane& lane, cl_kernel kernel, const std::string& kernelName, cl_uint iters, cl_uint seed,
+                   Metrics* metrics, const CancelToken& cancel, EstimateResult& result);
+    bool runEnsemble(Lane& lane, const std::string& kernelName, cl_uint iters, cl_uint seed, cl_uint firstReplica,
+                     cl_uint numReplicas, Metrics* metrics, const CancelToken& cancel, EstimateResult& result);
+    bool runChunks(Lane& lane, uint32_t seed, int64_t firstChunk, int64_t numChunks, int64_t numSamples,
+                   std::vector<int64_t>& hits);
+    bool setup(cl_device_id device, const char* kernelName, const std::string& sourceDir, size_t minWorkItems,
+               bool timestamps, int lanes);
+    void dispatch();
+    void release();
+    static void CL_CALLBACK buildFinished(cl_program program, void* estimator);
+public:
+    OpenCLEstimator();
+    ~OpenCLEstimator();
+    OpenCLEstimator(const OpenCLEstimator&) = delete;
+    OpenCLEstimator& operator=(const OpenCLEstimator&) = delete;
+
+    // The GPUs of the first platforms, in the order of their device index.
+    static bool listDevices(std::vector<cl_device_id>& devices, std::string& error);
+
+    // Start loading the sources in sourceDir, before the device is known;
+    // create() with the same sourceDir waits for them. Optional.
+    void prefetch(const std::string& sourceDir);
+    // Build the sources in sourceDir for device and set up kernelName on
+    // minWorkItems work items or more, with lanes queues. With timestamps,
+    // the queues profile commands for the trace and the metrics. A failed
+    // create() leaves no session, runs fail until the next one.
+    bool create(cl_device_id device, const char* kernelName, const std::string& sourceDir,
+                size_t minWorkItems, bool timestamps, int lanes = 1);
+
+    // On the kernel variant options.kernel, kernelName if empty.
+    bool run(int64_t samples, uint32_t seed, const EstimateOptions& options, EstimateResult& result) override;
+    // Hits of each of the CPU chunks [firstChunk, firstChunk + numChunks)
+    // of a run of numSamples, one work item per chunk: the same counts as
+    // the CPU backend, for work shared with CPU nodes.
+    bool runChunks(uint32_t seed, int64_t firstChunk, int64_t numChunks, int64_t numSamples,
+                   std::vector<int64_t>& hits);
+    bool submit(int64_t samples, uint32_t seed, const EstimateOptions& options, Callback done) override;
+    std::string error() const override
+    {
+        std::lock_guard<std::mutex> lock(errorMutex_);
+        return error_;
+    }
+    // Share of the device runs may keep busy, such as 0.3; 0 or 1 for
+    // all of it. Takes effect at the next run.
+    double budget() const
+    {
+        return budget_;
+    }
+    void setBudget(double share)
+    {
+        share = std::max(share, 0.0);
+        budget_ = share;
+        pacer_.set_cores(share < 1 ? share : 0);
+    }
+
+    cl_device_id device() const
+    {
+        return device_;
+    }
+    cl_context context() const
+    {
+        return context_;
+    }
+    // The queue of the first lane.
+    cl_command_queue queue() const
+    {
+        return lanes_.empty() ? NULL : lanes_[0].queue;
+    }
+    int lanes() const
+    {
+        return (int)lanes_.size();
+    }
+    cl_program program() const
+    {
+        return program_;
+    }
+    const std::string& deviceName() const
+    {
+        return deviceName_;
+    }
+    // Of the last create().
+    const OpenCLStartup& startup() const
+    {
+        return startup_;
+    }
+    size_t localWorkSize() const
+    {
+        return localWorkSize_;
+    }
+    size_t globalWorkSize() const
+    {
+        return globalWorkSize_;
+    }
+};
+
+#endif /* EOF */
@@ -0,0 +1,285 @@
+/* CPU limits of the process and a governor adapting the active threads to them. */
+
+#ifndef __GOVERNOR_H__
+#define __GOVERNOR_H__
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+#include "estimator.h"
+#include "topology.h"
+
+/**
+ * The CPUs the process may use. Each limit is 0 when it does not apply.
+ */
+struct CpuLimits
+{
+    int online;                   // logical CPUs of the machine
+    int affinity;                 // CPUs in the affinity mask
+    int cpuset;                   // CPUs of the cgroup cpuset
+    double quota;                 // CPUs worth of cgroup cpu.max quota
+    int effective;                // threads that neither share nor exceed them
+    double budget;                // cores to pace them to, 0 unless the quota is below effective
+    bool limited;                 // by any of them, below online
+    std::string cgroup;           // directory of the cgroup with the quota
+};
+
+inline static bool
+governor_read(const std::string& path, std::string& text)
+{
+    FILE* f = fopen(path.c_str(), "r");
+    if (!f)
+        return false;
+    char buf[4096];
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = 0;
+    text = buf;
+    return n > 0;
+}
+
+// Value of "key value" in a flat keyed file such as cpu.stat, -1 if absent.
+inline static int64_t
+governor_stat(const std::string& text, const char* key)
+{
+    size_t len = strlen(key);
+    for (size_t pos = 0; pos < text.size();)
+    {
+        if (text.compare(pos, len, key) == 0 && text[pos + len] == ' ')
+            return atoll(text.c_str() + pos + len + 1);
+        pos = text.find('\n', pos);
+        pos = pos == std::string::npos ? pos : pos + 1;
+    }
+    return -1;
+}
+
+// Number of CPUs in a list such as "0-3,8,10-11".
+inline static int
+governor_cpu_count(const std::string& list)
+{
+    int count = 0;
+    const char* p = list.c_str();
+    while (*p >= '0' && *p <= '9')
+    {
+        char* end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (*end == '-')
+            last = strtol(end + 1, &end, 10);
+        count += (int)(last - first + 1);
+        p = *end == ',' ? end + 1 : end;
+    }
+    return count;
+}
+
+/**
+ * Limits of this process: the affinity mask, and on Linux the cgroup v2
+ * cpuset and the tightest cpu.max quota of the cgroup and its parents,
+ * or the v1 CFS quota. effective is the smallest of them, the quota
+ * rounded down so that the threads never exceed it, and at least 1. A
+ * quota below one CPU still leaves one thread, so budget then carries
+ * the quota for a Pacer to hold the thread to.
+ */
+inline static CpuLimits
+detect_cpu_limits()
+{
+    CpuLimits l;
+    l.online = detect_topology().logical;
+    l.affinity = 0;
+    l.cpuset = 0;
+    l.quota = 0;
+#if defined(__linux__)
+    cpu_set_t mask;
+    if (sched_getaffinity(0, sizeof(mask), &mask) == 0)
+        l.affinity = CPU_COUNT(&mask);
+
+    std::string text, v2, v1;
+    if (governor_read("/proc/self/cgroup", text))
+    {
+        size_t pos = 0;
+        while (pos < text.size())
+        {
+            size_t end = text.find('\n', pos);
+            std::string line = text.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+            if (line.compare(0, 3, "0::") == 0)
+                v2 = line.substr(3);
+            else if (line.find(":cpu,") != std::string::npos || line.find(":cpu:") != std::string::npos ||
+                     line.find(",cpu:") != std::string::npos)
+                v1 = line.substr(line.rfind(':') + 1);
+            pos = end == std::string::npos ? end : end + 1;
+        }
+    }
+    std::string root = governor_read("/sys/fs/cgroup/cgroup.controllers", text) ? "/sys/fs/cgroup"
+                                                                                 : "/sys/fs/cgroup/unified";
+    if (!v2.empty())
+    {
+        std::string dir = root + (v2 == "/" ? "" : v2);
+        if (governor_read(dir + "/cpuset.cpus.effective", text))
+            l.cpuset = governor_cpu_count(text);
+        for (;;)
+        {
+            long long max, period;
+            if (governor_read(dir + "/cpu.max", text) && sscanf(text.c_str(), "%lld %lld", &max, &period) == 2 &&
+                period > 0 && (l.quota == 0 || (double)max / period < l.quota))
+            {
+                l.quota = (double)max / period;
+                l.cgroup = dir;
+            }
+            if (dir.size() <= root.size())
+                break;
+            dir = dir.substr(0, dir.rfind('/'));
+        }
+    }
+    if (l.quota == 0 && !v1.empty())
+    {
+        std::string dir = "/sys/fs/cgroup/cpu" + (v1 == "/" ? "" : v1);
+        std::string quota, period;
+        if (governor_read(dir + "/cpu.cfs_quota_us", quota) && governor_read(dir + "/cpu.cfs_period_us", period) &&
+            atoll(quota.c_str()) > 0 && atoll(period.c_str()) > 0)
+        {
+            l.quota = atoll(quota.c_str()) / (double)atoll(period.c_str());
+            l.cgroup = dir;
+        }
+    }
+#endif
+    l.effective = l.online;
+    if (l.affinity > 0)
+        l.effective = std::min(l.effective, l.affinity);
+    if (l.cpuset > 0)
+        l.effective = std::min(l.effective, l.cpuset);
+    if (l.quota > 0)
+        l.effective = std::min(l.effective, (int)l.quota);
+    l.effective = std::max(l.effective, 1);
+    l.budget = l.quota > 0 && l.quota < l.effective ? l.quota : 0;
+    l.limited = l.effective < l.online;
+    return l;
+}
+
+/**
+ * Adapts the active threads of a CpuEstimator to the CPU it gets, every
+ * interval while it is alive. CPU pressure (the "some" stall time of the
+ * cgroup, or of the system) or quota throttling shrink the active
+ * threads by a quarter; a calm interval grows them by one, up to the
+ * limit. Threads change at chunk boundaries, see WorkerPool::set_active().
+ * A quota below one CPU also caps the budget of the estimator.
+ */
+class Governor
+{
+    CpuEstimator& estimator_;
+    int limit_;
+    std::string pressure_;        // cpu.pressure or /proc/pressure/cpu
+    std::string stat_;            // cpu.stat of the cgroup with the quota
+    std::chrono::milliseconds interval_;
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    bool quit_;
+    int shrinks_;
+    int grows_;
+    int min_active_;
+
+    // Stall time in microseconds and throttled time in microseconds, -1
+    // when not available.
+    void sample(int64_t& stall_us, int64_t& throttled_us) const
+    {
+        std::string text;
+        stall_us = -1;
+        throttled_us = -1;
+        if (governor_read(pressure_, text))
+        {
+            size_t pos = text.find("some ");
+            size_t total = pos == std::string::npos ? pos : text.find("total=", pos);
+            if (total != std::string::npos)
+                stall_us = atoll(text.c_str() + total + 6);
+        }
+        if (!stat_.empty() && governor_read(stat_, text))
+        {
+            throttled_us = governor_stat(text, "throttled_usec");
+            if (throttled_us < 0 && governor_stat(text, "throttled_time") >= 0)
+                throttled_us = governor_stat(text, "throttled_time") / 1000;  // v1, in ns
+        }
+    }
+
+    void loop()
+    {
+        int64_t stall0, throttled0;
+        sample(stall0, throttled0);
+        auto t0 = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!wake_.wait_for(lock, interval_, [this] { return quit_; }))
+        {
+            int64_t stall, throttled;
+            sample(stall, throttled);
+            auto t = std::chrono::steady_clock::now();
+            double us = std::chrono::duration<double, std::micro>(t - t0).count();
+            double pressure = stall0 >= 0 && stall >= 0 ? (stall - stall0) / us : 0;
+            double throttling = throttled0 >= 0 && throttled >= 0 ? (throttled - throttled0) / us : 0;
+            stall0 = stall;
+            throttled0 = throttled;
+            t0 = t;
+
+            int active = estimator_.activeThreads();
+            int next = active;
+            if (throttling > 0.01 || pressure > 0.2)
+                next = std::max(1, active - std::max(1, active / 4));
+            else if (pressure < 0.05 && active < limit_)
+                next = active + 1;
+            if (next != active)
+            {
+                TRACE_INSTANT("governor", next);
+                estimator_.setActiveThreads(next);
+                next < active ? shrinks_++ : grows_++;
+                min_active_ = std::min(min_active_, next);
+            }
+        }
+    }
+public:
+    // Start with limit active threads, never more.
+    Governor(CpuEstimator& estimator, const CpuLimits& limits, int interval_ms = 250)
+        : estimator_(estimator), interval_(interval_ms), quit_(false), shrinks_(0), grows_(0)
+    {
+        limit_ = std::max(1, std::min(estimator.threads(), limits.effective));
+        min_active_ = limit_;
+        std::string text;
+        pressure_ = !limits.cgroup.empty() && governor_read(limits.cgroup + "/cpu.pressure", text)
+            ? limits.cgroup + "/cpu.pressure" : "/proc/pressure/cpu";
+        if (!limits.cgroup.empty())
+            stat_ = limits.cgroup + "/cpu.stat";
+        estimator_.setActiveThreads(limit_);
+        if (limits.budget > 0 && (estimator.budget() <= 0 || estimator.budget() > limits.budget))
+            estimator.setBudget(limits.budget);
+        thread_ = std::thread(&Governor::loop, this);
+    }
+    ~Governor()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            quit_ = true;
+        }
+        wake_.notify_one();
+        thread_.join();
+    }
+    Governor(const Governor&) = delete;
+    Governor& operator=(const Governor&) = delete;
+
+    void report(FILE* out)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        fprintf(out, "governor: limit = %d, active = %d (min %d), shrinks = %d, grows = %d\n", limit_,
+                estimator_.activeThreads(), min_active_, shrinks_, grows_);
+    }
+};
+
+#endif /* EOF */
@@ -0,0 +1,247 @@
+/* Append-only memory-mapped history of run timings. */
+
+#ifndef __HISTORY_H__
+#define __HISTORY_H__
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define HISTORY_MAGIC 0x31545349484950ULL  // "PIHIST1"
+
+// Git revision of the build, set by CMake.
+#ifndef ESTIMATE_PI_REVISION
+#define ESTIMATE_PI_REVISION "unknown"
+#endif
+
+enum HistoryPhase
+{
+    HISTORY_SETUP,                // cache lookup, allocation; build for OpenCL
+    HISTORY_COMPUTE,              // threads or kernels running
+    HISTORY_REDUCE,               // reduction, readback, cache store
+    HISTORY_TOTAL,
+    HISTORY_NUM_PHASES
+};
+
+/**
+ * One run. Runs are comparable when binary, config and host are equal.
+ */
+struct HistoryRecord
+{
+    uint64_t time;                // seconds since the epoch
+    uint64_t host;                // host_fingerprint()
+    char revision[24];
+    char binary[16];              // "cpu", "opencl"
+    char config[64];              // e.g. "threads=8 samples=1000000000"
+    int64_t samples;
+    double phase_ms[HISTORY_NUM_PHASES];
+    double samples_per_sec;
+};
+
+struct HistoryHeader
+{
+    uint64_t magic;
+    uint32_t record_size;
+    uint32_t reserved;
+    uint64_t count;
+};
+
+inline static uint64_t
+history_hash(uint64_t h, const std::string& s)
+{
+    for (unsigned char c : s)
+    {
+        h ^= c;
+        h *= 0x100000001b3ULL;    // FNV-1a
+    }
+    return h;
+}
+
+/**
+ * Fingerprint of the machine: host name, CPU model and number of logical
+ * CPUs. Runs on different hardware are never compared.
+ */
+inline static uint64_t
+host_fingerprint()
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+#ifndef _WIN32
+    char name[256] = {0};
+    gethostname(name, sizeof(name) - 1);
+    h = history_hash(h, name);
+#endif
+    FILE* f = fopen("/proc/cpuinfo", "r");
+    if (f)
+    {
+        char line[512];
+        while (fgets(line, sizeof(line), f))
+        {
+            if (strncmp(line, "model name", 10) == 0)
+            {
+                h = history_hash(h, line);
+                break;
+            }
+        }
+        fclose(f);
+    }
+    return history_hash(h, std::to_string(std::thread::hardware_concurrency()));
+}
+
+/**
+ * Fill the fields of a record that do not depend on the run.
+ */
+inline static void
+history_record_init(HistoryRecord& r, const char* binary, const std::string& config)
+{
+    memset(&r, 0, sizeof(r));
+    r.time = (uint64_t)time(NULL);
+    r.host = host_fingerprint();
+    strncpy(r.revision, ESTIMATE_PI_REVISION, sizeof(r.revision) - 1);
+    strncpy(r.binary, binary, sizeof(r.binary) - 1);
+    strncpy(r.config, config.c_str(), sizeof(r.config) - 1);
+}
+
+/**
+ * A header followed by records, in a file shared by all processes.
+ * Appends and reads happen under flock().
+ */
+class RunHistory
+{
+    int fd_;
+
+#ifndef _WIN32
+    // Map the whole file, checking or writing the header.
+    HistoryHeader* map(size_t& size, bool writable)
+    {
+        struct stat st;
+        if (fstat(fd_, &st) != 0)
+            return nullptr;
+        size = (size_t)st.st_size;
+        if (size == 0)
+        {
+            if (!writable)
+                return nullptr;
+            size = sizeof(HistoryHeader);
+            if (ftruncate(fd_, size) != 0)
+                return nullptr;
+            void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+            if (p == MAP_FAILED)
+                return nullptr;
+            HistoryHeader* h = (HistoryHeader*)p;
+            h->magic = HISTORY_MAGIC;
+            h->record_size = sizeof(HistoryRecord);
+            h->count = 0;
+            return h;
+        }
+        if (size < sizeof(HistoryHeader))
+            return nullptr;
+        void* p = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd_, 0);
+        if (p == MAP_FAILED)
+            return nullptr;
+        HistoryHeader* h = (HistoryHeader*)p;
+        if (h->magic != HISTORY_MAGIC || h->record_size != sizeof(HistoryRecord) ||
+            sizeof(HistoryHeader) + h->count * sizeof(HistoryRecord) > size)
+        {
+            munmap(p, size);
+            return nullptr;
+        }
+        return h;
+    }
+#endif
+public:
+    RunHistory() : fd_(-1)
+    {
+    }
+    ~RunHistory()
+    {
+        close();
+    }
+    bool open(const char* filename, bool create)
+    {
+#ifndef _WIN32
+        fd_ = ::open(filename, create ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+        return fd_ >= 0;
+#else
+        (void)filename;
+        (void)create;
+        return false;
+#endif
+    }
+    void close()
+    {
+#ifndef _WIN32
+        if (fd_ >= 0)
+            ::close(fd_);
+#endif
+        fd_ = -1;
+    }
+    bool append(const HistoryRecord& record)
+    {
+        bool ok = false;
+#ifndef _WIN32
+        if (fd_ < 0)
+            return false;
+        flock(fd_, LOCK_EX);
+        size_t size = 0;
+        HistoryHeader* h = map(size, true);
+        if (h)
+        {
+            uint64_t count = h->count;
+            size_t needed = sizeof(HistoryHeader) + (count + 1) * sizeof(HistoryRecord);
+            munmap(h, size);
+            if (ftruncate(fd_, needed) == 0)
+            {
+                h = map(size, true);
+                if (h)
+                {
+                    HistoryRecord* records = (HistoryRecord*)(h + 1);
+                    records[count] = record;
+                    h->count = count + 1;
+                    munmap(h, size);
+                    ok = true;
+                }
+            }
+        }
+        flock(fd_, LOCK_UN);
+#else
+        (void)record;
+#endif
+        return ok;
+    }
+    bool read(std::vector<HistoryRecord>& records)
+    {
+        bool ok = false;
+#ifndef _WIN32
+        if (fd_ < 0)
+            return false;
+        flock(fd_, LOCK_SH);
+        size_t size = 0;
+        HistoryHeader* h = map(size, false);
+        if (h)
+        {
+            const HistoryRecord* r = (const HistoryRecord*)(h + 1);
+            records.assign(r, r + h->count);
+            munmap(h, size);
+            ok = true;
+        }
+        flock(fd_, LOCK_UN);
+#else
+        (void)records;
+#endif
+        return ok;
+    }
+};
+
+#endif /* EOF */
@@ -0,0 +1,419 @@
+/* Run metrics in the Prometheus text exposition format. */
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#include "stats.h"
+
+#define METRICS_MAX_WORKERS 32
+
+/**
+ * Counters of one worker, each on its own cache line. Only the worker
+ * writes them, so a plain relaxed load and store is enough; readers may
+ * see them a chunk late but never torn.
+ */
+struct alignas(64) MetricsSlot
+{
+    std::atomic<int64_t> samples;
+    std::atomic<int64_t> hits;
+    std::atomic<int64_t> chunks;
+    std::atomic<int64_t> busy_ns;
+};
+
+/**
+ * What a run has done so far. Workers update their slot once per chunk;
+ * render() reads everything without taking a lock the workers could wait on.
+ */
+class Metrics
+{
+    MetricsSlot workers_[METRICS_MAX_WORKERS];
+    std::atomic<int> num_workers_;
+    std::atomic<int64_t> target_samples_;
+    std::atomic<int64_t> prefix_samples_;
+    std::atomic<int64_t> prefix_hits_;
+    std::atomic<int64_t> queued_;
+    std::atomic<int64_t> device_samples_;
+    std::atomic<int64_t> device_hits_;
+    std::atomic<int64_t> device_kernel_ns_;
+    std::atomic<int64_t> device_kernels_;
+    std::mutex device_mutex_;
+    std::string device_;
+    std::chrono::steady_clock::time_point start_;
+
+    // For counters with a single writer, cheaper than a read-modify-write.
+    static void add(std::atomic<int64_t>& a, int64_t v)
+    {
+        a.store(a.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+    }
+public:
+    Metrics()
+    {
+        for (MetricsSlot& s : workers_)
+        {
+            s.samples.store(0);
+            s.hits.store(0);
+            s.chunks.store(0);
+            s.busy_ns.store(0);
+        }
+        num_workers_.store(0);
+        target_samples_.store(0);
+        prefix_samples_.store(0);
+        prefix_hits_.store(0);
+        queued_.store(0);
+        device_samples_.store(0);
+        device_hits_.store(0);
+        device_kernel_ns_.store(0);
+        device_kernels_.store(0);
+        start_ = std::chrono::steady_clock::now();
+    }
+    // A new run of num_workers threads towards target samples.
+    void start(int num_workers, int64_t target)
+    {
+        num_workers_.store(std::min(num_workers, METRICS_MAX_WORKERS), std::memory_order_relaxed);
+        target_samples_.store(target, std::memory_order_relaxed);
+    }
+    // Samples counted by an earlier run, e.g. a cached prefix.
+    void setPrefix(int64_t samples, int64_t hits)
+    {
+        prefix_samples_.store(samples, std::memory_order_relaxed);
+        prefix_hits_.store(hits, std::memory_order_relaxed);
+    }
+    void setQueued(int64_t chunks)
+    {
+        queued_.store(chunks, std::memory_order_relaxed);
+    }
+    // Called by worker i only.
+    void addChunk(int i, int64_t samples, int64_t hits, int64_t ns)
+    {
+        if (i >= METRICS_MAX_WORKERS)
+            return;
+        MetricsSlot& s = workers_[i];
+        add(s.samples, samples);
+        add(s.hits, hits);
+        add(s.chunks, 1);
+        add(s.busy_ns, ns);
+    }
+    void setDevice(const std::string& name)
+    {
+        std::lock_guard<std::mutex> lock(device_mutex_);
+        device_ = name;
+    }
+    // Called by any of the lanes driving the device, concurrently.
+    void addKernel(int64_t samples, int64_t hits, int64_t ns)
+    {
+        device_samples_.fetch_add(samples, std::memory_order_relaxed);
+        device_hits_.fetch_add(hits, std::memory_order_relaxed);
+        device_kernel_ns_.fetch_add(ns, std::memory_order_relaxed);
+        device_kernels_.fetch_add(1, std::memory_order_relaxed);
+    }
+    std::string render()
+    {
+        std::string out;
+        char line[256];
+        int n = num_workers_.load(std::memory_order_relaxed);
+        int64_t samples = prefix_samples_.load(std::memory_order_relaxed) +
+                          device_samples_.load(std::memory_order_relaxed);
+        int64_t hits = prefix_hits_.load(std::memory_order_relaxed) +
+                       device_hits_.load(std::memory_order_relaxed);
+        for (int i = 0; i < n; i++)
+        {
+            samples += workers_[i].samples.load(std::memory_order_relaxed);
+            hits += workers_[i].hits.load(std::memory_order_relaxed);
+        }
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+
+        out += "# HELP estimate_pi_samples_total Samples drawn, including a cached prefix.\n";
+        out += "# TYPE estimate_pi_samples_total counter\n";
+        snprintf(line, sizeof(line), "estimate_pi_samples_total %lld\n", (long long)samples);
+        out += line;
+        out += "# HELP estimate_pi_hits_total Samples inside the quarter circle.\n";
+        out += "# TYPE estimate_pi_hits_total counter\n";
+        snprintf(line, sizeof(line), "estimate_pi_hits_total %lld\n", (long long)hits);
+        out += line;
+        out += "# HELP estimate_pi_target_samples Samples the run is asked for.\n";
+        out += "# TYPE estimate_pi_target_samples gauge\n";
+        snprintf(line, sizeof(line), "estimate_pi_target_samples %lld\n",
+            (long long)target_samples_.load(std::memory_order_relaxed));
+        out += line;
+        out += "# HELP estimate_pi_samples_per_second Samples per second since the process started.\n";
+        out += "# TYPE estimate_pi_samples_per_second gauge\n";
+        snprintf(line, sizeof(line), "estimate_pi_samples_per_second %.6g\n", elapsed > 0 ? samples / elapsed : 0);
+        out += line;
+        if (samples > 0)
+        {
+            out += "# HELP estimate_pi_estimate Current estimate of pi.\n";
+            out += "# TYPE estimate_pi_estimate gauge\n";
+            snprintf(line, sizeof(line), "estimate_pi_estimate %.9f\n", pi_estimate(hits, samples));
+            out += line;
+            out += "# HELP estimate_pi_ci95 Half width of the 95% confidence interval of the estimate.\n";
+            out += "# TYPE estimate_pi_ci95 gauge\n";
+            snprintf(line, sizeof(line), "estimate_pi_ci95 %.9f\n", pi_ci95(hits, samples));
+            out += line;
+        }
+        out += "# HELP estimate_pi_queued_chunks Chunks not yet claimed by a worker.\n";
+        out += "# TYPE estimate_pi_queued_chunks gauge\n";
+        snprintf(line, sizeof(line), "estimate_pi_queued_chunks %lld\n",
+            (long long)queued_.load(std::memory_order_relaxed));
+        out += line;
+        if (n > 0)
+        {
+            out += "# HELP estimate_pi_worker_samples_total Samples drawn by a worker thread.\n";
+            out += "# TYPE estimate_pi_worker_samples_total counter\n";
+            for (int i = 0; i < n; i++)
+            {
+                snprintf(line, sizeof(line), "estimate_pi_worker_samples_total{worker=\"%d\"} %lld\n",
+                    i, (long long)workers_[i].samples.load(std::memory_order_relaxed));
+                out += line;
+            }
+            out += "# HELP estimate_pi_worker_chunks_total Chunks computed by a worker thread.\n";
+            out += "# TYPE estimate_pi_worker_chunks_total counter\n";
+            for (int i = 0; i < n; i++)
+            {
+                snprintf(line, sizeof(line), "estimate_pi_worker_chunks_total{worker=\"%d\"} %lld\n",
+                    i, (long long)workers_[i].chunks.load(std::memory_order_relaxed));
+                out += line;
+            }
+            out += "# HELP estimate_pi_worker_busy_seconds_total Time a worker thread spent in chunks.\n";
+            out += "# TYPE estimate_pi_worker_busy_seconds_total counter\n";
+            for (int i = 0; i < n; i++)
+            {
+                snprintf(line, sizeof(line), "estimate_pi_worker_busy_seconds_total{worker=\"%d\"} %.9f\n",
+                    i, workers_[i].busy_ns.load(std::memory_order_relaxed) * 1e-9);
+                out += line;
+            }
+        }
+        std::string device;
+        {
+            std::lock_guard<std::mutex> lock(device_mutex_);
+            device = device_;
+        }
+        if (!device.empty())
+        {
+            for (char& c : device)
+            {
+                if (c == '"' || c == '\\' || c == '\n')
+                    c = '_';
+            }
+            out += "# HELP estimate_pi_device_kernel_seconds_total Kernel execution time on a device.\n";
+            out += "# TYPE estimate_pi_device_kernel_seconds_total counter\n";
+            snprintf(line, sizeof(line), "estimate_pi_device_kernel_seconds_total{device=\"%.160s\"} %.9f\n",
+                device.c_str(), device_kernel_ns_.load(std::memory_order_relaxed) * 1e-9);
+            out += line;
+            out += "# HELP estimate_pi_device_kernels_total Kernels completed on a device.\n";
+            out += "# TYPE estimate_pi_device_kernels_total counter\n";
+            snprintf(line, sizeof(line), "estimate_pi_device_kernels_total{device=\"%.160s\"} %lld\n",
+                device.c_str(), (long long)device_kernels_.load(std::memory_order_relaxed));
+            out += line;
+        }
+        return out;
+    }
+};
+
+/**
+ * Write the metrics to filename through a temporary file, so that readers
+ * such as the node_exporter textfile collector never see half of them.
+ */
+inline static bool
+metrics_write(Metrics* metrics, const std::string& filename)
+{
+    std::string tmp = filename + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "w");
+    if (!f)
+        return false;
+    std::string text = metrics->render();
+    bool ok = fwrite(text.data(), 1, text.size(), f) == text.size();
+    ok = fclose(f) == 0 && ok;
+    return ok && rename(tmp.c_str(), filename.c_str()) == 0;
+}
+
+/**
+ * Serves Metrics over HTTP on 127.0.0.1:port or a Unix socket, and
+ * rewrites a file with them every second and on stop(). Everything runs
+ * on one background thread, so a slow scraper only delays other scrapers.
+ */
+class MetricsExporter
+{
+    Metrics* metrics_;
+    int fd_;
+    std::string socket_path_;
+    std::string file_;
+    std::atomic<bool> stop_;
+    std::thread thread_;
+
+#ifndef _WIN32
+    void serve(int client)
+    {
+        // A short timeout so that a client sending nothing is dropped.
+        struct timeval tv = { 1, 0 };
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        char request[1024];
+        ssize_t n = recv(client, request, sizeof(request) - 1, 0);
+        if (n <= 0)
+            return;
+        request[n] = 0;
+        std::string body;
+        const char* status = "200 OK";
+        if (strncmp(request, "GET / ", 6) == 0 || strncmp(request, "GET /metrics ", 13) == 0)
+            body = metrics_->render();
+        else
+            status = "404 Not Found";
+        char header[160];
+        snprintf(header, sizeof(header),
+            "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %u\r\nConnection: close\r\n\r\n",
+            status, (unsigned int)body.size());
+        std::string reply = header + body;
+        size_t sent = 0;
+        while (sent < reply.size())
+        {
+            ssize_t k = send(client, reply.data() + sent, reply.size() - sent, MSG_NOSIGNAL);
+            if (k <= 0)
+                break;
+            sent += k;
+        }
+    }
+#endif
+    void loop()
+    {
+        auto last_dump = std::chrono::steady_clock::now();
+        while (!stop_.load())
+        {
+#ifndef _WIN32
+            if (fd_ >= 0)
+            {
+                struct pollfd p = { fd_, POLLIN, 0 };
+                if (poll(&p, 1, 100) > 0)
+                {
+                    int client = accept(fd_, NULL, NULL);
+                    if (client >= 0)
+                    {
+                        serve(client);
+                        ::close(client);
+                    }
+                }
+            }
+            else
+#endif
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            }
+            if (!file_.empty() && std::chrono::steady_clock::now() - last_dump >= std::chrono::seconds(1))
+            {
+                dump();
+                last_dump = std::chrono::steady_clock::now();
+            }
+        }
+    }
+public:
+    MetricsExporter() : metrics_(nullptr), fd_(-1), stop_(false)
+    {
+    }
+    ~MetricsExporter()
+    {
+        stop();
+    }
+    bool listenTcp(int port)
+    {
+#ifndef _WIN32
+        fd_ = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd_ < 0)
+            return false;
+        int one = 1;
+        setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t)port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(fd_, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd_, 16) != 0)
+        {
+            ::close(fd_);
+            fd_ = -1;
+            return false;
+        }
+        return true;
+#else
+        (void)port;
+        return false;
+#endif
+    }
+    bool listenUnix(const char* path)
+    {
+#ifndef _WIN32
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(addr.sun_path))
+            return false;
+        strcpy(addr.sun_path, path);
+        fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd_ < 0)
+            return false;
+        unlink(path);
+        if (bind(fd_, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd_, 16) != 0)
+        {
+            ::close(fd_);
+            fd_ = -1;
+            return false;
+        }
+        socket_path_ = path;
+        return true;
+#else
+        (void)path;
+        return false;
+#endif
+    }
+    // Rewrite filename with the metrics while running and when stopped.
+    void dumpTo(const char* filename)
+    {
+        file_ = filename;
+    }
+    bool dump()
+    {
+        return metrics_write(metrics_, file_);
+    }
+    void start(Metrics* metrics)
+    {
+        metrics_ = metrics;
+        stop_.store(false);
+        thread_ = std::thread(&MetricsExporter::loop, this);
+    }
+    // Stop serving; return false if the final dump failed.
+    bool stop()
+    {
+        if (!thread_.joinable())
+            return true;
+        stop_.store(true);
+        thread_.join();
+#ifndef _WIN32
+        if (fd_ >= 0)
+            ::close(fd_);
+        if (!socket_path_.empty())
+            unlink(socket_path_.c_str());
+#endif
+        fd_ = -1;
+        socket_path_.clear();
+        return file_.empty() || dump();
+    }
+};
+
+#endif /* EOF */
@@ -0,0 +1,259 @@
+/* Per-thread hardware performance counters through perf_event_open(2). */
+
+#ifndef __PERF_COUNTERS_H__
+#define __PERF_COUNTERS_H__
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#ifdef __linux__
+#include <cerrno>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+enum PerfCounter
+{
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_BRANCHES,
+    PERF_BRANCH_MISSES,
+    PERF_STALLED_FRONTEND,
+    PERF_STALLED_BACKEND,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_NUM_COUNTERS
+};
+
+#define PERF_NUM_GROUPS 3
+
+struct PerfValues
+{
+    bool valid[PERF_NUM_COUNTERS];
+    double value[PERF_NUM_COUNTERS];  // scaled when multiplexed
+};
+
+/**
+ * Counters of the calling thread. Counters whose ratios matter are
+ * in the same group, so they are always scheduled together: cycles,
+ * instructions and branches; stalls; cache misses. Counters the PMU does
+ * not have are left out.
+ */
+class PerfCounters
+{
+    int fd_[PERF_NUM_COUNTERS];
+    int leader_[PERF_NUM_GROUPS];
+    int error_;
+
+#ifdef __linux__
+    struct Event
+    {
+        int group;
+        uint32_t type;
+        uint64_t config;
+    };
+    static const Event& event(int i)
+    {
+        static const Event events[PERF_NUM_COUNTERS] = {
+            { 0, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+            { 0, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+            { 0, PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+            { 0, PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+            { 1, PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_FRONTEND },
+            { 1, PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_BACKEND },
+            { 2, PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+            { 2, PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL |
+                (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+        };
+        return events[i];
+    }
+#endif
+public:
+    PerfCounters() : error_(0)
+    {
+        for (int i = 0; i < PERF_NUM_COUNTERS; i++)
+            fd_[i] = -1;
+        for (int g = 0; g < PERF_NUM_GROUPS; g++)
+            leader_[g] = -1;
+    }
+    ~PerfCounters()
+    {
+        close();
+    }
+    // Open the counters, return false if none is available; error()
+    // then tells why.
+    bool open()
+    {
+#ifdef __linux__
+        bool any = false;
+        for (int i = 0; i < PERF_NUM_COUNTERS; i++)
+        {
+            const Event& e = event(i);
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = e.type;
+            attr.config = e.config;
+            attr.disabled = leader_[e.group] < 0 ? 1 : 0;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP |
+                PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            fd_[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, leader_[e.group], 0);
+            if (fd_[i] < 0)
+            {
+                if (!any && error_ == 0)
+                    error_ = errno;
+                continue;
+            }
+            if (leader_[e.group] < 0)
+                leader_[e.group] = fd_[i];
+            any = true;
+        }
+        return any;
+#else
+        error_ = -1;
+        return false;
+#endif
+    }
+    void close()
+    {
+#ifdef __linux__
+        for (int i = 0; i < PERF_NUM_COUNTERS; i++)
+        {
+            if (fd_[i] >= 0)
+                ::close(fd_[i]);
+        }
+#endif
+        for (int i = 0; i < PERF_NUM_COUNTERS; i++)
+            fd_[i] = -1;
+        for (int g = 0; g < PERF_NUM_GROUPS; g++)
+            leader_[g] = -1;
+    }
+    // errno of the first failed open, -1 on platforms without perf events.
+    int error() const
+    {
+        return error_;
+    }
+    void start()
+    {
+#ifdef __linux__
+        for (int g = 0; g < PERF_NUM_GROUPS; g++)
+        {
+            if (leader_[g] < 0)
+                continue;
+            ioctl(leader_[g], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(leader_[g], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+#endif
+    }
+    void stop()
+    {
+#ifdef __linux__
+        for (int g = 0; g < PERF_NUM_GROUPS; g++)
+        {
+            if (leader_[g] >= 0)
+                ioctl(leader_[g], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        }
+#endif
+    }
+    PerfValues read() const
+    {
+        PerfValues v;
+        memset(&v, 0, sizeof(v));
+#ifdef __linux__
+        for (int g = 0; g < PERF_NUM_GROUPS; g++)
+        {
+            if (leader_[g] < 0)
+                continue;
+            // nr, time_enabled, time_running, values in the order of opening
+            uint64_t buf[3 + PERF_NUM_COUNTERS];
+            if (::read(leader_[g], buf, sizeof(buf)) < (ssize_t)(3 * sizeof(uint64_t)) || buf[2] == 0)
+                continue;
+            double scale = buf[1] / (double)buf[2];
+            uint64_t k = 0;
+            for (int i = 0; i < PERF_NUM_COUNTERS && k < buf[0]; i++)
+            {
+                if (event(i).group != g || fd_[i] < 0)
+                    continue;
+                v.valid[i] = true;
+                v.value[i] = buf[3 + k++] * scale;
+            }
+        }
+#endif
+        return v;
+    }
+};
+
+inline static void
+perf_add(PerfValues& sum, const PerfValues& v)
+{
+    for (int i = 0; i < PERF_NUM_COUNTERS; i++)
+    {
+        sum.valid[i] = sum.valid[i] || v.valid[i];
+        sum.value[i] += v.value[i];
+    }
+}
+
+/**
+ * Explain why no counter could be opened.
+ */
+inline static void
+perf_report_error(FILE* out, int error)
+{
+    if (error < 0)
+    {
+        fprintf(out, "perf counters are not supported on this platform\n");
+        return;
+    }
+    int paranoid = -100;
+    FILE* f = fopen("/proc/sys/kernel/perf_event_paranoid", "r");
+    if (f)
+    {
+        if (fscanf(f, "%d", &paranoid) != 1)
+            paranoid = -100;
+        fclose(f);
+    }
+    if (paranoid != -100)
+        fprintf(out, "perf counters unavailable: %s (perf_event_paranoid = %d)\n", strerror(error), paranoid);
+    else
+        fprintf(out, "perf counters unavailable: %s\n", strerror(error));
+}
+
+/**
+ * One line of derived metrics: IPC, cycles per sample, branch-miss rate,
+ * stalls and cache misses per sample. Missing counters print as "-".
+ */
+inline static void
+perf_report(FILE* out, const char* name, const PerfValues& v, int64_t samples)
+{
+    char ipc[32] = "-", cps[32] = "-", bmr[32] = "-", fe[32] = "-", be[32] = "-", l1[32] = "-", llc[32] = "-";
+    if (v.valid[PERF_CYCLES] && v.valid[PERF_INSTRUCTIONS] && v.value[PERF_CYCLES] > 0)
+        snprintf(ipc, sizeof(ipc), "%.3f", v.value[PERF_INSTRUCTIONS] / v.value[PERF_CYCLES]);
+    if (v.valid[PERF_CYCLES] && samples > 0)
+        snprintf(cps, sizeof(cps), "%.2f", v.value[PERF_CYCLES] / samples);
+    if (v.valid[PERF_BRANCHES] && v.valid[PERF_BRANCH_MISSES] && v.value[PERF_BRANCHES] > 0)
+        snprintf(bmr, sizeof(bmr), "%.3f%%", 100 * v.value[PERF_BRANCH_MISSES] / v.value[PERF_BRANCHES]);
+    if (v.valid[PERF_CYCLES] && v.valid[PERF_STALLED_FRONTEND] && v.value[PERF_CYCLES] > 0)
+        snprintf(fe, sizeof(fe), "%.1f%%", 100 * v.value[PERF_STALLED_FRONTEND] / v.value[PERF_CYCLES]);
+    if (v.valid[PERF_CYCLES] && v.valid[PERF_STALLED_BACKEND] && v.value[PERF_CYCLES] > 0)
+        snprintf(be, sizeof(be), "%.1f%%", 100 * v.value[PERF_STALLED_BACKEND] / v.value[PERF_CYCLES]);
+    if (v.valid[PERF_L1D_MISSES] && samples > 0)
+        snprintf(l1, sizeof(l1), "%.4f", v.value[PERF_L1D_MISSES] / samples);
+    if (v.valid[PERF_LLC_MISSES] && samples > 0)
+        snprintf(llc, sizeof(llc), "%.4f", v.value[PERF_LLC_MISSES] / samples);
+    fprintf(out, "%-10s %8s %14s %12s %10s %10s %14s %14s\n", name, ipc, cps, bmr, fe, be, l1, llc);
+}
+
+inline static void
+perf_report_header(FILE* out)
+{
+    fprintf(out, "%-10s %8s %14s %12s %10s %10s %14s %14s\n", "thread", "IPC", "cycles/sample",
+        "branch-miss", "fe-stall", "be-stall", "L1D-miss/smp", "LLC-miss/smp");
+}
+
+#endif /* EOF */
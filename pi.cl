@@ -1,6 +1,5 @@
 #include <mt19937.cl>
-#define KERNEL_PROGRAM
-#include <tinymt32_jump.clh>
+#include "tinymt32j.h"
 
 uint wang_hash(uint seed)
 {
@@ -39,7 +38,7 @@ void pi_v2(uint iters,
            __global uint* global_sum)
 {
     tinymt32j_t tiny;
-    tinymt32j_init_jump(&tiny, seed);
+    tinymt32j_init_jump(&tiny, seed, get_global_id(0));
     uint sum = 0;
     for (uint i = 0; i < iters; i++)
     {
@@ -53,3 +52,114 @@ void pi_v2(uint iters,
     const size_t global_id = get_global_id(0);
     global_sum[global_id] = sum;
 }
+
+/*
+ * Ensemble of replicas in one dispatch. Every replica covers
+ * get_global_size(0) / num_replicas consecutive work items, a multiple of
+ * the work-group size, so each work-group belongs to exactly one replica
+ * and its jump ids are disjoint from all other replicas.
+ */
+__kernel
+void pi_v2_ensemble(uint iters,
+                    uint seed,
+                    __global uint* group_sum,
+                    __local uint* scratch)
+{
+    tinymt32j_t tiny;
+    tinymt32j_init_jump(&tiny, seed, get_global_id(0));
+    uint sum = 0;
+    for (uint i = 0; i < iters; i++)
+    {
+        float x = tinymt32j_single01(&tiny);
+        float y = tinymt32j_single01(&tiny);
+        if (x * x + y * y <= 1.0f) 
+        {
+            sum++;
+        }
+    }
+
+    const uint local_id = get_local_id(0);
+    const uint local_size = get_local_size(0);
+    scratch[local_id] = sum;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (uint s = 1; s < local_size; s <<= 1)
+    {
+        if ((local_id % (2 * s)) == 0 && local_id + s < local_size)
+        {
+            scratch[local_id] += scratch[local_id + s];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    if (local_id == 0)
+    {
+        group_sum[get_group_id(0)] = scratch[0];
+    }
+}
+
+__kernel
+void reduce_replicas(uint groups_per_replica,
+                     __global const uint* group_sum,
+                     __global ulong* replica_sum)
+{
+    const size_t replica = get_global_id(0);
+    __global const uint* p = group_sum + replica * groups_per_replica;
+    ulong sum = 0;
+    for (uint i = 0; i < groups_per_replica; i++)
+    {
+        sum += p[i];
+    }
+    replica_sum[replica] = sum;
+}
+
+/*
+ * Chunks of the CPU engine: work item g draws the samples
+ * [g * iters, min((g + 1) * iters, num_samples)) from stream g, as chunk g
+ * of a CPU run does, so that both count the same hits. Use the global
+ * offset to select the first chunk.
+ */
+__kernel
+void pi_chunks(uint iters,
+               uint seed,
+               ulong num_samples,
+               __global uint* chunk_sum)
+{
+    // Round x * x and y * y like the host does, which is built with
+    // -ffp-contract=off.
+    #pragma OPENCL FP_CONTRACT OFF
+    const size_t chunk = get_global_id(0);
+    const ulong begin = (ulong)chunk * iters;
+    const uint n = begin >= num_samples ? 0 : (uint)min((ulong)iters, num_samples - begin);
+    tinymt32j_t tiny;
+    tinymt32j_init_jump(&tiny, seed, chunk);
+    uint sum = 0;
+    for (uint i = 0; i < n; i++)
+    {
+        float x = tinymt32j_single01(&tiny);
+        float y = tinymt32j_single01(&tiny);
+        if (x * x + y * y <= 1.0f) 
+        {
+            sum++;
+        }
+    }
+    chunk_sum[chunk - get_global_offset(0)] = sum;
+}
+
+/*
+ * The first draws of stream get_global_id(0), alternating tinymt32j_uint32
+ * and the bits of tinymt32j_single01, for comparison with the host. Use the
+ * global offset to select the first stream.
+ */
+__kernel
+void dump_streams(uint draws,
+                  uint seed,
+                  __global uint* out)
+{
+    tinymt32j_t tiny;
+    tinymt32j_init_jump(&tiny, seed, get_global_id(0));
+    __global uint* p = out + (get_global_id(0) - get_global_offset(0)) * draws * 2;
+    for (uint i = 0; i < draws; i++)
+    {
+        p[2 * i] = tinymt32j_uint32(&tiny);
+        p[2 * i + 1] = as_uint(tinymt32j_single01(&tiny));
+    }
+}
@@ -0,0 +1,691 @@
+/* Chunked CPU engine shared by estimate_pi_cpu and estimate_pi_bench. */
+
+#ifndef __PI_CPU_H__
+#define __PI_CPU_H__
+
+#include <cstdint>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <ctime>
+#include <functional>
+#include <list>
+#include <map>
+#include <string>
+
+#include "tinymt32j.h"
+#define USE_TINYMT 1
+
+#include "perf_counters.h"
+#include "trace.h"
+#include "metrics.h"
+#include "probes.h"
+
+// The sample space is cut into chunks of CHUNK_SAMPLES, chunk c drawing
+// from the stream with jump id c. The result depends only on the number
+// of samples, never on how many threads run the chunks or in which order.
+#define CHUNK_SAMPLES (1 << 20)
+#define MAX_CHUNKS    (1LL << 32)  // jump ids are 32-bit
+#define DEFAULT_SEED  42
+
+class RandomNumber
+{
+#if USE_TINYMT
+    tinymt32j_t tinymt_;
+#else
+    std::mt19937 mt19937_;  // random number generator
+    const float MT19937_FLOAT_MULTI = 2.3283064365386962890625e-10f; // (2^32-1)^-1
+#endif
+public:
+    // Start stream id of the sequence of seed.
+    void seed(uint32_t seed, uint32_t id)
+    {
+    #if USE_TINYMT
+        tinymt32j_init_jump(&tinymt_, seed, id);
+    #else
+        std::seed_seq seq = { seed, id };
+        mt19937_.seed(seq);
+    #endif
+    }
+    float operator() ()
+    {
+    #if USE_TINYMT
+        return tinymt32j_single01(&tinymt_);
+    #else
+        return mt19937_() * MT19937_FLOAT_MULTI;
+    #endif
+    }
+#if USE_TINYMT
+    const tinymt32j_t& state() const
+    {
+        return tinymt_;
+    }
+    void restore(const tinymt32j_t& state)
+    {
+        tinymt_ = state;
+    }
+#endif
+};
+
+/**
+ * Start states of the streams with jump ids [0, size) of one seed,
+ * computed once so that runs skip the jump (about 20us per chunk). Used
+ * by long-lived engines where small runs are common.
+ */
+struct StreamCache
+{
+    uint32_t seed;
+#if USE_TINYMT
+    std::vector<tinymt32j_t> states;
+#endif
+
+    StreamCache() : seed(0)
+    {
+    }
+    void fill(uint32_t s, int64_t size)
+    {
+        seed = s;
+#if USE_TINYMT
+        states.resize(size);
+        for (int64_t id = 0; id < size; id++)
+            tinymt32j_init_jump(&states[id], s, (uint32_t)id);
+#else
+        (void)size;
+#endif
+    }
+    // Start rnd on stream id of seed s if the cache has it.
+    bool start(RandomNumber* rnd, uint32_t s, int64_t id) const
+    {
+#if USE_TINYMT
+        if (s != seed || id >= (int64_t)states.size())
+            return false;
+        rnd->restore(states[id]);
+        return true;
+#else
+        (void)rnd;
+        (void)s;
+        (void)id;
+        return false;
+#endif
+    }
+};
+
+// Draw samples up to each of the increasing offsets ends[0..num_ends-1],
+// storing the number of points inside the circle so far in in[]. The
+// products are rounded before the sum (-ffp-contract=off, see
+// CMakeLists.txt), like the pi_chunks kernel.
+inline static void
+worker(const int64_t *ends, int num_ends, RandomNumber *rnd, int64_t *in)
+{
+    int64_t localCounter = 0;
+    int64_t i = 0;
+    for (int k = 0; k < num_ends; k++)
+    {
+        for (; i < ends[k]; i++)
+        {
+            float x = (*rnd)();
+            float y = (*rnd)();
+            if (x*x + y*y <= 1)
+            {
+                localCounter++;
+            }
+        }
+        in[k] = localCounter;
+    }
+}
+
+/**
+ * What one thread of a run did.
+ */
+struct ThreadStats
+{
+    int64_t chunks;
+    int64_t samples;
+    int64_t busy_ns;              // CPU time computing chunks
+    PerfValues perf;
+    int perf_error;               // errno when no counter could be opened
+};
+
+/**
+ * Samples [prefix_samples, num_samples) of num_replicas independent
+ * replicas from first_replica on. Replica r draws chunk c from jump id
+ * r * chunks_per_replica + c, so replica 0 is a normal run. Tasks are the
+ * chunks still to compute, in replica-major order, and are claimed by the
+ * threads one at a time.
+ */
+struct Run
+{
+    uint32_t seed;
+    int64_t chunk_samples;        // CHUNK_SAMPLES except in benchmarks
+    int64_t num_samples;
+    int64_t prefix_samples;       // already counted, from the cache
+    int num_replicas;
+    int64_t first_replica;
+    int64_t chunks_per_replica;
+    int64_t first_chunk;
+    int64_t tasks_per_replica;
+    int64_t num_tasks;
+    std::atomic<int64_t> next_task;
+    std::vector<int64_t> task_points;  // hits of each task
+
+    // Checkpoints of replica 0; the hits of the chunk a checkpoint ends in,
+    // up to the checkpoint, go to checkpoint_points.
+    std::vector<int64_t> checkpoints;
+    std::vector<int64_t> checkpoint_points;
+
+    bool perf;                    // collect hardware counters per thread
+    std::vector<ThreadStats> thread_stats;
+    Metrics* metrics;             // updated after every chunk if set
+    const std::atomic<bool>* cancel;  // no more tasks are claimed once set
+    const StreamCache* streams;   // start states, if set
+
+#if USE_TINYMT
+    tinymt32j_t resume_state;     // chunk first_chunk after prefix_samples
+    tinymt32j_t last_state;       // last chunk after num_samples
+#endif
+
+    Run(int64_t samples, int64_t prefix, int replicas, int64_t chunk = CHUNK_SAMPLES)
+        : seed(DEFAULT_SEED), chunk_samples(chunk), num_samples(samples), prefix_samples(prefix), num_replicas(replicas),
+          first_replica(0), next_task(0), perf(false), metrics(nullptr), cancel(nullptr), streams(nullptr)
+    {
+        chunks_per_replica = (num_samples + chunk_samples - 1) / chunk_samples;
+        first_chunk = prefix_samples / chunk_samples;
+        tasks_per_replica = chunks_per_replica - first_chunk;
+        num_tasks = tasks_per_replica * num_replicas;
+        task_points.resize(num_tasks);
+    }
+};
+
+inline static int64_t
+elapsed_ns(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
+// CPU time of the calling thread, or the wall time where there is no
+// thread clock.
+inline static int64_t
+thread_cpu_ns()
+{
+#if defined(CLOCK_THREAD_CPUTIME_ID)
+    timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+        return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Compute one task, return the number of samples drawn.
+inline static int64_t
+run_task(Run *run, int64_t task, RandomNumber *rnd)
+{
+    int64_t replica = task / run->tasks_per_replica;
+    int64_t chunk = run->first_chunk + task % run->tasks_per_replica;
+    int64_t base = chunk * run->chunk_samples;
+    int64_t begin = std::max(run->prefix_samples, base) - base;
+    int64_t end = std::min(run->num_samples, base + run->chunk_samples) - base;
+
+    int64_t id = (run->first_replica + replica) * run->chunks_per_replica + chunk;
+#if USE_TINYMT
+    if (begin > 0)
+        rnd->restore(run->resume_state);
+    else
+#endif
+    if (!run->streams || !run->streams->start(rnd, run->seed, id))
+        rnd->seed(run->seed, (uint32_t)id);
+
+    // Stop at the checkpoints inside this chunk on the way to its end.
+    std::vector<int64_t> ends;
+    std::vector<int> marks;
+    if (replica == 0)
+    {
+        for (int k = 0; k < (int)run->checkpoints.size(); k++)
+        {
+            int64_t offset = run->checkpoints[k] - base;
+            if (offset > begin && offset <= end)
+            {
+                marks.push_back(k);
+                ends.push_back(offset - begin);
+            }
+        }
+    }
+    ends.push_back(end - begin);
+    std::vector<int64_t> in(ends.size());
+
+    worker(&ends[0], (int)ends.size(), rnd, &in[0]);
+
+    for (size_t i = 0; i < marks.size(); i++)
+        run->checkpoint_points[marks[i]] = in[i];
+    run->task_points[task] = in.back();
+#if USE_TINYMT
+    if (replica == 0 && base + end == run->num_samples)
+        run->last_state = rnd->state();
+#endif
+    return end - begin;
+}
+
+// Hits of all tasks of all replicas.
+inline static int64_t
+total_points(const Run *run)
+{
+    int64_t points = 0;
+    for (int64_t t = 0; t < run->num_tasks; t++)
+        points += run->task_points[t];
+    return points;
+}
+
+inline static bool
+run_cancelled(const Run *run)
+{
+    return run->cancel && run->cancel->load(std::memory_order_relaxed);
+}
+
+// Tasks that were computed, a prefix of all tasks since claimed tasks
+// always finish. Valid once the run is over.
+inline static int64_t
+completed_tasks(const Run *run)
+{
+    return std::min(run->next_task.load(), run->num_tasks);
+}
+
+// Compute claimed task on the thread thread_index.
+inline static void
+run_chunk(Run *run, int thread_index, int64_t task, RandomNumber *rnd)
+{
+    TRACE_SCOPE("chunk", task);
+    ThreadStats& stats = run->thread_stats[thread_index];
+    int64_t queued = std::max(run->num_tasks - task - 1, (int64_t)0);
+    PROBE3(chunk__start, thread_index, task, queued);
+    // Four clock reads per chunk of 2^20 samples.
+    auto start = std::chrono::steady_clock::now();
+    int64_t cpu_start = thread_cpu_ns();
+    int64_t samples = run_task(run, task, rnd);
+    stats.busy_ns += thread_cpu_ns() - cpu_start;
+    int64_t ns = elapsed_ns(start);
+    PROBE5(chunk__done, thread_index, task, samples, run->task_points[task], ns);
+    if (run->metrics)
+    {
+        run->metrics->setQueued(queued);
+        run->metrics->addChunk(thread_index, samples, run->task_points[task], ns);
+    }
+    stats.samples += samples;
+    stats.chunks++;
+}
+
+// Run tasks until none is left or the run is cancelled.
+inline static void
+run_worker(Run *run, int thread_index)
+{
+    TRACE_THREAD_NAME("worker " + std::to_string(thread_index));
+    TRACE_SCOPE("worker");
+    PROBE1(worker__start, thread_index);
+    auto worker_start = std::chrono::steady_clock::now();
+    ThreadStats& stats = run->thread_stats[thread_index];
+    PerfCounters counters;
+    if (run->perf)
+    {
+        if (!counters.open())
+            stats.perf_error = counters.error();
+        counters.start();
+    }
+
+    RandomNumber rnd;
+    while (!run_cancelled(run))
+    {
+        int64_t task = run->next_task.fetch_add(1);
+        if (task >= run->num_tasks)
+            break;
+        run_chunk(run, thread_index, task, &rnd);
+    }
+
+    if (run->perf)
+    {
+        counters.stop();
+        stats.perf = counters.read();
+    }
+    PROBE4(worker__end, thread_index, stats.chunks, stats.samples, elapsed_ns(worker_start));
+    (void)worker_start;
+}
+
+// Compute a Pacer lets through at once after an idle time.
+#define PACER_BURST_MS 100
+
+/**
+ * Token bucket capping the CPU time of the threads charging it to a
+ * number of cores. Tokens are nanoseconds of CPU time, refilled at cores
+ * nanoseconds per nanosecond of wall time, up to a burst of
+ * PACER_BURST_MS worth. A thread charges each chunk once computed and
+ * sleeps until the bucket is out of debt. Refills follow the clock, so
+ * oversleeping is made up for by the next chunks instead of adding up.
+ */
+class Pacer
+{
+    std::mutex mutex_;
+    double cores_;                // 0 if unlimited
+    double tokens_;
+    std::chrono::steady_clock::time_point refilled_;
+public:
+    Pacer() : cores_(0), tokens_(0)
+    {
+    }
+    double cores()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return cores_;
+    }
+    void set_cores(double cores)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        cores_ = std::max(cores, 0.0);
+        tokens_ = 0;
+        refilled_ = std::chrono::steady_clock::now();
+    }
+    // Take ns of compute, and return when the caller may compute again.
+    std::chrono::steady_clock::time_point charge(int64_t ns)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto now = std::chrono::steady_clock::now();
+        if (cores_ <= 0)
+            return now;
+        double burst = cores_ * PACER_BURST_MS * 1e6;
+        tokens_ = std::min(tokens_ + std::chrono::duration<double, std::nano>(now - refilled_).count() * cores_, burst);
+        refilled_ = now;
+        tokens_ -= (double)ns;
+        if (tokens_ >= 0)
+            return now;
+        return now + std::chrono::nanoseconds((int64_t)(-tokens_ / cores_));
+    }
+};
+
+/**
+ * Worker threads kept across runs, so that repeated runs do not pay for
+ * spawning them. Any number of runs can be submitted at once and share
+ * the threads chunk by chunk: every time a thread is free it picks the
+ * next chunk to compute, so scheduling decisions, and preemption, happen
+ * at chunk boundaries.
+ *
+ * Runs belong to tenants and have a priority. Only the runs of the highest
+ * priority with chunks left are served. Between their tenants, deficit
+ * round robin shares the chunks by weight (in samples, a quantum of
+ * weight * CHUNK_SAMPLES per round); within a tenant, the oldest run
+ * goes first. A run is done once no task is left, or it was cancelled,
+ * and its claimed chunks have finished.
+ *
+ * Only the first active() threads take chunks; the others wait, so the
+ * parallelism can follow the CPU available to the process without
+ * respawning threads. With a budget, the threads together compute no
+ * more than budget() cores worth, pacing themselves between chunks.
+ */
+class WorkerPool
+{
+    struct Job
+    {
+        Run* run;
+        int tenant;
+        int priority;             // higher first
+        int in_flight;            // chunks being computed
+        bool claimed;             // no task left to claim
+        std::function<void()> done;
+    };
+    struct Tenant
+    {
+        int weight;
+        int64_t deficit;          // samples it may still take this round
+        int jobs;
+    };
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable work_;
+    std::list<Job> jobs_;         // in submission order
+    std::map<int, Tenant> tenants_;
+    std::vector<int> order_;      // round of the tenants with jobs
+    size_t turn_;
+    bool granted_;                // order_[turn_] got its quantum
+    int active_;
+    Pacer pacer_;
+    bool quit_;
+
+    void advance()
+    {
+        turn_ = order_.empty() ? 0 : (turn_ + 1) % order_.size();
+        granted_ = false;
+    }
+
+    // The job to take the next chunk from, jobs_.end() if none.
+    std::list<Job>::iterator pick()
+    {
+        int top = INT_MIN;
+        for (const Job& j : jobs_)
+        {
+            if (!j.claimed)
+                top = std::max(top, j.priority);
+        }
+        if (top == INT_MIN)
+            return jobs_.end();
+        // Ends within one round: every tenant with a job at top gets a
+        // quantum of at least a chunk.
+        for (;;)
+        {
+            int id = order_[turn_];
+            Tenant& t = tenants_[id];
+            std::list<Job>::iterator job = jobs_.begin();
+            while (job != jobs_.end() && (job->tenant != id || job->claimed || job->priority != top))
+                ++job;
+            if (job == jobs_.end())
+            {
+                t.deficit = 0;    // idle at this priority, no credit
+                advance();
+                continue;
+            }
+            if (!granted_)
+            {
+                t.deficit += (int64_t)t.weight * CHUNK_SAMPLES;
+                granted_ = true;
+            }
+            int64_t cost = job->run->chunk_samples;
+            if (t.deficit >= cost)
+            {
+                t.deficit -= cost;
+                return job;
+            }
+            advance();
+        }
+    }
+
+    // Called with the lock held; unlocks it to call done.
+    void finish(std::list<Job>::iterator job, std::unique_lock<std::mutex>& lock)
+    {
+        std::function<void()> done;
+        done.swap(job->done);
+        auto t = tenants_.find(job->tenant);
+        if (--t->second.jobs == 0)
+        {
+            size_t i = std::find(order_.begin(), order_.end(), job->tenant) - order_.begin();
+            order_.erase(order_.begin() + i);
+            // Tenants come and go, only their weight is worth keeping.
+            if (t->second.weight == 1)
+                tenants_.erase(t);
+            else
+                t->second.deficit = 0;
+            if (i < turn_)
+                turn_--;
+            else if (i == turn_)
+                granted_ = false;
+            if (turn_ >= order_.size())
+                turn_ = 0;
+        }
+        jobs_.erase(job);
+        lock.unlock();
+        if (done)
+            done();
+        lock.lock();
+    }
+
+    void loop(int thread_index)
+    {
+        RandomNumber rnd;
+        PerfCounters counters;
+        int perf_error = -1;      // not opened yet
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;)
+        {
+            std::list<Job>::iterator job = jobs_.end();
+            // Runs submitted before the pool is destroyed still complete.
+            work_.wait(lock, [&] {
+                job = thread_index < active_ ? pick() : jobs_.end();
+                return quit_ || job != jobs_.end();
+            });
+            if (job == jobs_.end())
+                return;
+            Run* run = job->run;
+            int64_t task = run_cancelled(run) ? run->num_tasks : run->next_task.fetch_add(1);
+            if (task + 1 >= run->num_tasks)
+                job->claimed = true;
+            if (task >= run->num_tasks)
+            {
+                if (job->in_flight == 0)
+                    finish(job, lock);
+                continue;
+            }
+            job->in_flight++;
+            lock.unlock();
+
+            int64_t busy_ns = run->thread_stats[thread_index].busy_ns;
+            if (run->perf)
+            {
+                ThreadStats& stats = run->thread_stats[thread_index];
+                if (perf_error < 0)
+                    perf_error = counters.open() ? 0 : counters.error();
+                stats.perf_error = perf_error;
+                // Counters of a thread run only around the chunks of runs
+                // with perf; start() resets them, so each read is one chunk.
+                counters.start();
+                run_chunk(run, thread_index, task, &rnd);
+                counters.stop();
+                perf_add(stats.perf, counters.read());
+            }
+            else
+            {
+                run_chunk(run, thread_index, task, &rnd);
+            }
+
+            // Sleep off the budget only after finishing the run, which is
+            // not held up by the pacing.
+            auto resume = pacer_.charge(run->thread_stats[thread_index].busy_ns - busy_ns);
+            lock.lock();
+            if (--job->in_flight == 0 && job->claimed)
+                finish(job, lock);
+            if (resume > std::chrono::steady_clock::now())
+            {
+                lock.unlock();
+                std::this_thread::sleep_until(resume);
+                lock.lock();
+            }
+        }
+    }
+public:
+    explicit WorkerPool(int num_threads) : turn_(0), granted_(false), active_(num_threads), quit_(false)
+    {
+        for (int i = 0; i < num_threads; i++)
+            threads_.emplace_back(&WorkerPool::loop, this, i);
+    }
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            quit_ = true;
+        }
+        work_.notify_all();
+        for (std::thread& t : threads_)
+            t.join();
+    }
+    int size() const
+    {
+        return (int)threads_.size();
+    }
+    int active()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return active_;
+    }
+    // Threads taking chunks from now on, between 1 and size(). Threads
+    // beyond it finish the chunk they are computing.
+    void set_active(int threads)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            active_ = std::max(1, std::min(threads, size()));
+        }
+        work_.notify_all();
+    }
+    double budget()
+    {
+        return pacer_.cores();
+    }
+    // Cap the compute of all threads to cores, such as 2.5; 0 lifts it.
+    void set_budget(double cores)
+    {
+        pacer_.set_cores(cores);
+    }
+    // Share of tenant relative to the others, 1 by default.
+    void set_weight(int tenant, int weight)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Tenant& t = tenants_[tenant];
+        t.weight = std::max(weight, 1);
+    }
+    // Start run, whose thread_stats has size() entries, and return. done
+    // is called on a worker thread once the run is over.
+    void submit(Run* run, std::function<void()> done, int tenant = 0, int priority = 0)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            Tenant& t = tenants_.insert(std::make_pair(tenant, Tenant{ 1, 0, 0 })).first->second;
+            if (t.jobs++ == 0)
+                order_.push_back(tenant);
+            Job job;
+            job.run = run;
+            job.tenant = tenant;
+            job.priority = priority;
+            job.in_flight = 0;
+            job.claimed = false;
+            job.done = std::move(done);
+            jobs_.push_back(std::move(job));
+        }
+        work_.notify_all();
+    }
+    // Run run on the threads and wait for it.
+    void run(Run* run)
+    {
+        std::mutex mutex;
+        std::condition_variable cv;
+        bool over = false;
+        submit(run, [&] {
+            std::lock_guard<std::mutex> lock(mutex);
+            over = true;
+            cv.notify_one();
+        });
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return over; });
+    }
+};
+
+// Hits of replica r, without the cached prefix.
+inline static int64_t
+replica_points(const Run *run, int r)
+{
+    int64_t points = 0;
+    for (int64_t t = 0; t < run->tasks_per_replica; t++)
+        points += run->task_points[r * run->tasks_per_replica + t];
+    return points;
+}
+
+#endif /* EOF */
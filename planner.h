@@ -0,0 +1,221 @@
+/* Cost model of the backends, calibrated per host, and the planner using it. */
+
+#ifndef __PLANNER_H__
+#define __PLANNER_H__
+
+#include <cstdint>
+#include <cstdio>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "history.h"
+#include "pi_cpu.h"
+
+/**
+ * One way to run an estimate: "inline" on the calling thread, "cpu:N" on
+ * a pool of N threads, or "opencl:D:KERNEL" on device index D. The wall
+ * time of a run of n samples in a fresh process is predicted as
+ *
+ *   setup_ms + fixed_ms + ns_per_sample * critical(n) / 1e6
+ *
+ * where setup is creating the engine (spawning the pool, building the
+ * program), fixed is the cost of a run of nothing on a warm engine, and
+ * critical(n) are the samples on the longest path: n inline, n / threads
+ * but at least a chunk on the pool, ceil(n / work items) per work item on
+ * a device.
+ */
+struct PlanOption
+{
+    std::string name;
+    int64_t parallel;             // threads or work items, 1 inline
+    double setup_ms;
+    double fixed_ms;
+    double ns_per_sample;         // on the critical path
+
+    PlanOption() : parallel(1), setup_ms(0), fixed_ms(0), ns_per_sample(0)
+    {
+    }
+    bool opencl() const
+    {
+        return name.compare(0, 7, "opencl:") == 0;
+    }
+    bool inlined() const
+    {
+        return name == "inline";
+    }
+    double critical(int64_t samples) const
+    {
+        if (opencl())
+            return (double)((samples + parallel - 1) / parallel);
+        if (inlined())
+            return (double)samples;
+        return std::max((double)samples / parallel, (double)std::min(samples, (int64_t)CHUNK_SAMPLES));
+    }
+    double predict_ms(int64_t samples) const
+    {
+        return setup_ms + fixed_ms + ns_per_sample * critical(samples) / 1e6;
+    }
+    // The most samples a run can draw within deadline_ms, 0 if none.
+    int64_t samples_within(double deadline_ms) const
+    {
+        double budget = deadline_ms - setup_ms - fixed_ms;
+        if (budget <= 0 || ns_per_sample <= 0)
+            return 0;
+        double critical = budget * 1e6 / ns_per_sample;
+        if (opencl())
+            return (int64_t)critical * parallel;
+        if (inlined() || critical < CHUNK_SAMPLES)
+            return (int64_t)critical;
+        return (int64_t)(critical * parallel);
+    }
+    // Fit fixed and per-sample costs from warm runs of two sizes.
+    void fit(int64_t n1, double ms1, int64_t n2, double ms2)
+    {
+        double c1 = critical(n1), c2 = critical(n2);
+        ns_per_sample = c2 > c1 ? std::max((ms2 - ms1) * 1e6 / (c2 - c1), 0.0) : 0;
+        fixed_ms = std::max(ms1 - ns_per_sample * c1 / 1e6, 0.0);
+    }
+};
+
+/**
+ * Samples for a 95% confidence interval of half width ci95, at the true
+ * value of pi.
+ */
+inline static int64_t
+samples_for_ci95(double ci95)
+{
+    double p = acos(-1.0) / 4;
+    double z = 1.96 * 4 / ci95;
+    return (int64_t)ceil(z * z * p * (1 - p));
+}
+
+/**
+ * The option to run, how many samples and how long it should take.
+ */
+struct Plan
+{
+    int option;                   // index, -1 if none fits
+    int64_t samples;
+    double predicted_ms;
+};
+
+/**
+ * The fastest option for a number of samples.
+ */
+inline static Plan
+plan_fastest(const std::vector<PlanOption>& options, int64_t samples)
+{
+    Plan plan = { -1, samples, 0 };
+    for (size_t i = 0; i < options.size(); i++)
+    {
+        double ms = options[i].predict_ms(samples);
+        if (plan.option < 0 || ms < plan.predicted_ms)
+        {
+            plan.option = (int)i;
+            plan.predicted_ms = ms;
+        }
+    }
+    return plan;
+}
+
+/**
+ * The most accurate option, the one drawing the most samples, within a
+ * deadline.
+ */
+inline static Plan
+plan_deadline(const std::vector<PlanOption>& options, double deadline_ms)
+{
+    Plan plan = { -1, 0, 0 };
+    for (size_t i = 0; i < options.size(); i++)
+    {
+        int64_t samples = options[i].samples_within(deadline_ms);
+        if (samples > plan.samples)
+        {
+            plan.option = (int)i;
+            plan.samples = samples;
+            plan.predicted_ms = options[i].predict_ms(samples);
+        }
+    }
+    return plan;
+}
+
+/**
+ * Calibrations of all hosts in a text file, one line per option:
+ * host fingerprint, name, parallel, setup, fixed and per-sample cost.
+ * Calibrating a host replaces its lines only.
+ */
+class Calibration
+{
+    struct Line
+    {
+        uint64_t host;
+        PlanOption option;
+    };
+    std::vector<Line> lines_;
+public:
+    bool load(const char* path)
+    {
+        lines_.clear();
+        FILE* f = fopen(path, "r");
+        if (!f)
+            return false;
+        char buf[512];
+        while (fgets(buf, sizeof(buf), f))
+        {
+            Line l;
+            char name[128];
+            unsigned long long host;
+            long long parallel;
+            if (buf[0] == '#' || sscanf(buf, "%llx %127s %lld %lf %lf %lf", &host, name, &parallel,
+                                        &l.option.setup_ms, &l.option.fixed_ms, &l.option.ns_per_sample) != 6)
+                continue;
+            l.host = host;
+            l.option.name = name;
+            l.option.parallel = std::max(parallel, 1LL);
+            lines_.push_back(l);
+        }
+        fclose(f);
+        return true;
+    }
+    bool save(const char* path) const
+    {
+        FILE* f = fopen(path, "w");
+        if (!f)
+            return false;
+        fprintf(f, "# host option parallel setup_ms fixed_ms ns_per_sample\n");
+        for (const Line& l : lines_)
+        {
+            fprintf(f, "%016llx %s %lld %.4f %.4f %.6f\n", (unsigned long long)l.host, l.option.name.c_str(),
+                    (long long)l.option.parallel, l.option.setup_ms, l.option.fixed_ms, l.option.ns_per_sample);
+        }
+        return fclose(f) == 0;
+    }
+    std::vector<PlanOption> options(uint64_t host) const
+    {
+        std::vector<PlanOption> v;
+        for (const Line& l : lines_)
+        {
+            if (l.host == host)
+                v.push_back(l.option);
+        }
+        return v;
+    }
+    void replace(uint64_t host, const std::vector<PlanOption>& options)
+    {
+        lines_.erase(std::remove_if(lines_.begin(), lines_.end(), [&](const Line& l) { return l.host == host; }),
+                     lines_.end());
+        for (const PlanOption& o : options)
+        {
+            Line l;
+            l.host = host;
+            l.option = o;
+            lines_.push_back(l);
+        }
+    }
+};
+
+#endif /* EOF */
@@ -0,0 +1,46 @@
+/* USDT static probes for bpftrace, perf and SystemTap. */
+
+#ifndef __PROBES_H__
+#define __PROBES_H__
+
+// With systemtap's sys/sdt.h every probe is a single NOP plus a note in
+// .note.stapsdt, patched into a breakpoint only while a tracer is
+// attached. Without the header, or with -DDISABLE_USDT, probes vanish.
+//
+//   estimate_pi:run__start      threads, samples, chunks
+//   estimate_pi:run__end        threads, samples, hits, ns
+//   estimate_pi:worker__start   worker
+//   estimate_pi:worker__end     worker, chunks, samples, ns
+//   estimate_pi:chunk__start    worker, chunk, chunks still queued
+//   estimate_pi:chunk__done     worker, chunk, samples, hits, ns
+//   estimate_pi:checkpoint      checkpoint index, samples, hits
+//   estimate_pi:cache__store    samples, hits
+//   estimate_pi:cl__enqueue     kernel name, work items
+//   estimate_pi:cl__complete    kernel name, work items, ns
+//
+// e.g. bpftrace -e 'usdt:./estimate_pi_cpu:chunk__done { @ns[arg0] = hist(arg4); }'
+
+#if !defined(DISABLE_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_USDT 1
+#endif
+#endif
+
+#if HAVE_USDT
+#define PROBE0(name)                      DTRACE_PROBE(estimate_pi, name)
+#define PROBE1(name, a)                   DTRACE_PROBE1(estimate_pi, name, a)
+#define PROBE2(name, a, b)                DTRACE_PROBE2(estimate_pi, name, a, b)
+#define PROBE3(name, a, b, c)             DTRACE_PROBE3(estimate_pi, name, a, b, c)
+#define PROBE4(name, a, b, c, d)          DTRACE_PROBE4(estimate_pi, name, a, b, c, d)
+#define PROBE5(name, a, b, c, d, e)       DTRACE_PROBE5(estimate_pi, name, a, b, c, d, e)
+#else
+#define PROBE0(name)                      do { } while (0)
+#define PROBE1(name, a)                   do { } while (0)
+#define PROBE2(name, a, b)                do { } while (0)
+#define PROBE3(name, a, b, c)             do { } while (0)
+#define PROBE4(name, a, b, c, d)          do { } while (0)
+#define PROBE5(name, a, b, c, d, e)       do { } while (0)
+#endif
+
+#endif /* EOF */
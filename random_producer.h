@@ -0,0 +1,581 @@
+/* Uniform random numbers produced ahead for in-process consumers. */
+
+#ifndef __RANDOM_PRODUCER_H__
+#define __RANDOM_PRODUCER_H__
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "tinymt32j.h"
+#include "trace.h"
+
+// A block is RANDOM_BLOCK_FLOATS uniforms in [0, 1), 64 KiB, small
+// enough to stay in the L2 cache from the producer to the consumer.
+// Every channel draws from RANDOM_LANES TinyMT streams in lockstep.
+#define RANDOM_BLOCK_FLOATS (1 << 14)
+#define RANDOM_LANES        8
+#define RANDOM_SPINS        64    // yields before a consumer sleeps
+#define RANDOM_WAIT_US      1000  // longest sleep, covers missed wakeups
+
+/**
+ * Bounded lock-free ring for one producer and one consumer thread at a
+ * time. Capacity is rounded up to a power of two.
+ */
+template <class T>
+class SpscRing
+{
+    std::vector<T> slots_;
+    size_t mask_;
+    std::atomic<size_t> head_;
+    char pad_[64];                // head_ and tail_ on their own cache lines
+    std::atomic<size_t> tail_;
+public:
+    explicit SpscRing(size_t capacity) : head_(0), tail_(0)
+    {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        slots_.resize(size);
+        mask_ = size - 1;
+    }
+    bool push(const T& value)
+    {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) > mask_)
+            return false;
+        slots_[tail & mask_] = value;
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+    bool pop(T& value)
+    {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire))
+            return false;
+        value = slots_[head & mask_];
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+/**
+ * Bounded lock-free ring for any number of producer and consumer threads
+ * (D. Vyukov's queue): every slot carries a sequence number telling
+ * whose turn it is. Capacity is rounded up to a power of two.
+ */
+template <class T>
+class MpmcRing
+{
+    struct Slot
+    {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+    std::unique_ptr<Slot[]> slots_;
+    size_t mask_;
+    std::atomic<size_t> head_;
+    char pad_[64];                // head_ and tail_ on their own cache lines
+    std::atomic<size_t> tail_;
+public:
+    explicit MpmcRing(size_t capacity) : head_(0), tail_(0)
+    {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        slots_.reset(new Slot[size]);
+        for (size_t i = 0; i < size; i++)
+            slots_[i].sequence.store(i, std::memory_order_relaxed);
+        mask_ = size - 1;
+    }
+    bool push(const T& value)
+    {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Slot& slot = slots_[tail & mask_];
+            intptr_t turn = (intptr_t)slot.sequence.load(std::memory_order_acquire) - (intptr_t)tail;
+            if (turn == 0 && tail_.compare_exchange_weak(tail, tail + 1, std::memory_order_relaxed))
+            {
+                slot.value = value;
+                slot.sequence.store(tail + 1, std::memory_order_release);
+                return true;
+            }
+            if (turn < 0)
+                return false;     // full
+            if (turn > 0)
+                tail = tail_.load(std::memory_order_relaxed);
+        }
+    }
+    bool pop(T& value)
+    {
+        size_t head = head_.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Slot& slot = slots_[head & mask_];
+            intptr_t turn = (intptr_t)slot.sequence.load(std::memory_order_acquire) - (intptr_t)(head + 1);
+            if (turn == 0 && head_.compare_exchange_weak(head, head + 1, std::memory_order_relaxed))
+            {
+                value = slot.value;
+                slot.sequence.store(head + mask_ + 1, std::memory_order_release);
+                return true;
+            }
+            if (turn < 0)
+                return false;     // empty
+            if (turn > 0)
+                head = head_.load(std::memory_order_relaxed);
+        }
+    }
+};
+
+/**
+ * TinyMT streams stepped in lockstep, one per lane, laid out so that the
+ * compiler can keep the lanes in vector registers. Lane k of first_id
+ * is the stream with jump id first_id + k, the same numbers as
+ * tinymt32j_single01() on it.
+ */
+struct RandomLanes
+{
+    uint32_t s0[RANDOM_LANES];
+    uint32_t s1[RANDOM_LANES];
+    uint32_t s2[RANDOM_LANES];
+    uint32_t s3[RANDOM_LANES];
+
+    void init(uint32_t seed, uint32_t first_id)
+    {
+        for (int k = 0; k < RANDOM_LANES; k++)
+        {
+            tinymt32j_t tiny;
+            tinymt32j_init_jump(&tiny, seed, first_id + k);
+            s0[k] = tiny.s0;
+            s1[k] = tiny.s1;
+            s2[k] = tiny.s2;
+            s3[k] = tiny.s3;
+        }
+    }
+
+    // Write n uniforms (a multiple of RANDOM_LANES): draw i of lane k at
+    // out[i * RANDOM_LANES + k]. tinymt32j_next_state() and
+    // tinymt32j_temper_float12() with the branches turned into masks.
+    void fill(float* out, size_t n)
+    {
+        RandomLanes l = *this;
+        for (size_t i = 0; i < n; i += RANDOM_LANES)
+        {
+            for (int k = 0; k < RANDOM_LANES; k++)
+            {
+                uint32_t x = (l.s0[k] & 0x7fffffffU) ^ l.s1[k] ^ l.s2[k];
+                uint32_t y = l.s3[k];
+                x ^= x << 1;
+                y ^= (y >> 1) ^ x;
+                uint32_t odd = 0U - (y & 1);
+                l.s0[k] = l.s1[k];
+                l.s1[k] = l.s2[k] ^ (odd & TINYMT32J_MAT1);
+                l.s2[k] = x ^ (y << 10) ^ (odd & TINYMT32J_MAT2);
+                l.s3[k] = y;
+
+                uint32_t t1 = l.s0[k] + (l.s2[k] >> 8);
+                uint32_t t0 = l.s3[k] ^ t1;
+                uint32_t bits = (t0 >> 9) ^ 0x3f800000U ^ ((0U - (t1 & 1)) & (TINYMT32J_TMAT >> 9));
+                float f;
+                memcpy(&f, &bits, sizeof(f));
+                out[i + k] = f - 1.0f;
+            }
+        }
+        *this = l;
+    }
+};
+
+/**
+ * A block lent to a consumer, valid until it is given back.
+ */
+struct RandomBlock
+{
+    const float* data;
+    size_t size;                  // RANDOM_BLOCK_FLOATS
+    uint64_t sequence;            // blocks of the channel before this one
+    uint32_t index;               // in the channel
+};
+
+/**
+ * Wakes the threads sleeping on it, without a lock when none is. A
+ * sleeper takes current() before looking for work, and wait() returns at
+ * once if notify() was called since.
+ */
+struct RandomSignal
+{
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::atomic<uint64_t> generation;
+    std::atomic<int> waiting;
+
+    RandomSignal() : generation(0), waiting(0)
+    {
+    }
+    uint64_t current() const
+    {
+        return generation.load();
+    }
+    void notify()
+    {
+        generation++;
+        if (waiting.load() > 0)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            wake.notify_all();
+        }
+    }
+    // Sleep until notified after seen, RANDOM_WAIT_US at most.
+    void wait(uint64_t seen)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        waiting++;
+        if (generation.load() == seen)
+            wake.wait_for(lock, std::chrono::microseconds(RANDOM_WAIT_US));
+        waiting--;
+    }
+};
+
+/**
+ * Blocks of uniforms from the streams of one channel, filled ahead by
+ * the producer. A consumer borrows filled blocks and reads them in place;
+ * a given back block is refilled. When every block is filled or lent,
+ * the producer moves on to other channels (back-pressure), and a consumer
+ * outrunning the producer waits.
+ *
+ * The channel draws from the streams with jump ids stream * RANDOM_LANES
+ * and the RANDOM_LANES - 1 after it, so channels of distinct stream ids
+ * never share numbers, and a channel gets the same blocks in the same
+ * order whichever producer thread fills them.
+ */
+class RandomChannel
+{
+    friend class RandomProducer;
+
+    uint32_t stream_;
+    size_t num_blocks_;
+    std::unique_ptr<float[]> memory_;
+    float* blocks_;               // aligned to cache lines
+    std::vector<uint64_t> sequences_;
+    RandomLanes lanes_;
+    uint64_t produced_;
+    std::atomic<bool> filling_;   // a producer thread owns the streams
+    std::atomic<bool> closed_;
+    RandomSignal ready_;          // consumers wait for blocks
+    // Of the producer, for given back blocks; shared, as the channel may
+    // outlive it.
+    std::shared_ptr<RandomSignal> work_;
+    std::atomic<int64_t> borrowed_;
+    std::atomic<int64_t> waits_;
+    std::atomic<int64_t> wait_ns_;
+
+    // Fill a free block if no other thread is filling, false if there was
+    // nothing to do.
+    bool fill()
+    {
+        if (filling_.exchange(true, std::memory_order_acquire))
+            return false;
+        uint32_t index;
+        bool filled = !closed_.load() && pop_free(index);
+        if (filled)
+        {
+            TRACE_SCOPE("fill", stream_);
+            lanes_.fill(blocks_ + (size_t)index * RANDOM_BLOCK_FLOATS, RANDOM_BLOCK_FLOATS);
+            sequences_[index] = produced_++;
+            push_full(index);
+        }
+        filling_.store(false, std::memory_order_release);
+        if (filled)
+            ready_.notify();
+        return filled;
+    }
+    void close()
+    {
+        closed_ = true;
+        ready_.notify();
+    }
+protected:
+    virtual bool push_full(uint32_t index) = 0;
+    virtual bool pop_full(uint32_t& index) = 0;
+    virtual bool push_free(uint32_t index) = 0;
+    virtual bool pop_free(uint32_t& index) = 0;
+
+    RandomChannel(uint32_t seed, uint32_t stream, size_t blocks, const std::shared_ptr<RandomSignal>& work)
+        : stream_(stream), num_blocks_(std::max(blocks, (size_t)1)), sequences_(num_blocks_), produced_(0),
+          filling_(false), closed_(false), work_(work), borrowed_(0), waits_(0), wait_ns_(0)
+    {
+        memory_.reset(new float[num_blocks_ * RANDOM_BLOCK_FLOATS + 16]);
+        blocks_ = memory_.get() + (16 - ((uintptr_t)memory_.get() / sizeof(float)) % 16) % 16;
+        lanes_.init(seed, stream * RANDOM_LANES);
+    }
+    // Called by the derived constructor, once the rings exist.
+    void start()
+    {
+        for (size_t i = 0; i < num_blocks_; i++)
+            push_free((uint32_t)i);
+    }
+public:
+    virtual ~RandomChannel()
+    {
+    }
+    RandomChannel(const RandomChannel&) = delete;
+    RandomChannel& operator=(const RandomChannel&) = delete;
+
+    uint32_t stream() const
+    {
+        return stream_;
+    }
+    size_t blocks() const
+    {
+        return num_blocks_;
+    }
+
+    // Lend the next filled block, waiting for one unless wait is false.
+    // False if there is none, or the channel was detached.
+    bool borrow(RandomBlock& block, bool wait = true)
+    {
+        uint32_t index;
+        if (!pop_full(index))
+        {
+            if (!wait || closed_.load())
+                return false;
+            auto start = std::chrono::steady_clock::now();
+            for (int spin = 0;; spin++)
+            {
+                uint64_t seen = ready_.current();
+                if (pop_full(index))
+                    break;
+                if (closed_.load())
+                    return false;
+                if (spin < RANDOM_SPINS)
+                    std::this_thread::yield();
+                else
+                    ready_.wait(seen);
+            }
+            waits_++;
+            wait_ns_ += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+        }
+        block.data = blocks_ + (size_t)index * RANDOM_BLOCK_FLOATS;
+        block.size = RANDOM_BLOCK_FLOATS;
+        block.sequence = sequences_[index];
+        block.index = index;
+        borrowed_++;
+        return true;
+    }
+    // Hand a borrowed block back for refilling; its data is not to be
+    // read anymore.
+    void give_back(const RandomBlock& block)
+    {
+        push_free(block.index);
+        work_->notify();
+    }
+
+    // Blocks borrowed, and how often and how long borrow() waited for the
+    // producer.
+    int64_t borrowed() const
+    {
+        return borrowed_.load();
+    }
+    int64_t waits() const
+    {
+        return waits_.load();
+    }
+    double wait_ms() const
+    {
+        return wait_ns_.load() / 1e6;
+    }
+};
+
+template <template <class> class Ring>
+class RingChannel : public RandomChannel
+{
+    Ring<uint32_t> full_;
+    Ring<uint32_t> free_;
+protected:
+    bool push_full(uint32_t index) override
+    {
+        return full_.push(index);
+    }
+    bool pop_full(uint32_t& index) override
+    {
+        return full_.pop(index);
+    }
+    bool push_free(uint32_t index) override
+    {
+        return free_.push(index);
+    }
+    bool pop_free(uint32_t& index) override
+    {
+        return free_.pop(index);
+    }
+public:
+    RingChannel(uint32_t seed, uint32_t stream, size_t blocks, const std::shared_ptr<RandomSignal>& work)
+        : RandomChannel(seed, stream, blocks, work), full_(blocks), free_(blocks)
+    {
+        start();
+    }
+};
+
+/**
+ * Threads filling the blocks of the attached channels round robin, a
+ * block at a time, and sleeping when every channel is full. A channel is
+ * filled by one thread at a time, which owns its streams while it does.
+ *
+ * A channel for one consumer thread is a pair of SPSC rings (of filled
+ * and of free block indices); a shared channel, which any number of
+ * consumer threads borrow from and give back to, a pair of MPMC rings.
+ * With pin, each thread is bound to one of the CPUs the process may use
+ * (Linux only).
+ */
+class RandomProducer
+{
+    uint32_t seed_;
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;            // of channels_
+    std::vector<std::shared_ptr<RandomChannel> > channels_;
+    std::atomic<uint64_t> version_;
+    std::shared_ptr<RandomSignal> work_;  // shared with the channels
+    std::atomic<bool> quit_;
+    std::atomic<int64_t> blocks_;
+    std::atomic<int64_t> idle_waits_;
+
+    void loop(int thread_index)
+    {
+        TRACE_THREAD_NAME("producer " + std::to_string(thread_index));
+        std::vector<std::shared_ptr<RandomChannel> > channels;
+        uint64_t version = ~(uint64_t)0;
+        size_t next = thread_index;
+        while (!quit_.load())
+        {
+            uint64_t seen = work_->current();
+            if (version != version_.load())
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                channels = channels_;
+                version = version_.load();
+            }
+            bool filled = false;
+            for (size_t k = 0; k < channels.size(); k++)
+            {
+                if (channels[(next + k) % channels.size()]->fill())
+                {
+                    blocks_++;
+                    filled = true;
+                }
+            }
+            next++;
+            if (!filled)
+            {
+                // Every channel is full, or being filled by another thread.
+                idle_waits_++;
+                work_->wait(seen);
+            }
+        }
+    }
+
+    static void pin(std::thread& thread, int thread_index)
+    {
+#if defined(__linux__)
+        cpu_set_t allowed;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0)
+            return;
+        int n = thread_index % CPU_COUNT(&allowed);
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &allowed) && n-- == 0)
+            {
+                cpu_set_t mask;
+                CPU_ZERO(&mask);
+                CPU_SET(cpu, &mask);
+                pthread_setaffinity_np(thread.native_handle(), sizeof(mask), &mask);
+                return;
+            }
+        }
+#else
+        (void)thread;
+        (void)thread_index;
+#endif
+    }
+public:
+    RandomProducer(int threads, uint32_t seed, bool pinned = false)
+        : seed_(seed), version_(1), work_(std::make_shared<RandomSignal>()), quit_(false), blocks_(0), idle_waits_(0)
+    {
+        for (int i = 0; i < std::max(threads, 1); i++)
+        {
+            threads_.push_back(std::thread(&RandomProducer::loop, this, i));
+            if (pinned)
+                pin(threads_.back(), i);
+        }
+    }
+    ~RandomProducer()
+    {
+        quit_ = true;
+        work_->notify();
+        for (auto& thread : threads_)
+            thread.join();
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& channel : channels_)
+            channel->close();
+    }
+    RandomProducer(const RandomProducer&) = delete;
+    RandomProducer& operator=(const RandomProducer&) = delete;
+
+    // A channel of blocks on the streams of stream, see RandomChannel.
+    // Shared channels may be borrowed from by several threads at once.
+    std::shared_ptr<RandomChannel> attach(uint32_t stream, size_t blocks = 8, bool shared = false)
+    {
+        std::shared_ptr<RandomChannel> channel;
+        if (shared)
+            channel.reset(new RingChannel<MpmcRing>(seed_, stream, blocks, work_));
+        else
+            channel.reset(new RingChannel<SpscRing>(seed_, stream, blocks, work_));
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            channels_.push_back(channel);
+            version_++;
+        }
+        work_->notify();
+        return channel;
+    }
+    // Stop filling channel and wake its waiting consumers. Blocks lent
+    // stay valid while the caller holds the channel.
+    void detach(const std::shared_ptr<RandomChannel>& channel)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            channels_.erase(std::remove(channels_.begin(), channels_.end(), channel), channels_.end());
+            version_++;
+        }
+        channel->close();
+    }
+
+    int threads() const
+    {
+        return (int)threads_.size();
+    }
+    // Blocks filled, and how often the threads found nothing to fill.
+    int64_t blocks() const
+    {
+        return blocks_.load();
+    }
+    int64_t idle_waits() const
+    {
+        return idle_waits_.load();
+    }
+};
+
+#endif /* EOF */
@@ -0,0 +1,189 @@
+/* Memory-mapped store of finished runs. */
+
+#ifndef __RESULT_CACHE_H__
+#define __RESULT_CACHE_H__
+
+#include <cstdint>
+#include <cstring>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "tinymt32j.h"
+
+#define RESULT_CACHE_MAGIC       0x32484341434950ULL  // "PICACH2"
+#define RESULT_CACHE_CAPACITY    64
+
+#define RESULT_GENERATOR_TINYMT32J 1
+
+/**
+ * Identifies a sequence of samples: the same key always produces the same
+ * random numbers in the same chunks, so a stored prefix can be extended.
+ */
+struct ResultKey
+{
+    uint32_t generator;
+    uint32_t seed;
+    uint32_t chunk_samples;
+    uint32_t reserved;
+};
+
+struct ResultEntry
+{
+    ResultKey key;
+    uint64_t stamp;      // last update, for replacement
+    int64_t samples;
+    int64_t hits;
+    tinymt32j_t state;   // state of the last chunk if it is partial
+};
+
+struct ResultCacheFile
+{
+    uint64_t magic;
+    uint64_t stamp;
+    uint32_t capacity;
+    uint32_t entry_size;
+    ResultEntry entries[RESULT_CACHE_CAPACITY];
+};
+
+/**
+ * A fixed-size table of ResultEntry in a file shared by all processes.
+ * Every access happens under an exclusive flock(), computation does not.
+ */
+class ResultCache
+{
+    int fd_;
+    ResultCacheFile* file_;
+
+    static bool sameKey(const ResultKey& a, const ResultKey& b)
+    {
+        return a.generator == b.generator &&
+               a.seed == b.seed &&
+               a.chunk_samples == b.chunk_samples;
+    }
+public:
+    ResultCache() : fd_(-1), file_(nullptr)
+    {
+    }
+    ~ResultCache()
+    {
+        close();
+    }
+    bool open(const char* filename)
+    {
+#ifndef _WIN32
+        fd_ = ::open(filename, O_RDWR | O_CREAT, 0644);
+        if (fd_ < 0)
+            return false;
+        flock(fd_, LOCK_EX);
+        struct stat st;
+        bool ok = fstat(fd_, &st) == 0;
+        bool fresh = ok && st.st_size == 0;
+        if (fresh)
+            ok = ftruncate(fd_, sizeof(ResultCacheFile)) == 0;
+        else if (ok)
+            ok = st.st_size == (off_t)sizeof(ResultCacheFile);
+        if (ok)
+        {
+            void* p = mmap(NULL, sizeof(ResultCacheFile), PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+            if (p != MAP_FAILED)
+                file_ = (ResultCacheFile*)p;
+        }
+        if (file_ && fresh)
+        {
+            file_->magic = RESULT_CACHE_MAGIC;
+            file_->capacity = RESULT_CACHE_CAPACITY;
+            file_->entry_size = sizeof(ResultEntry);
+        }
+        if (file_ && (file_->magic != RESULT_CACHE_MAGIC ||
+                      file_->capacity != RESULT_CACHE_CAPACITY ||
+                      file_->entry_size != sizeof(ResultEntry)))
+        {
+            munmap(file_, sizeof(ResultCacheFile));
+            file_ = nullptr;
+        }
+        flock(fd_, LOCK_UN);
+        if (!file_)
+        {
+            ::close(fd_);
+            fd_ = -1;
+        }
+        return file_ != nullptr;
+#else
+        (void)filename;
+        return false;
+#endif
+    }
+    void close()
+    {
+#ifndef _WIN32
+        if (file_)
+            munmap(file_, sizeof(ResultCacheFile));
+        if (fd_ >= 0)
+            ::close(fd_);
+#endif
+        file_ = nullptr;
+        fd_ = -1;
+    }
+    // Copy the stored entry for key into entry, return false if not found.
+    bool lookup(const ResultKey& key, ResultEntry& entry)
+    {
+        bool found = false;
+        if (!file_)
+            return false;
+#ifndef _WIN32
+        flock(fd_, LOCK_EX);
+        for (int i = 0; i < RESULT_CACHE_CAPACITY; i++)
+        {
+            const ResultEntry& e = file_->entries[i];
+            if (e.stamp != 0 && sameKey(e.key, key))
+            {
+                entry = e;
+                found = true;
+                break;
+            }
+        }
+        flock(fd_, LOCK_UN);
+#endif
+        return found;
+    }
+    // Store entry unless a longer prefix for the same key is already there.
+    void store(const ResultEntry& entry)
+    {
+        if (!file_)
+            return;
+#ifndef _WIN32
+        flock(fd_, LOCK_EX);
+        ResultEntry* slot = nullptr;
+        ResultEntry* oldest = &file_->entries[0];
+        for (int i = 0; i < RESULT_CACHE_CAPACITY; i++)
+        {
+            ResultEntry& e = file_->entries[i];
+            if (e.stamp != 0 && sameKey(e.key, entry.key))
+            {
+                slot = &e;
+                break;
+            }
+            if (e.stamp < oldest->stamp)
+                oldest = &e;
+        }
+        if (!slot)
+            slot = oldest;
+        else if (slot->samples >= entry.samples)
+            slot = nullptr;
+        if (slot)
+        {
+            *slot = entry;
+            slot->stamp = ++file_->stamp;
+        }
+        flock(fd_, LOCK_UN);
+#endif
+    }
+};
+
+#endif /* EOF */
@@ -0,0 +1,312 @@
+/* Statistics helpers shared by the estimate_pi executables. */
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <cstdint>
+#include <cstdio>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+/**
+ * Estimate of pi from the number of samples inside the quarter circle.
+ */
+inline static double
+pi_estimate(int64_t hits, int64_t samples)
+{
+    return 4 * hits / (double)samples;
+}
+
+/**
+ * Relative error of an estimate, in percent.
+ */
+inline static double
+pi_error(double pi)
+{
+    double pi_true = acos(-1.0);  // true value of pi
+    return fabs(pi - pi_true) / pi_true * 100;
+}
+
+/**
+ * Half width of the 95% confidence interval of pi_estimate(),
+ * using the normal approximation of the binomial hit count.
+ */
+inline static double
+pi_ci95(int64_t hits, int64_t samples)
+{
+    double p = hits / (double)samples;
+    return 1.96 * 4 * sqrt(p * (1 - p) / samples);
+}
+
+/**
+ * Unsigned 128-bit sum of counts, for totals gathered from many nodes
+ * that must not overflow whatever they add up to.
+ */
+struct Count128
+{
+    uint64_t lo;
+    uint64_t hi;
+
+    Count128() : lo(0), hi(0)
+    {
+    }
+    void add(uint64_t v)
+    {
+        lo += v;
+        if (lo < v)
+            hi++;
+    }
+    double value() const
+    {
+        return hi * 18446744073709551616.0 + lo;
+    }
+    // Decimal digits, dividing the four 32-bit limbs by 10 at a time.
+    std::string str() const
+    {
+        uint32_t limbs[4] = { (uint32_t)(hi >> 32), (uint32_t)hi, (uint32_t)(lo >> 32), (uint32_t)lo };
+        std::string digits;
+        bool zero;
+        do
+        {
+            uint64_t rem = 0;
+            zero = true;
+            for (int i = 0; i < 4; i++)
+            {
+                uint64_t cur = (rem << 32) | limbs[i];
+                limbs[i] = (uint32_t)(cur / 10);
+                rem = cur % 10;
+                zero = zero && limbs[i] == 0;
+            }
+            digits.push_back((char)('0' + rem));
+        } while (!zero);
+        return std::string(digits.rbegin(), digits.rend());
+    }
+};
+
+/**
+ * Quantile q (0 <= q <= 1) of sorted data, interpolating linearly
+ * between the closest ranks.
+ */
+inline static double
+quantile(const std::vector<double>& sorted, double q)
+{
+    double pos = q * (sorted.size() - 1);
+    size_t i = (size_t)pos;
+    if (i + 1 >= sorted.size())
+        return sorted.back();
+    return sorted[i] + (pos - i) * (sorted[i + 1] - sorted[i]);
+}
+
+/**
+ * Summary of repeated measurements.
+ */
+struct Summary
+{
+    size_t count;
+    size_t rejected;
+    double min;
+    double median;
+    double mean;
+    double p90;
+    double p99;
+    double stddev;
+    double max;
+};
+
+/**
+ * Summarize values. With reject_outliers, values further than three
+ * scaled median absolute deviations from the median are left out.
+ */
+inline static Summary
+summarize(std::vector<double> values, bool reject_outliers)
+{
+    Summary s = Summary();
+    if (values.empty())
+        return s;
+    std::sort(values.begin(), values.end());
+    size_t n = values.size();
+    if (reject_outliers && n >= 5)
+    {
+        double median = quantile(values, 0.5);
+        std::vector<double> deviations(n);
+        for (size_t i = 0; i < n; i++)
+            deviations[i] = fabs(values[i] - median);
+        std::sort(deviations.begin(), deviations.end());
+        double limit = 3 * 1.4826 * quantile(deviations, 0.5);
+        std::vector<double> kept;
+        for (double v : values)
+        {
+            if (fabs(v - median) <= limit)
+                kept.push_back(v);
+        }
+        values.swap(kept);
+    }
+    s.count = values.size();
+    s.rejected = n - values.size();
+    s.min = values.front();
+    s.median = quantile(values, 0.5);
+    s.p90 = quantile(values, 0.9);
+    s.p99 = quantile(values, 0.99);
+    s.max = values.back();
+    for (double v : values)
+        s.mean += v;
+    s.mean /= s.count;
+    for (double v : values)
+        s.stddev += (v - s.mean) * (v - s.mean);
+    s.stddev = s.count > 1 ? sqrt(s.stddev / (s.count - 1)) : 0;
+    return s;
+}
+
+/**
+ * Asymptotic p-value of the one-sample Kolmogorov-Smirnov statistic d
+ * computed from n observations.
+ */
+inline static double
+ks_pvalue(double d, size_t n)
+{
+    double sn = sqrt((double)n);
+    double lambda = (sn + 0.12 + 0.11 / sn) * d;
+    double sum = 0;
+    double sign = 1;
+    for (int j = 1; j <= 100; j++)
+    {
+        double term = sign * exp(-2 * j * j * lambda * lambda);
+        sum += term;
+        if (fabs(term) < 1e-12)
+            break;
+        sign = -sign;
+    }
+    return std::min(1.0, std::max(0.0, 2 * sum));
+}
+
+/**
+ * Print summary statistics of independent estimates of pi, each from
+ * the given number of samples, and a Kolmogorov-Smirnov test against
+ * the normal approximation N(pi, 16 p (1 - p) / samples), p = pi / 4.
+ */
+inline static void
+ensemble_report(FILE* out, const std::vector<double>& pis, int64_t samples)
+{
+    size_t k = pis.size();
+    std::vector<double> sorted(pis);
+    std::sort(sorted.begin(), sorted.end());
+
+    double mean = 0;
+    for (double v : sorted)
+        mean += v;
+    mean /= k;
+    double variance = 0;
+    for (double v : sorted)
+        variance += (v - mean) * (v - mean);
+    variance = k > 1 ? variance / (k - 1) : 0;
+
+    double pi_true = acos(-1.0);
+    double p = pi_true / 4;
+    double sigma = 4 * sqrt(p * (1 - p) / samples);
+    double d = 0;
+    for (size_t i = 0; i < k; i++)
+    {
+        double cdf = 0.5 * erfc(-(sorted[i] - pi_true) / (sigma * sqrt(2.0)));
+        d = std::max(d, std::max(cdf - i / (double)k, (i + 1) / (double)k - cdf));
+    }
+
+    fprintf(out, "replicas = %u\n", (unsigned int)k);
+    fprintf(out, "samples per replica = %lld\n", (long long)samples);
+    fprintf(out, "mean = %.8f (bias %+.3e)\n", mean, mean - pi_true);
+    fprintf(out, "variance = %.4e (expected %.4e)\n", variance, sigma * sigma);
+    fprintf(out, "min/q05/q25/median/q75/q95/max = %.6f %.6f %.6f %.6f %.6f %.6f %.6f\n",
+        sorted.front(), quantile(sorted, 0.05), quantile(sorted, 0.25), quantile(sorted, 0.5),
+        quantile(sorted, 0.75), quantile(sorted, 0.95), sorted.back());
+    fprintf(out, "ks D = %.4f, p-value = %.4f\n", d, ks_pvalue(d, k));
+}
+
+/**
+ * Karp-Flatt metric: the serial fraction of the work implied by a
+ * speedup on p workers. Only defined for p > 1.
+ */
+inline static double
+karp_flatt(double speedup, int p)
+{
+    return (1 / speedup - 1.0 / p) / (1 - 1.0 / p);
+}
+
+/**
+ * One-sided Mann-Whitney U test of whether values in a tend to be
+ * smaller than those in b. Returns the p-value of the normal
+ * approximation, with tie and continuity corrections.
+ */
+inline static double
+mann_whitney_less(const std::vector<double>& a, const std::vector<double>& b)
+{
+    size_t n1 = a.size(), n2 = b.size(), n = n1 + n2;
+    if (n1 == 0 || n2 == 0)
+        return 1;
+    std::vector<std::pair<double, int> > all;
+    for (double v : a)
+        all.push_back(std::make_pair(v, 0));
+    for (double v : b)
+        all.push_back(std::make_pair(v, 1));
+    std::sort(all.begin(), all.end());
+
+    // Ranks from 1, tied values share their average rank.
+    double r1 = 0;
+    double ties = 0;
+    for (size_t i = 0; i < n;)
+    {
+        size_t j = i;
+        while (j < n && all[j].first == all[i].first)
+            j++;
+        double rank = (i + 1 + j) / 2.0;
+        for (size_t k = i; k < j; k++)
+        {
+            if (all[k].second == 0)
+                r1 += rank;
+        }
+        double t = (double)(j - i);
+        ties += t * t * t - t;
+        i = j;
+    }
+    double u1 = r1 - n1 * (n1 + 1) / 2.0;
+    double mean = n1 * n2 / 2.0;
+    double var = n1 * n2 / 12.0 * ((n + 1) - ties / (n * (n - 1.0)));
+    if (var <= 0)
+        return 1;
+    double z = (u1 - mean + 0.5) / sqrt(var);
+    return 0.5 * erfc(-z / sqrt(2.0));
+}
+
+// Repeated timings whose coefficient of variation is above this are
+// flagged as unstable.
+#define UNSTABLE_CV 0.05
+
+/**
+ * Print the distribution of the wall times (in ms) of repeated runs of
+ * the given number of samples each, and of their throughput. All runs
+ * are kept: the spread is what is being reported.
+ */
+inline static void
+repeat_report(FILE* out, const std::vector<double>& ms, int64_t samples, int warmup)
+{
+    std::vector<double> rates;
+    for (double t : ms)
+        rates.push_back(t > 0 ? samples / (t * 1000) : 0);
+    Summary w = summarize(ms, false);
+    Summary r = summarize(rates, false);
+    double cv = w.mean > 0 ? w.stddev / w.mean : 0;
+
+    fprintf(out, "repeat = %u (warmup %d)\n", (unsigned int)ms.size(), warmup);
+    fprintf(out, "%-12s %10s %10s %10s %10s %10s %10s %8s\n",
+        "", "min", "median", "mean", "p90", "p99", "stddev", "cv");
+    fprintf(out, "%-12s %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %7.2f%%\n",
+        "wall ms", w.min, w.median, w.mean, w.p90, w.p99, w.stddev, 100 * cv);
+    fprintf(out, "%-12s %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f %7.2f%%\n",
+        "Msamples/s", r.min, r.median, r.mean, r.p90, r.p99, r.stddev,
+        r.mean > 0 ? 100 * r.stddev / r.mean : 0);
+    if (cv > UNSTABLE_CV)
+        fprintf(out, "unstable: cv %.2f%% > %.0f%%, do not compare these numbers\n", 100 * cv, 100 * UNSTABLE_CV);
+}
+
+#endif /* EOF */
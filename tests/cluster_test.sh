@@ -0,0 +1,46 @@
+#!/bin/sh
+# A coordinator and three workers on localhost, one of them killed while
+# it holds leases. The result must equal a run of estimate_pi_cpu.
+#
+#     tests/cluster_test.sh build_dir
+
+bin=${1:-.}
+samples=400000000
+port=$((20000 + $$ % 20000))
+out=$(mktemp -d)
+pids=
+trap 'kill $pids 2>/dev/null; rm -rf "$out"' EXIT
+
+"$bin/estimate_pi_cluster" coordinate $port $samples --lease-chunks 2 > "$out/coordinator" 2>&1 &
+coordinator=$!
+pids=$coordinator
+for i in $(seq 50); do
+    grep -q listening "$out/coordinator" && break
+    sleep 0.1
+done
+
+for i in 1 2 3; do
+    "$bin/estimate_pi_cluster" work 127.0.0.1 $port --threads 1 --chunks 2 > "$out/worker$i" 2>&1 &
+    pids="$pids $!"
+    [ $i = 2 ] && victim=$!
+done
+# A while after all joined, so that the victim holds leases.
+for i in $(seq 100); do
+    [ $(grep -c joined "$out/coordinator") = 3 ] && break
+    sleep 0.1
+done
+sleep 1
+kill -9 $victim
+
+wait $coordinator
+status=$?
+cat "$out/coordinator"
+# The hits exactly, pi = has only 6 decimals.
+expected=$("$bin/estimate_pi_cpu" 2 $samples | grep '^hits =\|^pi =')
+got=$(grep '^hits =\|^pi =' "$out/coordinator")
+echo "expected: $expected"
+if [ $status != 0 ] || [ "$got" != "$expected" ]; then
+    echo "cluster run differs from estimate_pi_cpu"
+    exit 1
+fi
+grep -q "left" "$out/coordinator" || { echo "the killed worker was not noticed"; exit 1; }
@@ -0,0 +1,126 @@
+/*
+ * A failed create() must leave no session behind: runs fail with "No
+ * device session" instead of waiting for a lane, and the next create()
+ * works. Its streams must be bit-identical to tinymt32j.h on the host.
+ * Exits with 77, skipped by ctest, without an OpenCL device.
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "estimator_opencl.h"
+#include "tinymt32j.h"
+
+#define SKIPPED 77
+
+// Differences between the first draws of dump_streams, for the lowest and
+// the highest jump ids, and the host; -1 if the kernel did not run.
+static int verify_streams(OpenCLEstimator& estimator)
+{
+    const cl_uint streams = 256;
+    const cl_uint draws = 8;
+    const cl_uint seed = 42;
+    const size_t offsets[2] = { 0, 0xFFFFFFFFu - streams + 1 };
+    int err;
+    cl_kernel kernel = clCreateKernel(estimator.program(), "dump_streams", &err);
+    size_t size = sizeof(cl_uint) * streams * draws * 2;
+    cl_mem out = clCreateBuffer(estimator.context(), CL_MEM_WRITE_ONLY, size, NULL, &err);
+    if (!kernel || !out)
+    {
+        if (out)
+            clReleaseMemObject(out);
+        if (kernel)
+            clReleaseKernel(kernel);
+        return -1;
+    }
+    err  = clSetKernelArg(kernel, 0, sizeof(cl_uint), &draws);
+    err |= clSetKernelArg(kernel, 1, sizeof(cl_uint), &seed);
+    err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &out);
+    vector<cl_uint> device(streams * draws * 2);
+    int mismatches = 0;
+    for (size_t offset : offsets)
+    {
+        size_t work_size = streams;
+        if (err == CL_SUCCESS)
+            err = clEnqueueNDRangeKernel(estimator.queue(), kernel, 1, &offset, &work_size, NULL, 0, NULL, NULL);
+        if (err == CL_SUCCESS)
+            err = clEnqueueReadBuffer(estimator.queue(), out, CL_TRUE, 0, size, &device[0], 0, NULL, NULL);
+        if (err != CL_SUCCESS)
+            break;
+        for (cl_uint s = 0; s < streams; s++)
+        {
+            tinymt32j_t tiny;
+            tinymt32j_init_jump(&tiny, seed, (uint)(offset + s));
+            for (cl_uint i = 0; i < draws; i++)
+            {
+                cl_uint u = tinymt32j_uint32(&tiny);
+                float f = tinymt32j_single01(&tiny);
+                cl_uint bits;
+                memcpy(&bits, &f, sizeof(bits));
+                const cl_uint* d = &device[(s * draws + i) * 2];
+                if ((d[0] != u || d[1] != bits) && mismatches++ == 0)
+                    fprintf(stderr, "stream %u, draw %u: device %08x %08x, host %08x %08x\n",
+                            (unsigned int)(offset + s), i, d[0], d[1], u, bits);
+            }
+        }
+    }
+    clReleaseMemObject(out);
+    clReleaseKernel(kernel);
+    return err == CL_SUCCESS ? mismatches : -1;
+}
+
+int main(int argc, char* argv[])
+{
+    string source_dir = argc > 1 ? argv[1] : "..";
+    vector<cl_device_id> devices;
+    string error;
+    if (!OpenCLEstimator::listDevices(devices, error) || devices.empty())
+    {
+        fprintf(stdout, "no OpenCL device: %s\n", error.empty() ? "none found" : error.c_str());
+        return SKIPPED;
+    }
+
+    int failures = 0;
+    OpenCLEstimator estimator;
+    if (estimator.create(devices[0], "no_such_kernel", source_dir, N_THREADS, false, 2))
+    {
+        fprintf(stderr, "create() with an unknown kernel succeeded\n");
+        return EXIT_FAILURE;
+    }
+    fprintf(stdout, "create: %s\n", estimator.error().c_str());
+
+    EstimateOptions options;
+    EstimateResult result;
+    if (estimator.run(1000000, DEFAULT_SEED, options, result) || estimator.error() != "No device session")
+    {
+        fprintf(stderr, "run() after a failed create(): %s\n", estimator.error().c_str());
+        failures++;
+    }
+    if (estimator.submit(1000000, DEFAULT_SEED, options, [](const EstimateResult&) {}) ||
+        estimator.error() != "No device session")
+    {
+        fprintf(stderr, "submit() after a failed create(): %s\n", estimator.error().c_str());
+        failures++;
+    }
+
+    if (!estimator.create(devices[0], "pi_v2", source_dir, N_THREADS, false, 2) ||
+        !estimator.run(1000000, DEFAULT_SEED, options, result) || result.hits <= 0)
+    {
+        fprintf(stderr, "create() after a failed one: %s\n", estimator.error().c_str());
+        failures++;
+    }
+    else
+    {
+        fprintf(stdout, "then pi_v2: pi = %f\n", result.pi);
+        int mismatches = verify_streams(estimator);
+        fprintf(stdout, "streams: mismatches = %d\n", mismatches);
+        if (mismatches != 0)
+            failures++;
+    }
+    return failures == 0 ? 0 : EXIT_FAILURE;
+}
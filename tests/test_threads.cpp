@@ -0,0 +1,51 @@
+/* Runs must give the same hits whatever the number of threads. */
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+using namespace std;
+
+#include "estimator.h"
+
+// Hits of every replica, or an empty vector if the run failed.
+static vector<int64_t> hits(int threads, int64_t samples, int replicas)
+{
+    CpuEstimator estimator(threads);
+    EstimateOptions options;
+    options.replicas = replicas;
+    EstimateResult result;
+    if (!estimator.run(samples, DEFAULT_SEED, options, result))
+    {
+        fprintf(stderr, "%d threads: %s\n", threads, estimator.error().c_str());
+        return vector<int64_t>();
+    }
+    return result.replica_hits;
+}
+
+int main(int argc, char* argv[])
+{
+    int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+    // A partial last chunk, and more chunks than threads.
+    int64_t samples = 5 * (int64_t)CHUNK_SAMPLES + 12345;
+    int failures = 0;
+    for (int replicas = 1; replicas <= 3; replicas += 2)
+    {
+        vector<int64_t> expected = hits(0, samples, replicas);
+        if (expected.empty())
+            return EXIT_FAILURE;
+        for (int threads = 1; threads <= max_threads; threads++)
+        {
+            vector<int64_t> got = hits(threads, samples, replicas);
+            if (got != expected)
+            {
+                fprintf(stderr, "replicas = %d, threads = %d: hits differ from the inline run\n", replicas,
+                        threads);
+                failures++;
+            }
+        }
+        fprintf(stdout, "replicas = %d: hits = %lld for inline and 1..%d threads\n", replicas,
+                (long long)expected[0], max_threads);
+    }
+    return failures == 0 ? 0 : EXIT_FAILURE;
+}
@@ -0,0 +1,228 @@
+/* Known answers of the TinyMT streams shared by the host and the devices. */
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "tinymt32j.h"
+
+static int failures = 0;
+
+static void expect(bool ok, const char* what, uint32_t seed, uint32_t gid, int i)
+{
+    if (!ok && failures++ < 10)
+        fprintf(stderr, "%s differs: seed = %u, jump id = %u, output %d\n", what, seed, gid, i);
+}
+
+// Polynomials over GF(2) of degree up to 127, bit i the coefficient of
+// x^i, and the states of TinyMT32 as their 127 linear bits.
+#define TINYMT_DEGREE 127
+
+struct Poly
+{
+    uint64_t w[2];
+};
+
+static Poly monomial(int i)
+{
+    Poly p = { { 0, 0 } };
+    p.w[i / 64] = 1ULL << (i % 64);
+    return p;
+}
+
+static bool coefficient(const Poly& p, int i)
+{
+    return (p.w[i / 64] >> (i % 64)) & 1;
+}
+
+// a * b modulo phi, phi of degree TINYMT_DEGREE and a, b below it.
+static Poly multiply(const Poly& a, const Poly& b, const Poly& phi)
+{
+    Poly r = { { 0, 0 } };
+    for (int i = TINYMT_DEGREE - 1; i >= 0; i--)
+    {
+        r.w[1] = r.w[1] << 1 | r.w[0] >> 63;
+        r.w[0] <<= 1;
+        if (coefficient(r, TINYMT_DEGREE))
+        {
+            r.w[0] ^= phi.w[0];
+            r.w[1] ^= phi.w[1];
+        }
+        if (coefficient(a, i))
+        {
+            r.w[0] ^= b.w[0];
+            r.w[1] ^= b.w[1];
+        }
+    }
+    return r;
+}
+
+static Poly power(Poly base, uint64_t e, const Poly& phi)
+{
+    Poly r = monomial(0);
+    for (; e != 0; e >>= 1)
+    {
+        if (e & 1)
+            r = multiply(r, base, phi);
+        base = multiply(base, base, phi);
+    }
+    return r;
+}
+
+// The minimal polynomial of the bit sequence the transition makes, by
+// Berlekamp-Massey; false unless it has the full degree, then it is the
+// characteristic polynomial.
+static bool characteristic(Poly& phi)
+{
+    const int n = 4 * TINYMT_DEGREE;
+    std::vector<int> bits(n);
+    tinymt32j_t tiny;
+    tinymt32j_init_seed(&tiny, 1);
+    for (int i = 0; i < n; i++)
+    {
+        bits[i] = tiny.s3 & 1;
+        tinymt32j_next_state(&tiny);
+    }
+    std::vector<int> c(n + 1, 0), b(n + 1, 0);
+    c[0] = b[0] = 1;
+    int length = 0;
+    int m = 1;
+    for (int i = 0; i < n; i++)
+    {
+        int d = bits[i];
+        for (int j = 1; j <= length; j++)
+            d ^= c[j] & bits[i - j];
+        if (d == 0)
+        {
+            m++;
+            continue;
+        }
+        std::vector<int> t = c;
+        for (int j = 0; j + m <= n; j++)
+            c[j + m] ^= b[j];
+        if (2 * length <= i)
+        {
+            length = i + 1 - length;
+            b = t;
+            m = 1;
+        }
+        else
+        {
+            m++;
+        }
+    }
+    if (length != TINYMT_DEGREE)
+        return false;
+    // The reciprocal of the connection polynomial.
+    phi = monomial(0);
+    phi.w[0] = 0;
+    for (int i = 0; i <= length; i++)
+    {
+        if (c[i])
+            phi.w[(length - i) / 64] |= 1ULL << ((length - i) % 64);
+    }
+    return true;
+}
+
+// Move tiny to p(transition) applied to it.
+static void jump(tinymt32j_t* tiny, const Poly& p)
+{
+    tinymt32j_t sum = { 0, 0, 0, 0 };
+    for (int i = 0; i < TINYMT_DEGREE; i++)
+    {
+        if (coefficient(p, i))
+        {
+            sum.s0 ^= tiny->s0;
+            sum.s1 ^= tiny->s1;
+            sum.s2 ^= tiny->s2;
+            sum.s3 ^= tiny->s3;
+        }
+        tinymt32j_next_state(tiny);
+    }
+    *tiny = sum;
+}
+
+// The top bit of s0 is not part of the state, the transition masks it.
+static bool same(const tinymt32j_t& a, const tinymt32j_t& b)
+{
+    return ((a.s0 ^ b.s0) & 0x7fffffffU) == 0 && a.s1 == b.s1 && a.s2 == b.s2 && a.s3 == b.s3;
+}
+
+int main()
+{
+    // Jump id 0 is plain TinyMT32 with the default parameters; the first
+    // outputs of seed 1 in tinymt32.out.txt of the reference code.
+    const uint32_t reference[10] = {
+        2545341989U, 981918433U, 3715302833U, 2387538352U, 3591001365U,
+        3820442102U, 2114400566U, 2196103051U, 2783359912U, 764534509U
+    };
+    tinymt32j_t tiny;
+    tinymt32j_init_jump(&tiny, 1, 0);
+    for (int i = 0; i < 10; i++)
+        expect(tinymt32j_uint32(&tiny) == reference[i], "reference", 1, 0, i);
+
+    // The jumps, derived here the way the reference TinyMT jump code
+    // calculates them, without the table: the characteristic polynomial
+    // of the transition, then x^(3^40 * gid) modulo it, applied to the
+    // seeded state.
+    Poly phi;
+    if (!characteristic(phi))
+    {
+        fprintf(stderr, "characteristic polynomial: not of degree %d\n", TINYMT_DEGREE);
+        return EXIT_FAILURE;
+    }
+    // As published with the default parameters by the TinyMT authors.
+    expect(phi.w[1] == 0xd8524022ed8dff4aULL && phi.w[0] == 0x8dcc50c798faba43ULL, "characteristic polynomial",
+           0, 0, 0);
+    tinymt32j_t seeded, stepped, jumped;
+    tinymt32j_init_seed(&seeded, 42);
+    stepped = seeded;
+    for (int i = 0; i < 1000; i++)
+        tinymt32j_next_state(&stepped);
+    jumped = seeded;
+    jump(&jumped, power(monomial(1), 1000, phi));
+    expect(same(jumped, stepped), "1000 steps", 42, 0, 0);
+
+    const uint64_t magic_step = 12157665459056928801ULL;  // 3^40
+    Poly step = power(monomial(1), magic_step, phi);
+    Poly entry = step;
+    for (int i = 0; i < TINYMT32_JUMP_TABLE_SIZE; i++)
+    {
+        expect(entry.w[0] == ((uint64_t)tinymt32_jump_table[i][1] << 32 | tinymt32_jump_table[i][0]) &&
+               entry.w[1] == ((uint64_t)tinymt32_jump_table[i][3] << 32 | tinymt32_jump_table[i][2]),
+               "jump table", 0, 1U << i, 0);
+        entry = multiply(entry, entry, phi);
+    }
+    const uint32_t gids[] = { 1, 2, 3, 1000, 123456789, 0xFFFFFFFFU };
+    for (uint32_t gid : gids)
+    {
+        jumped = seeded;
+        jump(&jumped, power(step, gid, phi));
+        tinymt32j_init_jump(&tiny, 42, gid);
+        expect(same(tiny, jumped), "jumped", 42, gid, 0);
+    }
+
+    // A jump is a polynomial in the transition, so it commutes with it.
+    for (uint32_t gid = 1; gid < 64; gid++)
+    {
+        tinymt32j_t a, b;
+        tinymt32j_init_seed(&a, gid);
+        b = a;
+        tinymt32j_next_state(&a);
+        tinymt32j_jump_by_array(&a, tinymt32_jump_table[gid % TINYMT32_JUMP_TABLE_SIZE]);
+        tinymt32j_jump_by_array(&b, tinymt32_jump_table[gid % TINYMT32_JUMP_TABLE_SIZE]);
+        tinymt32j_next_state(&b);
+        expect(a.s0 == b.s0 && a.s1 == b.s1 && a.s2 == b.s2 && a.s3 == b.s3, "commuted jump", gid, gid, 0);
+    }
+
+    // The floats are the top 23 bits of the integers.
+    tinymt32j_t u, f;
+    tinymt32j_init_jump(&u, 42, 7);
+    f = u;
+    for (int i = 0; i < 1000; i++)
+        expect(tinymt32j_single01(&f) == (tinymt32j_uint32(&u) >> 9) * (1.0f / 8388608.0f), "float", 42, 7, i);
+
+    fprintf(stdout, "tinymt: %d failures\n", failures);
+    return failures == 0 ? 0 : EXIT_FAILURE;
+}
@@ -1,4 +1,10 @@
-/* Port from OpenCL version of TinyMT. */
+/*
+ * Port from OpenCL version of TinyMT.
+ *
+ * The same file is compiled as C/C++ on the host, as OpenCL C (spliced
+ * into pi.cl) and as Metal (spliced into pi.metal), so a given
+ * (seed, jump id) produces the same numbers on every backend.
+ */
 
 /**
  * Copyright (C) 2013 Mutsuo Saito, Makoto Matsumoto,
@@ -11,7 +17,27 @@
 #ifndef __TINYMT32J_H__
 #define __TINYMT32J_H__
 
+#if defined(__OPENCL_VERSION__)
+#define TINYMT32J_CONSTANT __constant
+#define TINYMT32J_THREAD
+#define tinymt32j_as_float(x) as_float(x)
+#elif defined(__METAL_VERSION__)
+#define TINYMT32J_CONSTANT constant
+#define TINYMT32J_THREAD thread
+#define tinymt32j_as_float(x) as_type<float>(x)
+#else
+#include <string.h>
+#define TINYMT32J_CONSTANT const
+#define TINYMT32J_THREAD
 typedef unsigned int uint;
+inline static float
+tinymt32j_as_float(uint x)
+{
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+#endif
 
 /**
  * TinyMT32 structure for jump without parameters
@@ -33,7 +59,7 @@ typedef struct TINYMT32J_T {
  * Jump table contains pre-calculated jump polynomials.
  * This table supports sequential ids from 0 to 2<sup>32</sup>-1.
  */
-const uint
+TINYMT32J_CONSTANT uint
 tinymt32_jump_table[TINYMT32_JUMP_TABLE_SIZE][4] = {
     {0x4ef38e31,0xca64cb3e,0x58005925,0x50029072},
     {0x0db944dd,0xb5baf1a6,0x11190368,0x002e97f0},
@@ -72,14 +98,14 @@ tinymt32_jump_table[TINYMT32_JUMP_TABLE_SIZE][4] = {
 #define TINYMT32J_MIN_LOOP 8
 #define TINYMT32J_PRE_LOOP 8
 
-const int tinymt32j_sh0 = 1;
-const int tinymt32j_sh1 = 10;
-const int tinymt32j_sh8 = 8;
-const uint tinymt32j_mask = 0x7fffffffU;
-const uint tinymt32j_mat1 = TINYMT32J_MAT1;
-const uint tinymt32j_mat2 = TINYMT32J_MAT2;
-const uint tinymt32j_tmat = TINYMT32J_TMAT;
-const uint tinymt32j_tmat_float = (TINYMT32J_TMAT >> 9) | 0x3f800000U;
+TINYMT32J_CONSTANT int tinymt32j_sh0 = 1;
+TINYMT32J_CONSTANT int tinymt32j_sh1 = 10;
+TINYMT32J_CONSTANT int tinymt32j_sh8 = 8;
+TINYMT32J_CONSTANT uint tinymt32j_mask = 0x7fffffffU;
+TINYMT32J_CONSTANT uint tinymt32j_mat1 = TINYMT32J_MAT1;
+TINYMT32J_CONSTANT uint tinymt32j_mat2 = TINYMT32J_MAT2;
+TINYMT32J_CONSTANT uint tinymt32j_tmat = TINYMT32J_TMAT;
+TINYMT32J_CONSTANT uint tinymt32j_tmat_float = (TINYMT32J_TMAT >> 9) | 0x3f800000U;
 
 /**
  * Addition of internal state
@@ -87,7 +113,7 @@ const uint tinymt32j_tmat_float = (TINYMT32J_TMAT >> 9) | 0x3f800000U;
  * @param src source (not changed)
  */
 inline static void
-tinymt32j_add(tinymt32j_t * dest, tinymt32j_t * src)
+tinymt32j_add(TINYMT32J_THREAD tinymt32j_t * dest, TINYMT32J_THREAD tinymt32j_t * src)
 {
     dest->s0 ^= src->s0;
     dest->s1 ^= src->s1;
@@ -100,7 +126,7 @@ tinymt32j_add(tinymt32j_t * dest, tinymt32j_t * src)
  * @param tiny internal state
  */
 inline static void
-tinymt32j_next_state(tinymt32j_t *tiny)
+tinymt32j_next_state(TINYMT32J_THREAD tinymt32j_t *tiny)
 {
     uint x;
     uint y;
@@ -127,7 +153,7 @@ tinymt32j_next_state(tinymt32j_t *tiny)
  * @return generated number
  */
 inline static uint
-tinymt32j_temper(tinymt32j_t *tiny)
+tinymt32j_temper(TINYMT32J_THREAD tinymt32j_t *tiny)
 {
     uint t0;
     uint t1;
@@ -147,7 +173,7 @@ tinymt32j_temper(tinymt32j_t *tiny)
  * @return generated number
  */
 inline static uint
-tinymt32j_uint32(tinymt32j_t *tiny)
+tinymt32j_uint32(TINYMT32J_THREAD tinymt32j_t *tiny)
 {
     tinymt32j_next_state(tiny);
     return tinymt32j_temper(tiny);
@@ -159,7 +185,7 @@ tinymt32j_uint32(tinymt32j_t *tiny)
  * @return generated number
  */
 inline static float
-tinymt32j_temper_float12(tinymt32j_t *tiny)
+tinymt32j_temper_float12(TINYMT32J_THREAD tinymt32j_t *tiny)
 {
     uint t0;
     uint t1;
@@ -172,7 +198,7 @@ tinymt32j_temper_float12(tinymt32j_t *tiny)
     } else {
 	t0 = (t0 >> 9) ^ 0x3f800000U;
     }
-    return *reinterpret_cast<float*>(&t0);
+    return tinymt32j_as_float(t0);
 }
 
 /**
@@ -181,7 +207,7 @@ tinymt32j_temper_float12(tinymt32j_t *tiny)
  * @return generated number
  */
 inline static float
-tinymt32j_single12(tinymt32j_t *tiny)
+tinymt32j_single12(TINYMT32J_THREAD tinymt32j_t *tiny)
 {
     tinymt32j_next_state(tiny);
     return tinymt32j_temper_float12(tiny);
@@ -193,7 +219,7 @@ tinymt32j_single12(tinymt32j_t *tiny)
  * @return generated number
  */
 inline static float
-tinymt32j_single01(tinymt32j_t *tiny)
+tinymt32j_single01(TINYMT32J_THREAD tinymt32j_t *tiny)
 {
     return tinymt32j_single12(tiny) - 1.0f;
 }
@@ -204,7 +230,7 @@ tinymt32j_single01(tinymt32j_t *tiny)
  * @param tiny tinymt state vector.
  */
 inline static void
-tinymt32j_period_certification(tinymt32j_t * tiny)
+tinymt32j_period_certification(TINYMT32J_THREAD tinymt32j_t * tiny)
 {
     if ((tiny->s0 & tinymt32j_mask) == 0 &&
         tiny->s1 == 0 &&
@@ -224,7 +250,7 @@ tinymt32j_period_certification(tinymt32j_t * tiny)
  * @param seed a 32-bit unsigned integer used as a seed.
  */
 inline static void
-tinymt32j_init_seed(tinymt32j_t *tiny, uint seed)
+tinymt32j_init_seed(TINYMT32J_THREAD tinymt32j_t *tiny, uint seed)
 {
     uint status[4];
     status[0] = seed;
@@ -256,11 +282,11 @@ tinymt32j_init_seed(tinymt32j_t *tiny, uint seed)
  * tinymt32j_calculate_jump_polynomial.
  */
 inline static void
-tinymt32j_jump_by_array(tinymt32j_t *tiny,
-			            const uint * jump_array)
+tinymt32j_jump_by_array(TINYMT32J_THREAD tinymt32j_t *tiny,
+			            TINYMT32J_CONSTANT uint * jump_array)
 {
     tinymt32j_t work_z;
-    tinymt32j_t *work = &work_z;
+    TINYMT32J_THREAD tinymt32j_t *work = &work_z;
     work->s0 = 0;
     work->s1 = 0;
     work->s2 = 0;
@@ -279,11 +305,17 @@ tinymt32j_jump_by_array(tinymt32j_t *tiny,
     *tiny = *work;
 }
 
+/**
+ * Initialize the stream with jump id gid: seed, then jump gid steps
+ * of 3<sup>40</sup> numbers ahead.
+ * @param tiny tinymt32j structure.
+ * @param seed a 32-bit unsigned integer used as a seed.
+ * @param gid jump id of the stream, the global id on the devices.
+ */
 inline static void
-tinymt32j_init_jump(tinymt32j_t *tiny, uint seed, uint gid)
+tinymt32j_init_jump(TINYMT32J_THREAD tinymt32j_t *tiny, uint seed, uint gid)
 {
     tinymt32j_init_seed(tiny, seed);
-    //size_t gid = tinymt_get_sequential_id();
     for (int i = 0; (gid != 0) && (i < TINYMT32_JUMP_TABLE_SIZE); i++) {
 	if ((gid & 1) != 0) {
 	    tinymt32j_jump_by_array(tiny, tinymt32_jump_table[i]);
@@ -0,0 +1,89 @@
+/* CPU topology: logical CPUs, physical cores and packages. */
+
+#ifndef __TOPOLOGY_H__
+#define __TOPOLOGY_H__
+
+#include <cstdio>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+
+#ifdef __APPLE__
+#include <sys/types.h>
+#include <sys/sysctl.h>
+#endif
+
+struct Topology
+{
+    int logical;                  // hardware threads
+    int physical;                 // cores, logical / physical is the SMT width
+    int packages;
+};
+
+inline static bool
+topology_read_int(const std::string& path, int& value)
+{
+    FILE* f = fopen(path.c_str(), "r");
+    if (!f)
+        return false;
+    bool ok = fscanf(f, "%d", &value) == 1;
+    fclose(f);
+    return ok;
+}
+
+/**
+ * Topology of the machine. On Linux the cores are the distinct
+ * (package, core) pairs of the online CPUs in /sys; elsewhere, or when
+ * /sys is not readable, every logical CPU counts as a core.
+ */
+inline static Topology
+detect_topology()
+{
+    Topology t;
+    t.logical = (int)std::thread::hardware_concurrency();
+    if (t.logical <= 0)
+        t.logical = 1;
+    t.physical = t.logical;
+    t.packages = 1;
+#if defined(__linux__)
+    std::set<std::pair<int, int> > cores;
+    std::set<int> packages;
+    int logical = 0;
+    for (int cpu = 0; cpu < 4096; cpu++)
+    {
+        std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+        int online = 1;
+        int package, core;
+        if (!topology_read_int(dir + "/topology/core_id", core))
+        {
+            if (cpu >= t.logical)
+                break;
+            continue;
+        }
+        topology_read_int(dir + "/online", online);  // missing for cpu0
+        if (!online || !topology_read_int(dir + "/topology/physical_package_id", package))
+            continue;
+        cores.insert(std::make_pair(package, core));
+        packages.insert(package);
+        logical++;
+    }
+    if (logical > 0)
+    {
+        t.logical = logical;
+        t.physical = (int)cores.size();
+        t.packages = (int)packages.size();
+    }
+#elif defined(__APPLE__)
+    int value = 0;
+    size_t size = sizeof(value);
+    if (sysctlbyname("hw.physicalcpu", &value, &size, NULL, 0) == 0 && value > 0)
+        t.physical = value;
+    size = sizeof(value);
+    if (sysctlbyname("hw.packages", &value, &size, NULL, 0) == 0 && value > 0)
+        t.packages = value;
+#endif
+    return t;
+}
+
+#endif /* EOF */
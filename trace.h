@@ -0,0 +1,269 @@
+/* Timeline of run phases in the Chrome trace-event format. */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#ifndef ENABLE_TRACE
+#define ENABLE_TRACE 1
+#endif
+
+#include <cstdint>
+#include <cstdio>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TRACE_TSC 1
+#elif defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#define TRACE_TSC 1
+#endif
+
+#define TRACE_BUFFER_SIZE (1 << 16)  // events kept per thread
+
+struct TraceEvent
+{
+    uint64_t ticks;
+    const char* name;      // static string
+    int64_t arg;           // < 0 for none
+    char phase;            // 'B', 'E' or 'i'
+};
+
+/**
+ * Events of one thread. Only that thread writes to it; when it is full
+ * the oldest events are overwritten.
+ */
+struct TraceBuffer
+{
+    std::string thread_name;
+    std::vector<TraceEvent> events;
+    size_t next;
+    bool wrapped;
+
+    TraceBuffer() : events(TRACE_BUFFER_SIZE), next(0), wrapped(false)
+    {
+    }
+};
+
+/**
+ * Process-wide tracer. Disabled, recording an event costs a test of
+ * enabled(); enabled, a time stamp and a store into the thread's buffer.
+ * The events are only formatted by write(), after the run.
+ */
+class Tracer
+{
+    bool enabled_;
+    uint64_t start_ticks_;
+    std::chrono::steady_clock::time_point start_time_;
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<TraceBuffer> > buffers_;
+    struct Complete
+    {
+        std::string track;
+        std::string name;
+        double ts_us;
+        double dur_us;
+    };
+    std::vector<Complete> completes_;
+
+    TraceBuffer* localBuffer()
+    {
+        static thread_local TraceBuffer* buffer = nullptr;
+        if (!buffer)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            buffers_.emplace_back(new TraceBuffer());
+            buffer = buffers_.back().get();
+        }
+        return buffer;
+    }
+    double ticksPerUs()
+    {
+        uint64_t ticks = now();
+        double us = std::chrono::duration<double, std::micro>(
+            std::chrono::steady_clock::now() - start_time_).count();
+        return us > 0 ? (ticks - start_ticks_) / us : 1;
+    }
+    // s as a JSON string literal, quotes included.
+    static std::string quote(const std::string& s)
+    {
+        std::string out = "\"";
+        for (char c : s)
+        {
+            if (c == '"' || c == '\\')
+            {
+                out += '\\';
+                out += c;
+            }
+            else if ((unsigned char)c < 0x20)
+            {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", (unsigned char)c);
+                out += buf;
+            }
+            else
+            {
+                out += c;
+            }
+        }
+        return out + "\"";
+    }
+public:
+    Tracer() : enabled_(false), start_ticks_(0)
+    {
+    }
+    static uint64_t now()
+    {
+#if TRACE_TSC
+        return __rdtsc();
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+    bool enabled() const
+    {
+        return enabled_;
+    }
+    // Start recording. Call before the threads to trace are started.
+    void enable()
+    {
+        start_ticks_ = now();
+        start_time_ = std::chrono::steady_clock::now();
+        enabled_ = true;
+    }
+    void add(char phase, const char* name, int64_t arg = -1)
+    {
+        TraceBuffer* b = localBuffer();
+        TraceEvent& e = b->events[b->next];
+        e.ticks = now();
+        e.name = name;
+        e.arg = arg;
+        e.phase = phase;
+        if (++b->next == b->events.size())
+        {
+            b->next = 0;
+            b->wrapped = true;
+        }
+    }
+    void setThreadName(const std::string& name)
+    {
+        localBuffer()->thread_name = name;
+    }
+    // Microseconds since enable(), to place events timed elsewhere.
+    double nowUs()
+    {
+        return std::chrono::duration<double, std::micro>(
+            std::chrono::steady_clock::now() - start_time_).count();
+    }
+    // An event timed elsewhere (e.g. by an OpenCL device), on its own track.
+    void addComplete(const std::string& track, const std::string& name, double ts_us, double dur_us)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Complete c = { track, name, ts_us, dur_us };
+        completes_.push_back(c);
+    }
+    // Write all events as trace-event JSON, for chrome://tracing or Perfetto.
+    bool write(const char* filename)
+    {
+        FILE* f = fopen(filename, "w");
+        if (!f)
+            return false;
+        std::lock_guard<std::mutex> lock(mutex_);
+        double scale = 1 / ticksPerUs();
+        fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+        fprintf(f, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"estimate_pi\"}}");
+        size_t tid = 0;
+        for (; tid < buffers_.size(); tid++)
+        {
+            const TraceBuffer& b = *buffers_[tid];
+            std::string name = b.thread_name.empty() ? "thread " + std::to_string(tid) : b.thread_name;
+            if (b.wrapped)
+                name += " (wrapped)";
+            fprintf(f, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"args\": {\"name\": %s}}",
+                (unsigned int)tid, quote(name).c_str());
+            size_t count = b.wrapped ? b.events.size() : b.next;
+            for (size_t i = 0; i < count; i++)
+            {
+                const TraceEvent& e = b.events[b.wrapped ? (b.next + i) % b.events.size() : i];
+                double ts = (int64_t)(e.ticks - start_ticks_) * scale;
+                fprintf(f, ",\n{\"name\": %s, \"ph\": \"%c\", \"ts\": %.3f, \"pid\": 1, \"tid\": %u",
+                    quote(e.name).c_str(), e.phase, ts, (unsigned int)tid);
+                if (e.phase == 'i')
+                    fprintf(f, ", \"s\": \"t\"");
+                if (e.arg >= 0)
+                    fprintf(f, ", \"args\": {\"arg\": %lld}", (long long)e.arg);
+                fprintf(f, "}");
+            }
+        }
+        std::vector<std::string> tracks;
+        for (const Complete& c : completes_)
+        {
+            size_t t = 0;
+            while (t < tracks.size() && tracks[t] != c.track)
+                t++;
+            if (t == tracks.size())
+            {
+                tracks.push_back(c.track);
+                fprintf(f, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"args\": {\"name\": %s}}",
+                    (unsigned int)(tid + t), quote(c.track).c_str());
+            }
+            fprintf(f, ",\n{\"name\": %s, \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %u}",
+                quote(c.name).c_str(), c.ts_us, c.dur_us, (unsigned int)(tid + t));
+        }
+        fprintf(f, "\n]}\n");
+        fclose(f);
+        return true;
+    }
+};
+
+inline Tracer& tracer()
+{
+    static Tracer t;
+    return t;
+}
+
+/**
+ * Records a begin event now and the matching end event when it goes
+ * out of scope.
+ */
+class TraceScope
+{
+    const char* name_;
+public:
+    TraceScope(const char* name, int64_t arg = -1) : name_(nullptr)
+    {
+        if (tracer().enabled())
+        {
+            name_ = name;
+            tracer().add('B', name, arg);
+        }
+    }
+    ~TraceScope()
+    {
+        if (name_)
+            tracer().add('E', name_);
+    }
+};
+
+#if ENABLE_TRACE
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(...) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(__VA_ARGS__)
+#define TRACE_BEGIN(name, arg) do { if (tracer().enabled()) tracer().add('B', name, arg); } while (0)
+#define TRACE_END(name) do { if (tracer().enabled()) tracer().add('E', name); } while (0)
+#define TRACE_INSTANT(name, arg) do { if (tracer().enabled()) tracer().add('i', name, arg); } while (0)
+#define TRACE_THREAD_NAME(name) do { if (tracer().enabled()) tracer().setThreadName(name); } while (0)
+#else
+#define TRACE_SCOPE(...) do { } while (0)
+#define TRACE_BEGIN(name, arg) do { } while (0)
+#define TRACE_END(name) do { } while (0)
+#define TRACE_INSTANT(name, arg) do { } while (0)
+#define TRACE_THREAD_NAME(name) do { } while (0)
+#endif
+
+#endif /* EOF */